@@ -22,7 +22,9 @@ function ApplianceTemperatureDial({
 
   const utils = trpc.useContext();
   trpc.appliance.onTemperatureUpdate.useSubscription(id, {
-    onData: (temperatures) => {
+    onData: ({ zone, ...temperatures }) => {
+      // The card shows the appliance's own reading, zone 0
+      if (zone !== 0) return;
       utils.appliance.get.setData({ ...appliance, ...temperatures });
       setTemp(temperatures);
     },
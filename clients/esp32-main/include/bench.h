@@ -0,0 +1,23 @@
+#ifndef BENCH
+#define BENCH
+
+#include <stdbool.h>
+
+#define BENCH_DEFAULT_ITERATIONS 200
+#define BENCH_MAX_ITERATIONS 1000
+#define BENCH_TRACED_ITERATIONS 8     // Run again under the heap tracer, kept apart so tracing doesn't skew the timings
+#define BENCH_TRACE_RECORDS 64
+#define BENCH_STACK 6144              // Each benchmark gets a fresh task of this size to measure its stack peak
+#define BENCH_NAME_LENGTH 16
+#define BENCH_BASELINE_KEY "BENCH_BASE"
+#define BENCH_REGRESSION_PERCENT 10   // p50 slower than the saved baseline by more than this is flagged
+
+// Registers the "bench" console command. It times the firmware's own hot paths with the CPU cycle counter, each at
+// the priority and on the core of the task that normally runs it, and compares the p50s against a baseline in NVS.
+extern void RegisterBench(void);
+// What the command runs: every benchmark, or only the one named, printing the table and optionally saving the p50s as
+// the baseline. Returns how many were slower than the baseline by more than BENCH_REGRESSION_PERCENT, -1 if one
+// couldn't run. Also the entry point of test/test_bench.
+extern int BenchRunAll(const char *only, int iterations, bool save);
+
+#endif
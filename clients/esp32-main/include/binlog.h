@@ -0,0 +1,55 @@
+#ifndef BINLOG
+#define BINLOG
+
+#include <stdint.h>
+
+#include "esp_log.h"
+
+// Deferred logging for hot paths. A call site stores the format string's address and its raw arguments in a per-core
+// ring, a few stores and no formatting, and BinlogDrainTask formats and prints them later at low priority. In raw mode
+// the drain writes the records out unformatted instead and tools/binlog_decode.py turns them back into text using the
+// firmware ELF, which holds every format string at the address the record carries.
+//
+// Arguments are stored as 32 bit words, so only integers, chars and pointers to string literals can be logged: a %s
+// must point at something that still exists when the drain gets to it, and %f isn't supported at all.
+#define BINLOG_BUFFER_LENGTH 64      // Records kept per core between drains, must be a power of two
+#define BINLOG_MAX_ARGS 4
+#define BINLOG_DRAIN_INTERVAL_MS 100
+#define BINLOG_LINE_LENGTH 160       // Longest formatted message, anything past it is cut off
+#define BINLOG_RAW_SYNC "\xa5\x5a"   // Starts every raw record so the decoder can pick them out of the console text
+
+extern esp_log_level_t BinlogLevel;  // Records above this level are skipped at the call site, per tag levels apply at the drain
+
+extern void SetupBinlog(void);
+extern void BinlogWrite(esp_log_level_t level, const char *tag, const char *format, int argCount, const uint32_t *args);
+
+static inline void BinlogCheckFormat(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static inline void BinlogCheckFormat(const char *format, ...) {}
+
+#define BINLOG_COUNT(...) BINLOG_COUNT_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define BINLOG_COUNT_(_0, _1, _2, _3, _4, count, ...) count
+#define BINLOG_CAT(a, b) BINLOG_CAT_(a, b)
+#define BINLOG_CAT_(a, b) a##b
+#define BINLOG_WORDS_0() 0
+#define BINLOG_WORDS_1(a) (uint32_t)(uintptr_t)(a)
+#define BINLOG_WORDS_2(a, b) BINLOG_WORDS_1(a), BINLOG_WORDS_1(b)
+#define BINLOG_WORDS_3(a, b, c) BINLOG_WORDS_1(a), BINLOG_WORDS_2(b, c)
+#define BINLOG_WORDS_4(a, b, c, d) BINLOG_WORDS_1(a), BINLOG_WORDS_3(b, c, d)
+
+// Same shape as ESP_LOG_LEVEL_LOCAL, the format is still checked against the arguments at compile time
+#define BINLOG_LEVEL(level, tag, format, ...)                                                                 \
+  do {                                                                                                        \
+    if (LOG_LOCAL_LEVEL >= (level) && BinlogLevel >= (level)) {                                               \
+      if (0) BinlogCheckFormat(format, ##__VA_ARGS__);                                                        \
+      const uint32_t binlogArgs[] = {BINLOG_CAT(BINLOG_WORDS_, BINLOG_COUNT(__VA_ARGS__))(__VA_ARGS__)};       \
+      BinlogWrite((level), (tag), (format), BINLOG_COUNT(__VA_ARGS__), binlogArgs);                           \
+    }                                                                                                         \
+  } while (0)
+
+#define BINLOGE(tag, format, ...) BINLOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define BINLOGW(tag, format, ...) BINLOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define BINLOGI(tag, format, ...) BINLOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define BINLOGD(tag, format, ...) BINLOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define BINLOGV(tag, format, ...) BINLOG_LEVEL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#endif
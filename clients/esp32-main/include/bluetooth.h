@@ -1,8 +1,42 @@
 #ifndef BLUETOOTH
 #define BLUETOOTH
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void SetupBluetooth(void);
+extern void BluetoothRequest(void);  // Starts BLE if needed and reopens the provisioning window, e.g. from a button
+extern void BluetoothRelease(void);  // Shuts BLE down straight away
+extern bool BluetoothIsRunning(void);
 #define BLE_DEVICE_NAME_KEY "BLE_NAME_KEY"
 #define BLE_DEVICE_NAME_DEFAULT "SafeEats"
 #define BLE_DEVICE_ID_KEY "BLE_ID_KEY"
+
+#define BLE_PROVISIONING_WINDOW_MS (5 * 60 * 1000)  // BLE stays up at least this long after boot or a request
+#define BLE_LIFECYCLE_RECHECK_MS 10000               // How often an expired window re-checks provisioning
+// Setting this hands the controller's static memory to the heap as well, after which BLE cannot restart until reboot
+#define BLE_RELEASE_CONTROLLER_MEMORY 0
+
+#define BLE_TELEMETRY_INTERVAL_MS 500
+#define BLE_RECIPE_TRANSFER_TIMEOUT_MS 2000  // Gap between writes after which a partial recipe is dropped
+#define BLE_TELEMETRY_VERSION 2
+// Connection interval requested once connected, in 1.25 ms units
+#define BLE_CONN_ITVL_MIN 12  // 15 ms
+#define BLE_CONN_ITVL_MAX 24  // 30 ms
+#define BLE_CONN_SUPERVISION_TIMEOUT 400  // 4 s in 10 ms units
+
+// Payload of the telemetry characteristic, little endian
+typedef struct __attribute__((packed)) BLETelemetry {
+  uint8_t version;
+  uint16_t sequence;
+  int16_t temperatureC;
+  int16_t temperatureF;
+  int16_t setpoint;
+  uint8_t temperatureUnit;  // 'C', 'F' or 0 when not cooking
+  uint32_t remainingSeconds;
+  uint8_t relays;  // RelayControllerFlags bits
+  uint8_t status;  // DeviceStatus bits
+  uint8_t zone;    // which zone the temperature and cook fields are for, added in version 2
+} BLETelemetry;
+
 #endif
@@ -0,0 +1,58 @@
+#ifndef BOOT
+#define BOOT
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum BootModule {
+  BOOT_FLASH,
+  BOOT_LCD,
+  BOOT_WIFI,
+  BOOT_SNTP,
+  BOOT_POWER,
+  BOOT_TEMP_SENSOR,
+  BOOT_QR_SCANNER,
+  BOOT_WEBSOCKET,
+  BOOT_RELAY,
+  BOOT_BUZZER,
+  BOOT_COOKING,
+  BOOT_DB_MANAGER,
+  BOOT_BLUETOOTH,
+  BOOT_PERF,
+  BOOT_SIMULATION,
+  BOOT_OTA,
+  BOOT_MODULE_COUNT,  // At most 23, one event group bit each and the last for BootRun finishing
+} BootModule;
+
+// Points after boot worth timing from power on, each is recorded the first time it is reached
+typedef enum BootMilestone {
+  BOOT_FIRST_TEMPERATURE,
+  BOOT_WIFI_CONNECTED,
+  BOOT_WEBSOCKET_READY,
+  BOOT_MILESTONE_COUNT,
+} BootMilestone;
+
+#define BOOT_DEP(module) (1UL << (module))
+// Longest BootRun waits for every module to report ready, steps still waiting on a dependency by then are skipped
+#define BOOT_TIMEOUT_MS 10000
+
+typedef struct BootStep {
+  BootModule module;
+  const char *name;
+  void (*setup)(void);
+  uint32_t dependsOn;  // BOOT_DEP bits that must be ready before setup runs
+  bool signalsReady;   // setup returns early and the module calls BootReady itself once it is usable
+} BootStep;
+
+// Runs every step as soon as its dependencies are ready, spread over BOOT_WORKERS tasks plus the caller
+extern void BootRun(const BootStep *steps, int count);
+extern void BootReady(BootModule module);
+// Waits up to waitMs for BootRun to finish, true if every module was set up and reported ready within BOOT_TIMEOUT_MS
+extern bool BootSucceeded(uint32_t waitMs);
+extern void BootMark(BootMilestone milestone);
+extern void BootReport(void);
+extern void RegisterBoot(void);
+// Brings the whole firmware up, app_main in the application and the first thing the on-target tests under test/ do
+extern void AppStart(void);
+
+#endif
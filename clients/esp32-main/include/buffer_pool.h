@@ -0,0 +1,42 @@
+#ifndef BUFFER_POOL
+#define BUFFER_POOL
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "memory_budget.h"
+
+#define BUFFER_POOL_MAX_POOLS 4
+
+// Fixed size blocks handed out by reference. Queues carry a pointer to the block, producers fill it in place and
+// every consumer releases it, the block goes back to the pool when the last reference is dropped.
+typedef struct BufferPool {
+  const char *name;
+  uint8_t *blocks;
+  size_t blockSize;
+  int count;
+  uint8_t *refs;
+  QueueHandle_t freeList;
+  int inUse;
+  int peakInUse;
+  uint32_t allocs;
+  uint32_t failures;  // allocations that timed out
+} BufferPool;
+
+// Declares the static storage BufferPoolCreate takes
+#define STATIC_BUFFER_POOL(name, count, type)                      \
+  static type name##Blocks[count] __attribute__((aligned(8)));    \
+  static uint8_t name##Refs[count];                                \
+  STATIC_QUEUE(name##FreeList, count, void *)
+
+extern void BufferPoolCreate(const char *module, BufferPool *pool, const char *name, void *blocks, size_t blockSize, int count,
+                             uint8_t *refs, uint8_t *freeListStorage, StaticQueue_t *freeListBuffer);
+// Returns a block holding one reference, or NULL if none came free within wait
+extern void *BufferAlloc(BufferPool *pool, TickType_t wait);
+extern void BufferRetain(void *block);
+extern void BufferRelease(void *block);
+// xQueueOverwrite for queues of blocks, the displaced block is released rather than leaked
+extern void BufferQueueOverwrite(QueueHandle_t queue, void *block);
+extern void RegisterBufferPool(void);
+
+#endif
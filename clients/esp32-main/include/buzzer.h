@@ -2,43 +2,61 @@
 #define BUZZER
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
 
 void SetupBuzzer(void);
-extern TaskHandle_t Buzzer;
-extern QueueHandle_t BuzzerQueue;
 
 // #define c 261
 // #define d 294
-// #define e 329
+#define e_NOTE 329
 // #define f 349
 // #define g 391
 // #define gS 415
 #define a_NOTE 440
 // #define aS 455
 #define b_NOTE 466
-// #define cH 523
+#define cH_NOTE 523
 // #define cSH 554
 // #define dH 587
 // #define dSH 622
-// #define eH 659
+#define eH_NOTE 659
 // #define fH 698
 // #define fSH 740
 // #define gH 784
 #define gSH_NOTE 830
 #define aH_NOTE 880
+#define REST 0
 
 #define BUZZER_PIN GPIO_NUM_23
 
 typedef struct BuzzerNote {
-  uint32_t freq;
+  uint32_t freq;  // REST for silence
   uint32_t duration;
-  uint32_t repeats;
 } BuzzerNote;
 
-extern BuzzerNote ThermalRunAwayAlarm;
-extern BuzzerNote MealStarted;
-extern BuzzerNote MealFinished;
-extern BuzzerNote EmergencyStop;
+// A pattern only interrupts a pattern of the same or lower priority
+typedef enum BuzzerPriority {
+  BUZZER_PRIORITY_INFO,
+  BUZZER_PRIORITY_WARNING,
+  BUZZER_PRIORITY_ALARM,
+  BUZZER_PRIORITY_EMERGENCY,
+} BuzzerPriority;
+
+typedef struct BuzzerPattern {
+  const char *name;
+  BuzzerPriority priority;
+  const BuzzerNote *notes;
+  uint32_t length;
+  uint32_t repeats;
+} BuzzerPattern;
+
+extern const BuzzerPattern ThermalRunAwayAlarm;
+extern const BuzzerPattern MealStarted;
+extern const BuzzerPattern MealFinished;
+extern const BuzzerPattern EmergencyStop;
+extern const BuzzerPattern ScanRejected;
+
+// Starts the pattern straight away if nothing more important is playing, never blocks on the pattern itself
+extern bool BuzzerPlay(const BuzzerPattern *pattern);
+extern void BuzzerStop(void);
 
 #endif
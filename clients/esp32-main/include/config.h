@@ -20,6 +20,10 @@ extern char APPLIANCE_TYPE[64];
 #define BOTTOM_HEATING_ELEMENT BIT2
 #define CONVECTION_FAN BIT3
 #define ROTISERRIE BIT4
+// Outputs of the extra zones on multi zone boards, see zone.h
+#define ZONE1_TOP_HEATING_ELEMENT BIT5
+#define ZONE1_BOTTOM_HEATING_ELEMENT BIT6
+#define ZONE2_HEATING_ELEMENT BIT7
 
 #define EMERGENCY_STOP BIT0
 #define WIFI_CONNECTED BIT1
@@ -1,4 +1,8 @@
 #ifndef CONSOLE
 #define CONSOLE
+#include "esp_console.h"
+
 void SetupConsole(void);
+// esp_console_cmd_register is not thread safe and modules now register from parallel boot workers
+esp_err_t ConsoleRegister(const esp_console_cmd_t *cmd);
 #endif
@@ -0,0 +1,14 @@
+#ifndef CONTROL_BENCH
+#define CONTROL_BENCH
+
+#define CONTROL_BENCH_PERIOD_MS 10             // One tick at CONFIG_FREERTOS_HZ 100
+#define CONTROL_BENCH_DEFAULT_SECONDS 10
+#define CONTROL_BENCH_FLOOD_PORT 9             // UDP discard
+#define CONTROL_BENCH_FLOOD_PAYLOAD 1024
+
+// Registers the "control_bench" console command. It runs a probe at the control loop's priority and core that wakes
+// every CONTROL_BENCH_PERIOD_MS and records how late each wake up is, optionally while a UDP flood saturates the
+// network stack. Passing --unpinned lets the probe and flood float across cores like tasks did before the placement plan.
+extern void RegisterControlBench(void);
+
+#endif
@@ -2,11 +2,25 @@
 #define COOKING_CONTROLLER
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include <freertos/queue.h>
 
-extern QueueHandle_t RecipeQueue;
+#include "buffer_pool.h"
+#include "relay_accounting.h"
+#include "temperature_sensor.h"
+#include "zone.h"
+
+extern BufferPool RecipePool;
+// Signalled with an empty item whenever a zone starts or finishes. Several changes before it is read coalesce into one
+// signal, so readers compare CookingState.edges against the count they last handled rather than the cooking state.
+extern QueueHandle_t CookingStatusQueue;
 void SetupCookingController(void);
 
+#define COOKING_CONTROL_PERIOD_MS 1000  // Matches the sensor rate while cooking
+#define COOKING_REST_MS 5000            // A zone shows "Done" this long before it takes the next recipe
+#define COOKING_SENSOR_STALE_PERIODS 10 // A zone whose reading is stale or faulted for this many periods stops cooking
+#define RECIPE_POOL_SIZE (ZONE_COUNT * 2 + 1)  // One cooking and one queued to replace it per zone, and one being decoded
+
 typedef struct Recipe {
   char applianceMode[64];
   int temperature;
@@ -15,6 +29,31 @@ typedef struct Recipe {
   double cookingTime;
   double expiryDate;
   char id[256];
+  int zone;
 } Recipe;
 
+typedef struct CookingState {
+  int setpoint;
+  char temperatureUnit;  // 'C' or 'F', 0 when not cooking
+  int32_t remainingSeconds;
+  uint32_t edges;  // Starts and finishes since boot, they alternate so it is odd while cooking
+} CookingState;
+
+// What the zone's relays did over its last finished cook, captured when it finished
+typedef struct CookUsage {
+  uint32_t edge;  // CookingState.edges of the finish it belongs to
+  int count;
+  RelayUsage relays[ZONE_MAX_RELAYS];
+} CookUsage;
+
+extern void CookingControllerGetState(int zone, CookingState *state);
+extern void CookingControllerLastCook(int zone, CookUsage *usage);
+// Queues a Recipe from RecipePool for recipe->zone and wakes the controller, which releases it once the cook is over.
+// False if the zone still had one waiting after wait, the caller keeps the recipe then.
+extern bool CookingControllerSubmit(Recipe *recipe, TickType_t wait);
+// First zone that isn't cooking or about to, where a scanned recipe goes. -1 when they're all busy.
+extern int CookingControllerIdleZone(void);
+// One pass of the control loop, switches the elements in heatElementMask when the reading is outside the band
+extern void CookingControlStep(const Recipe *recipe, const Temperature *reading, EventBits_t heatElementMask);
+
 #endif
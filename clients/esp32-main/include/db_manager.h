@@ -2,13 +2,31 @@
 #define DB_MANAGER
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+
+#include "cooking_controller.h"
+#include "json_arena.h"
+#include "websocket.h"
+
+#define STATUS_MESSAGE_QUEUE_LENGTH 3
+#define DB_MANAGER_RETRY_MS 100  // How often messages waiting on a full WebsocketQueue are retried
+
+// One task, DBManagerTask, serializes everything the appliance tells the server and every recipe it decodes. It waits
+// on a queue set of TempSensorQueue, StatusMessageQueue, QRCodeQueue, CookingStatusQueue and the recipe queue and runs
+// the handler for whichever has an item.
 extern void SetupDBManager(void);
+extern TaskHandle_t DBManager;
 extern QueueHandle_t StatusMessageQueue;
-extern QueueHandle_t DecodeRecipeQueue;
+// Queues a recipe document from JSONStringPool for decoding and takes ownership of it, dropped if the queue is full
+extern void DBManagerDecodeRecipe(JSONString *json);
 
 typedef struct StatusMessage {
   char *type;
   char *message;
+  int zone;
 } StatusMessage;
 
+// Parses a recipe pushed over the websocket or BLE into recipe and copies its display name, false if it is malformed.
+// A recipe without a zone is for zone 0.
+extern bool RecipeDecode(JsonArena *arena, const JSONString *json, Recipe *recipe, char *name, size_t nameSize);
+
 #endif
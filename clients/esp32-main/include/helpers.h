@@ -1,5 +1,7 @@
 #ifndef HELPERS
 #define HELPERS
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #define NELEMS(x) (sizeof(x) / sizeof((x)[0]))
@@ -18,6 +20,11 @@
 
 #define RESET_STRING_BUF(x) (memset(x, 0, sizeof(x)))
 
+#define UUID_STRING_LENGTH 36  // 8-4-4-4-12 hex digits
+#define UUID_BYTES 16
+
 void GetUniqueID(char *str);
+bool UUIDParse(const char *str, size_t length, uint8_t *uuid);
+void UUIDFormat(const uint8_t *uuid, char *str);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef JSON_ARENA
+#define JSON_ARENA
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Thread local storage slot holding the calling task's open arena, slot 0 belongs to pthread
+#define JSON_ARENA_TLS_INDEX 1
+#define JSON_ARENA_ALIGN 8  // cJSON nodes hold a double
+
+typedef struct JsonArena {
+  const char *name;
+  uint8_t *buffer;
+  size_t size;
+  size_t used;
+  size_t highWater;
+  uint32_t scopes;
+  uint32_t fallbacks;          // allocations that did not fit and went to the heap
+  struct JsonArena *previous;  // arena that was open when this scope began
+  struct JsonArena *next;      // every arena that has been used, for the console
+} JsonArena;
+
+// Declares a static arena of the given size for one call site or task
+#define STATIC_JSON_ARENA(arenaName, arenaSize)                                           \
+  static uint8_t arenaName##Buffer[arenaSize] __attribute__((aligned(JSON_ARENA_ALIGN))); \
+  static JsonArena arenaName = {.name = #arenaName, .buffer = arenaName##Buffer, .size = arenaSize}
+
+// Every cJSON allocation the calling task makes until JsonArenaEnd comes from the arena. Nothing allocated inside the
+// scope may outlive it, build, print and delete the whole message between the two calls.
+extern void JsonArenaBegin(JsonArena *arena);
+// Releases everything allocated in the scope at once
+extern void JsonArenaEnd(JsonArena *arena);
+// cJSON allocations since boot that went to the heap, outside any arena or past the end of one
+extern uint32_t JsonHeapAllocations(void);
+extern void SetupJsonArena(void);
+
+#endif
@@ -1,14 +1,36 @@
 #ifndef LCD
 #define LCD
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
+#include <freertos/task.h>
 void SetupLCD(void);
-extern QueueHandle_t LCDQueue;
+extern TaskHandle_t LCDRenderer;
 
-typedef struct LCDMessage {
-  char text[20];
-  int row;
-  int col;
-} LCDMessage;
+#define LCD_ROWS 4
+#define LCD_COLS 20
+#define LCD_FRAME_RATE_HZ 4  // Upper bound on redraws, updates in between are coalesced into the next frame
+
+typedef enum LCDField {
+  LCD_FIELD_DEVICE_NAME,
+  LCD_FIELD_STATUS,
+  LCD_FIELD_TEMPERATURE,
+  LCD_FIELD_TIME_REMAINING,
+  LCD_FIELD_RECIPE_NAME,
+  LCD_FIELD_COUNT,
+} LCDField;
+
+typedef struct LCDStats {
+  uint32_t frames;
+  uint32_t transactions;
+  uint32_t busBytes;        // bytes clocked onto the I2C bus including the address byte
+  uint32_t legacyBusBytes;  // what the per character path would have sent for the same updates
+  uint32_t coalescedUpdates;
+  uint32_t lastRenderUs;
+  uint32_t maxRenderUs;
+  uint64_t totalRenderUs;
+} LCDStats;
+
+// Never blocks, safe to call from any task. An empty string blanks the field.
+extern void LCDSetField(LCDField field, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+extern void LCDGetStats(LCDStats *stats);
 
 #endif
@@ -0,0 +1,45 @@
+#ifndef MEMORY_BUDGET
+#define MEMORY_BUDGET
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#define BUDGET_MAX_ENTRIES 48
+
+// Declares the static storage the Budget* constructors below take
+#define STATIC_TASK(name, stack) \
+  static StackType_t name##Stack[stack]; \
+  static StaticTask_t name##TCB
+#define STATIC_QUEUE(name, length, type) \
+  static uint8_t name##Storage[(length) * sizeof(type)]; \
+  static StaticQueue_t name##Buffer
+
+typedef enum BudgetKind {
+  BUDGET_TASK,
+  BUDGET_QUEUE,
+  BUDGET_EVENT_GROUP,
+  BUDGET_TIMER,
+  BUDGET_MUTEX,
+  BUDGET_BUFFERS,
+} BudgetKind;
+
+// Static counterparts of xTaskCreate and friends that also record the RAM they pin in the budget table
+extern TaskHandle_t BudgetCreateTask(const char *module, TaskFunction_t function, const char *name, uint32_t stackDepth, void *params,
+                                     UBaseType_t priority, BaseType_t core, StackType_t *stack, StaticTask_t *tcb);
+extern QueueHandle_t BudgetCreateQueue(const char *module, const char *name, UBaseType_t length, UBaseType_t itemSize, uint8_t *storage,
+                                       StaticQueue_t *buffer);
+extern EventGroupHandle_t BudgetCreateEventGroup(const char *module, const char *name, StaticEventGroup_t *buffer);
+extern TimerHandle_t BudgetCreateTimer(const char *module, const char *name, TickType_t period, UBaseType_t autoReload,
+                                       TimerCallbackFunction_t callback, StaticTimer_t *buffer);
+extern SemaphoreHandle_t BudgetCreateMutex(const char *module, const char *name, StaticSemaphore_t *buffer);
+// For static storage that is not a FreeRTOS object, such as buffer pool blocks
+extern void BudgetAddBuffers(const char *module, const char *name, size_t bytes);
+
+extern void BudgetReport(void);
+extern void RegisterBudget(void);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef OTA
+#define OTA
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Delta patch format, built by tools/ota_delta.py. Integers are little endian.
+//   header  "SEDP", version u8, source digest[32], target sha256[32], target size u32
+//   ops     0x01 COPY offset u32, length u32   bytes taken from the running image
+//           0x02 DATA length u32, bytes        bytes carried in the patch
+//           0x00 END
+// The source digest is the SHA-256 esptool appends to every image, so it is what esp_partition_get_sha256 reports
+// for the running slot. The target hash covers the whole new image file.
+#define OTA_PATCH_MAGIC "SEDP"
+#define OTA_PATCH_VERSION 1
+#define OTA_HASH_LENGTH 32
+#define OTA_HEADER_LENGTH (4 + 1 + OTA_HASH_LENGTH * 2 + 4)
+
+#define OTA_CHUNK_LENGTH 1024          // HTTP reads and copies from the running image go through buffers this size
+#define OTA_HTTP_TIMEOUT_MS 10000
+#define OTA_REBOOT_DELAY_MS 2000       // Lets the console and log output drain before restarting into the new image
+#define OTA_VERIFY_TIMEOUT_MS 60000    // A new image without a fault free reading on every zone by now is rolled back
+#define OTA_VERIFY_POLL_MS 1000
+#define OTA_CONNECT_TIMEOUT_MS 600000  // Only logged, a new image that passed its self checks is kept whatever the network does
+#define OTA_URL_LENGTH 256
+
+typedef enum OtaOp {
+  OTA_OP_END,
+  OTA_OP_COPY,
+  OTA_OP_DATA,
+} OtaOp;
+
+typedef struct OtaStats {
+  bool running;
+  bool patch;           // the last update was a delta rather than a full image
+  uint32_t downloaded;  // bytes fetched
+  uint32_t written;     // image bytes written to the update slot
+  uint32_t copied;      // of those, bytes taken from the running image
+  uint32_t durationMs;
+  esp_err_t result;     // ESP_OK once an update has been written and verified
+} OtaStats;
+
+extern void SetupOta(void);
+// Streams url into the other slot in the background and reboots into it once verified. A body starting with
+// OTA_PATCH_MAGIC is applied as a patch against the running image, anything else is taken as a full image.
+extern esp_err_t OtaStart(const char *url);
+extern void OtaGetStats(OtaStats *stats);
+
+#endif
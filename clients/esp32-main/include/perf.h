@@ -0,0 +1,33 @@
+#ifndef PERF
+#define PERF
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#define PERF_WINDOW_MS 5000  // CPU usage is reported over the last window of this length
+#define PERF_MAX_TASKS 32
+#define PERF_MAX_QUEUES 12
+#define PERF_DIAGNOSTICS_INTERVAL_MS 60000  // How often a diagnostics message goes out over the websocket
+// The diagnostics message has to fit a JSONString, SetupPerf checks the worst case of these. Queue names are cut to
+// the length of a task name and BufferPool free lists are left out, the perf command still shows them in full.
+#define PERF_DIAGNOSTICS_TASKS 6   // Busiest tasks
+#define PERF_DIAGNOSTICS_QUEUES 8  // First queues tracked, every queue of a two zone board
+
+typedef struct PerfQueueStats {
+  const char *name;
+  UBaseType_t depth;
+  UBaseType_t peak;
+  UBaseType_t length;
+  uint32_t sends;
+  uint32_t failed;  // sends that found the queue still full after their wait, the item was not queued
+  bool hidden;  // left out of the diagnostics message
+} PerfQueueStats;
+
+extern void SetupPerf(void);
+extern void PerfTrackQueue(const char *name, QueueHandle_t queue, UBaseType_t length);
+// Keeps a tracked queue out of the diagnostics message, for BufferPool free lists
+extern void PerfHideQueue(QueueHandle_t queue);
+// xQueueSend that counts the sends that failed and records the queue's peak depth
+extern BaseType_t PerfQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef POWER
+#define POWER
+
+#include <stdbool.h>
+
+#define POWER_MAX_FREQ_MHZ CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define POWER_IDLE_MIN_FREQ_MHZ 40     // XTAL, only reached between cooks
+#define POWER_COOKING_MIN_FREQ_MHZ 80  // Keeps APB at 80 MHz so peripherals never see a clock switch mid cook
+// Automatic light sleep while IS_COOKING is clear. The scanner holds POWER_LOCK_SCANNER while any zone can take a
+// recipe, so in practice it only sleeps while every zone has one waiting.
+#define POWER_IDLE_LIGHT_SLEEP 1
+// Beacons between modem wake ups while idle, ~1 s with the usual 102.4 ms beacon interval
+#define POWER_IDLE_LISTEN_INTERVAL 10
+
+typedef enum PowerLock {
+  POWER_LOCK_CONTROL,  // one iteration of the cooking control loop
+  POWER_LOCK_SENSOR,   // a temperature sensor SPI transaction
+  POWER_LOCK_NETWORK,  // serialising and sending a websocket message
+  POWER_LOCK_BUZZER,   // LEDC stops in light sleep and follows APB, held while a pattern plays
+  POWER_LOCK_SCANNER,  // UART receive stops in light sleep, held while a scan is wanted and after scanner activity
+  POWER_LOCK_COUNT,
+} PowerLock;
+
+extern void SetupPower(void);
+// Both are no-ops when CONFIG_PM_ENABLE is off
+extern void PowerAcquire(PowerLock lock);
+extern void PowerRelease(PowerLock lock);
+// Switches between the cooking and idle policies, called where IS_COOKING changes
+extern void PowerSetCooking(bool cooking);
+
+#endif
@@ -3,13 +3,38 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
+#include "helpers.h"
+
 void SetupQRScanner(void);
 extern QueueHandle_t QRCodeQueue;
 
 #define QR_CODE_LENGTH 1024
+#define QR_TERMINATOR '\r'       // Line terminator the scanner appends to every code
+#define QR_DEDUP_TTL_MS 5000     // A code is ignored until it has been out of view for this long
+#define QR_RECENT_SCANS 16        // Slots in the recent scan set, must be a power of two
+#define QR_AWAKE_MS 10000         // Light sleep drops the bytes that wake the UART, stay awake this long after any traffic
+#define QR_CODE_QUEUE_LENGTH 4
+#define QR_UART_EVENT_QUEUE_LENGTH 20
+#define QR_PATTERN_QUEUE_LENGTH 8
 #define UART_BAUD 9600
 #define UART_TXD GPIO_NUM_10
 #define UART_RXD GPIO_NUM_9
 #define UART_PORT UART_NUM_1
 
+typedef struct QRCode {
+  uint8_t uuid[UUID_BYTES];
+} QRCode;
+
+typedef struct QRScannerStats {
+  uint32_t frames;
+  uint32_t accepted;
+  uint32_t rejected;
+  uint32_t duplicates;
+  uint32_t overflows;
+  uint32_t lastLatencyUs;  // terminator detected to enqueue
+  uint32_t maxLatencyUs;
+} QRScannerStats;
+
+extern void QRScannerGetStats(QRScannerStats *stats);
+
 #endif
@@ -0,0 +1,47 @@
+#ifndef RELAY_ACCOUNTING
+#define RELAY_ACCOUNTING
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Wear and energy bookkeeping for the relay outputs. Every write the relay controller makes goes through
+// RelayAccountingSet, which keeps per channel on-time and switching cycles (off to on edges) over the device's
+// lifetime and over each zone's last cook. Energy is on-time times the element's nameplate wattage.
+//
+// The lifetime counters are one NVS blob, written when they changed since the last checkpoint: every
+// RELAY_CHECKPOINT_INTERVAL_MS while cooking and once all zones have finished. A power cut loses at most one interval.
+#define RELAY_MAX_CHANNELS 8  // One per RelayControllerFlags relay bit
+#define RELAY_CHECKPOINT_INTERVAL_MS (15 * 60 * 1000)
+#define RELAY_ACCOUNTING_KEY "RELAY_ACCT"
+#define RELAY_ACCOUNTING_VERSION 1
+
+// Nameplate power per output, indexed like RelayDevices
+#define INDICATOR_LIGHT_WATTS 1
+#define TOP_HEATING_ELEMENT_WATTS 800
+#define BOTTOM_HEATING_ELEMENT_WATTS 1000
+#define CONVECTION_FAN_WATTS 25
+#define ROTISERRIE_WATTS 5
+#define ZONE1_TOP_HEATING_ELEMENT_WATTS 600
+#define ZONE1_BOTTOM_HEATING_ELEMENT_WATTS 600
+#define ZONE2_HEATING_ELEMENT_WATTS 1200
+
+typedef struct RelayUsage {
+  int channel;
+  uint32_t onSeconds;
+  uint32_t cycles;
+  float energyWh;
+  uint32_t lifetimeCycles;
+  float lifetimeHours;
+} RelayUsage;
+
+extern void SetupRelayAccounting(void);
+// Called by the relay controller for every GPIO write, only level changes are counted
+extern void RelayAccountingSet(int channel, int level);
+// Starts and stops the per cook counters of the zone's channels, from the cooking controller. CookEnd fills usage with
+// what each channel did over the cook and its lifetime wear as of now, and returns how many entries it wrote.
+extern void RelayAccountingCookStart(int zone);
+extern int RelayAccountingCookEnd(int zone, RelayUsage *usage, int max);
+// Has RelayCheckpointTask write the lifetime counters to NVS if they changed since the last write, doesn't block
+extern void RelayAccountingRequestCheckpoint(void);
+
+#endif
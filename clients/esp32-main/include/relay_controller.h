@@ -7,11 +7,19 @@
 void SetupRelayController(void);
 extern TaskHandle_t RelayController;
 extern EventGroupHandle_t RelayControllerFlags;
+// Tags the current RelayControllerFlags with the trace seq of the sample that decided them
+extern void RelayControllerSetCause(uint32_t seq);
 
 #define INDICATOR_LIGHT_PIN GPIO_NUM_27
 #define TOP_HEATING_ELEMENT_PIN GPIO_NUM_33
 #define BOTTOM_HEATING_ELEMENT_PIN GPIO_NUM_32
 #define CONVECTION_FAN_PIN GPIO_NUM_26
 #define ROTISERRIE_PIN GPIO_NUM_25
+// The pico32 has no other free output pins for zones 1 and 2. GPIO13 and GPIO14 are JTAG TCK and TMS, so
+// multi-zone builds can't use esp-prog. GPIO2 is a strapping pin and must stay low at reset for the download mode to
+// work, so the zone 2 relay driver needs a pull-down, not a pull-up, and its relay is off at reset.
+#define ZONE1_TOP_HEATING_ELEMENT_PIN GPIO_NUM_13
+#define ZONE1_BOTTOM_HEATING_ELEMENT_PIN GPIO_NUM_14
+#define ZONE2_HEATING_ELEMENT_PIN GPIO_NUM_2
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef SENSOR_BUS
+#define SENSOR_BUS
+
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+
+// Owns VSPI_HOST and the MAX6675 thermocouple amplifiers on it, one channel per chip select. A sweep queues a DMA
+// transaction for every channel up front and then collects the results, so the driver clocks the channels out back to
+// back from its interrupt instead of the caller blocking on each device in turn.
+#define SENSOR_BUS_HOST VSPI_HOST
+#define SENSOR_BUS_MAX_CHANNELS 3              // VSPI hardware chip selects
+#define SENSOR_BUS_CLOCK_HZ (2 * 1000 * 1000)  // MAX6675 tops out at 4.3 MHz
+#define SENSOR_BUS_FRAME_LEN 16                // bits per MAX6675 read
+#define SENSOR_BUS_TIMEOUT_MS 10               // A sweep takes well under a millisecond, past this the bus is stuck
+
+// Per channel fault bits, a reading with any of them set has no temperature
+#define SENSOR_FAULT_OPEN BIT0     // The MAX6675 reports an open thermocouple, bit 2 of the frame
+#define SENSOR_FAULT_MISSING BIT1  // All zeros, or the sign or device ID bit set, nothing is driving MISO
+#define SENSOR_FAULT_BUS BIT2      // The transaction couldn't be queued or didn't complete in time
+
+typedef struct SensorReading {
+  float c;
+  uint8_t faults;
+} SensorReading;
+
+extern void SetupSensorBus(void);
+// Adds a MAX6675 on chip select cs, channels are numbered in the order they're added. -1 once the bus is full.
+extern int SensorBusAddChannel(int cs);
+extern int SensorBusChannelCount(void);
+// Reads every channel, readings has room for SensorBusChannelCount() entries
+extern void SensorBusSweep(SensorReading *readings);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PLANT_SIMULATION
+#define PLANT_SIMULATION
+
+#include <freertos/FreeRTOS.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "zone.h"
+
+// The control and sensor periods are delays of SIM_PERIOD_MS / timeScale real ms, so timeScale has to divide the
+// period's ticks exactly or a period runs short or long in simulated time. At CONFIG_FREERTOS_HZ 100 that is 1, 2, 4,
+// 5, 10, 20, 25, 50 or 100.
+#ifndef SIM_DEFAULT_TIME_SCALE
+#define SIM_DEFAULT_TIME_SCALE 50  // A 30 minute cook takes 36 s
+#endif
+#define SIM_PERIOD_MS 1000         // COOKING_CONTROL_PERIOD_MS and the sensor period
+#define SIM_MAX_TIME_SCALE 100     // The period is one tick
+#define SIM_STEP_MS 10             // Real time between plant model steps
+#define SIM_BAND_C 5               // Matches the cooking controller's dead band
+
+// Lumped model of a toaster oven cavity, one temperature heated by the elements and losing heat through the walls.
+// Every zone is its own cavity with the same model.
+#define SIM_DEFAULT_AMBIENT_C 22.0f
+#define SIM_DEFAULT_HEAT_CAPACITY 8000.0f  // J/C, cavity, racks and air
+#define SIM_DEFAULT_ELEMENT_WATTS 800.0f   // Each of the top and bottom elements
+#define SIM_DEFAULT_LOSS_W_PER_C 4.0f      // Through the walls to ambient
+#define SIM_DEFAULT_FAN_LOSS_FACTOR 1.5f   // The convection fan moves more heat to the walls
+
+typedef struct SimulationModel {
+  float ambientC;
+  float heatCapacity;
+  float elementWatts;
+  float lossWattsPerC;
+  float fanLossFactor;
+} SimulationModel;
+
+typedef struct SimulationStats {
+  float temperatureC[ZONE_COUNT];
+  double simulatedSeconds;
+  uint32_t timeScale;
+  // Summed over the zones, two zones cooking for 1 s count 2
+  double cookingSeconds;
+  double inBandSeconds;      // Within SIM_BAND_C of the setpoint while cooking
+  double heatingSeconds;     // Element seconds, both elements on for 1 s counts 2
+  float maxOvershootC;       // Above the setpoint while cooking, in any zone
+  uint32_t relayEdges;
+  uint32_t qrScansReplayed;
+} SimulationStats;
+
+#ifdef SIMULATION
+// Simulation build, see [env:simulation] in platformio.ini. The MAX6675 reads come from the plant model, the relay
+// outputs drive it, QR scans are replayed through the scanner UART in loopback and the cooking clock runs
+// timeScale times faster than real time.
+extern void SetupSimulation(void);
+extern uint16_t SimulationSensorFrame(int zone);  // What the zone's MAX6675 would have clocked into rx_data
+extern void SimulationSetRelay(int index, int level);
+extern void SimulationGetStats(SimulationStats *stats);
+extern time_t SimulationNow(void);
+// Real ticks of ms simulated, ms is a multiple of SIM_PERIOD_MS
+extern TickType_t SimulationTicks(uint32_t ms);
+#define SIM_TIME() SimulationNow()
+#define SIM_TICKS(ms) SimulationTicks(ms)
+#else
+#define SIM_TIME() time(NULL)
+#define SIM_TICKS(ms) pdMS_TO_TICKS(ms)
+#endif
+
+#endif
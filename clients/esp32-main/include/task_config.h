@@ -0,0 +1,68 @@
+#ifndef TASK_CONFIG
+#define TASK_CONFIG
+
+#include <freertos/FreeRTOS.h>
+
+// Stack depths in bytes. Each is the deepest path through the task (locals, logging and library calls) plus
+// TASK_STACK_MARGIN, check them against the high water marks printed by the "budget" command after changes.
+// Only shrink one below the size it had before these were static with a "budget" peak from a device that has
+// cooked, run a BLE transfer and kept the websocket busy.
+#define TASK_STACK_MARGIN 512
+
+#define LCD_RENDERER_STACK (1536 + TASK_STACK_MARGIN)
+#define COOKING_CONTROLLER_STACK (1536 + TASK_STACK_MARGIN)
+#define RELAY_CONTROLLER_STACK (1536 + TASK_STACK_MARGIN)
+#define TEMP_SENSOR_STACK (1536 + TASK_STACK_MARGIN)
+#define QR_SCANNER_STACK (1536 + TASK_STACK_MARGIN)
+// Messages, recipes and JSON documents live in the buffer pools, tasks only hold pointers to them
+#define DB_MANAGER_STACK (3584 + TASK_STACK_MARGIN)   // cJSON parsing a recipe is the deepest handler
+#define WEBSOCKET_STACK (3584 + TASK_STACK_MARGIN)    // cJSON printing into the static frame
+#define DEFINED_IN_DB_STACK (3584 + TASK_STACK_MARGIN)
+#define BLUETOOTH_LIFECYCLE_STACK (2560 + TASK_STACK_MARGIN)  // Runs the NimBLE init and deinit
+#define BOOT_WORKER_STACK 4096  // Runs module setup, Wi-Fi init is the deepest. From the heap and freed after boot.
+#define PERF_STACK (2560 + TASK_STACK_MARGIN)                 // Builds the diagnostics cJSON tree
+#define SIMULATION_STACK (1536 + TASK_STACK_MARGIN)           // Simulation builds only
+#define OTA_STACK (6144 + TASK_STACK_MARGIN)       // TLS handshake, from the heap and only while an update runs
+#define OTA_VERIFY_STACK (1536 + TASK_STACK_MARGIN)  // Only runs on the first boot of a new image
+#define BINLOG_DRAIN_STACK (2048 + TASK_STACK_MARGIN)  // Formats deferred log records
+#define RELAY_CHECKPOINT_STACK (2560 + TASK_STACK_MARGIN)  // NVS blob write, needed 3072 bytes when it ran on the timer task
+// From the heap and only while "control_bench" runs
+#define CONTROL_BENCH_PROBE_STACK (1536 + TASK_STACK_MARGIN)
+#define CONTROL_BENCH_FLOOD_STACK (2560 + TASK_STACK_MARGIN)  // LwIP sendto
+
+// Placement plan. Sensing, control and relay output own APP_CPU so nothing on the network side can delay them.
+// Wi-Fi (23), LwIP (18), NimBLE host, esp_timer and the websocket client all live on PRO_CPU with the tasks
+// that feed them. Higher number wins within a core.
+#define RELAY_CONTROLLER_PRIORITY 7  // Last word on the heating elements
+#define RELAY_CONTROLLER_CORE APP_CPU_NUM
+#define COOKING_CONTROLLER_PRIORITY 6
+#define COOKING_CONTROLLER_CORE APP_CPU_NUM
+#define TEMP_SENSOR_PRIORITY 5
+#define TEMP_SENSOR_CORE APP_CPU_NUM
+#define QR_SCANNER_PRIORITY 3
+#define QR_SCANNER_CORE APP_CPU_NUM
+#define LCD_RENDERER_PRIORITY 2
+#define LCD_RENDERER_CORE APP_CPU_NUM
+
+#define WEBSOCKET_PRIORITY 4
+#define WEBSOCKET_CORE PRO_CPU_NUM
+#define DEFINED_IN_DB_PRIORITY 3
+#define DEFINED_IN_DB_CORE PRO_CPU_NUM
+#define DB_MANAGER_PRIORITY 3
+#define DB_MANAGER_CORE PRO_CPU_NUM
+#define BLUETOOTH_LIFECYCLE_PRIORITY 2
+#define BLUETOOTH_LIFECYCLE_CORE PRO_CPU_NUM
+#define SIMULATION_PRIORITY 5  // Stands in for physics, it shouldn't fall behind the network tasks it shares a core with
+#define SIMULATION_CORE PRO_CPU_NUM
+#define BINLOG_DRAIN_PRIORITY 1  // Log output waits on everything else
+#define BINLOG_DRAIN_CORE PRO_CPU_NUM
+#define RELAY_CHECKPOINT_PRIORITY 1  // Flash writes stall the cache, keep them behind everything that has a deadline
+#define RELAY_CHECKPOINT_CORE PRO_CPU_NUM
+#define OTA_PRIORITY 1
+#define OTA_CORE PRO_CPU_NUM
+#define PERF_PRIORITY 1
+#define BOOT_WORKERS 2  // Plus the main task
+#define BOOT_WORKER_PRIORITY 1
+#define PERF_CORE PRO_CPU_NUM
+
+#endif
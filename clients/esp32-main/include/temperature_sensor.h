@@ -5,16 +5,23 @@
 #include <freertos/queue.h>
 
 extern void SetupTempSensor(void);
-extern QueueHandle_t TempSensorQueue;
+extern QueueHandle_t TempSensorQueue;  // Each zone's readings in turn, ZONE_COUNT deep
 extern TaskHandle_t TempSensor;
 
 #define SPI_CLK GPIO_NUM_18
 #define SPI_MISO GPIO_NUM_19
 #define TEMP_SENSOR_CS GPIO_NUM_5
-#define TEMP_SENSOR_DATA_LEN 16
+#define ZONE1_TEMP_SENSOR_CS GPIO_NUM_4
+// GPIO15 is JTAG TDO and a strapping pin. A chip select idles high, which matches its reset pull-up.
+#define ZONE2_TEMP_SENSOR_CS GPIO_NUM_15
 typedef struct Temperature {
   int c;  // celcius
   int f;  // farenheit
+  uint32_t seq;  // trace sequence number of the read
+  uint8_t zone;
+  uint8_t faults;  // SENSOR_FAULT_* bits, c and f are 0 when any is set
 } Temperature;
 
+extern void TempSensorGetLatest(int zone, Temperature *temp);
+
 #endif
@@ -0,0 +1,25 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdint.h>
+
+// Points along a temperature sample's path, every later point is measured against TRACE_SENSOR_READ with the same seq
+typedef enum TracePoint {
+  TRACE_SENSOR_READ,
+  TRACE_CONTROL_DECISION,
+  TRACE_RELAY_EDGE,
+  TRACE_TEMPERATURE_ENQUEUE,
+  TRACE_WEBSOCKET_SEND,
+  TRACE_POINT_COUNT,
+} TracePoint;
+
+#define TRACE_BUFFER_LENGTH 128     // Events kept per core, about a minute of cooking, must be a power of two
+#define TRACE_HISTOGRAM_BUCKETS 24  // Power of two buckets in microseconds, the last one tops out around 16 s
+
+extern void RegisterTrace(void);
+// Hands out the sequence number a sample carries through every later trace point, never 0
+extern uint32_t TraceNextSeq(void);
+// Safe from any task on either core, a seq of 0 is ignored
+extern void Trace(TracePoint point, uint32_t seq);
+
+#endif
@@ -4,11 +4,27 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
+#include "buffer_pool.h"
 #include "cJSON.h"
+#include "json_arena.h"
 
 extern void SetupWebsocket(void);
-extern QueueHandle_t WebsocketQueue;
+extern QueueHandle_t WebsocketQueue;  // WebSocketMessage pointers from WebsocketPool
 extern TaskHandle_t Websocket;
+extern BufferPool WebsocketPool;
+extern BufferPool JSONStringPool;
+
+// Server the appliance talks to, "nvs_set WS_URI str -v ws://host:port" points a unit at a local server
+#define WEBSOCKET_URI_KEY "WS_URI"
+#ifndef DEFAULT_WEBSOCKET_URI
+#define DEFAULT_WEBSOCKET_URI "ws://10.0.0.146:3001"
+#endif
+
+#define WEBSOCKET_FRAME_LENGTH 1536  // tRPC envelope around a full JSONString
+#define WEBSOCKET_POOL_SIZE 4    // One queued, one being sent and two producers filling theirs
+#define DECODE_RECIPE_QUEUE_LENGTH 2  // Recipe documents waiting on DBManagerTask, only the newest one is decoded
+// Every slot of the decode queue, one being decoded and one BLE transfer in progress
+#define JSON_STRING_POOL_SIZE (DECODE_RECIPE_QUEUE_LENGTH + 2)
 
 typedef struct JSONString {
   char string[1024];
@@ -19,6 +35,15 @@ typedef struct WebSocketMessage {
   char path[32];
   char method[16];
   JSONString dataString;
+  uint32_t seq;  // trace sequence number of the sample behind the message, 0 when there is none
+  const char *methodName;  // the literals WebsocketMessageAlloc was given, for BINLOG which can only keep pointers
+  const char *pathName;
 } WebSocketMessage;
 
+// Wraps the message in the tRPC envelope and prints it into frame, false if it didn't fit
+extern bool WebsocketBuildFrame(JsonArena *arena, const WebSocketMessage *msg, char *frame, size_t size);
+// Takes a message from WebsocketPool with the method and path filled in, NULL if none came free within wait.
+// method and path must be string literals.
+extern WebSocketMessage *WebsocketMessageAlloc(const char *method, const char *path, TickType_t wait);
+
 #endif
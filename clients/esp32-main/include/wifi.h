@@ -1,6 +1,8 @@
 #ifndef WIFI
 #define WIFI
 
+#include <stdint.h>
+
 extern void SetupWifi(void);
 extern void SetWifiCreds(char *ssid, char *pass);
 
@@ -9,4 +11,26 @@ extern void SetWifiCreds(char *ssid, char *pass);
 #define DEFAULT_WIFI_PASS ""
 #define DEFAULT_WIFI_SSID ""
 
+// Last access point we got an IP from, lets the next connect skip the all channel scan
+#define WIFI_CACHE_KEY "WIFI_CACHE"
+// Optional static address, all three must be set in dotted form or DHCP is used
+#define WIFI_STATIC_IP_KEY "WIFI_IP"
+#define WIFI_STATIC_NETMASK_KEY "WIFI_NETMASK"
+#define WIFI_STATIC_GATEWAY_KEY "WIFI_GATEWAY"
+
+#define WIFI_BACKOFF_MIN_MS 250
+#define WIFI_BACKOFF_MAX_MS 30000
+
+typedef struct WifiStats {
+  int64_t bootToConnectedUs;  // 0 until the first IP after boot
+  int64_t lastReconnectUs;    // disconnect to IP for the last drop
+  int64_t maxReconnectUs;
+  uint32_t reconnects;
+  uint32_t attempts;
+  uint32_t fastConnects;  // IPs gained through the cached BSSID and channel
+  uint32_t fullScans;     // times the cache missed and we fell back to scanning every channel
+} WifiStats;
+
+extern void WifiGetStats(WifiStats *stats);
+
 #endif
@@ -0,0 +1,33 @@
+#ifndef ZONE
+#define ZONE
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+// Independently controlled cavities or plates on one board, each with its own thermocouple on the VSPI bus, its own
+// relays and its own recipe. Boards with more than one set ZONE_COUNT in their platformio.ini build_flags.
+#ifndef ZONE_COUNT
+#define ZONE_COUNT 1
+#endif
+#if ZONE_COUNT < 1 || ZONE_COUNT > 3
+#error "ZONE_COUNT must be 1 to 3, the VSPI host has three hardware chip selects"
+#endif
+
+typedef struct ZoneConfig {
+  const char *name;
+  int sensorCs;  // MAX6675 chip select
+  // RelayControllerFlags bits the zone owns, 0 for outputs it doesn't have. INDICATOR_LIGHT is shared, it is on
+  // while any zone cooks.
+  EventBits_t topElement;
+  EventBits_t bottomElement;
+  EventBits_t fan;
+  EventBits_t rotisserie;
+} ZoneConfig;
+
+#define ZONE_RELAYS(zone) ((zone)->topElement | (zone)->bottomElement | (zone)->fan | (zone)->rotisserie)
+#define ZONE_MAX_RELAYS 4  // Top, bottom, fan and rotisserie
+
+extern const ZoneConfig Zones[ZONE_COUNT];
+extern void RegisterZones(void);
+
+#endif
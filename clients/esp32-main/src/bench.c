@@ -0,0 +1,296 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "config.h"
+#include "console.h"
+#include "cooking_controller.h"
+#include "db_manager.h"
+#include "esp_console.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "json_arena.h"
+#include "lcd.h"
+#include "power.h"
+#include "relay_controller.h"
+#include "sensor_bus.h"
+#include "task_config.h"
+#include "temperature_sensor.h"
+#include "websocket.h"
+#if CONFIG_HEAP_TRACING_STANDALONE
+#include "esp_heap_trace.h"
+#endif
+
+#define TAG "BENCH"
+
+typedef struct Benchmark {
+  const char *name;
+  void (*setup)(void);
+  void (*run)(void);
+  void (*teardown)(void);
+  UBaseType_t priority;  // Same as the task the code normally runs in
+  BaseType_t core;
+} Benchmark;
+
+typedef struct BenchResult {
+  uint32_t meanCycles;
+  uint32_t p50Cycles;
+  uint32_t p99Cycles;
+  float allocsPerOp;  // Every heap allocation under the heap tracer, otherwise only cJSON's
+  bool allocsSaturated;
+  uint32_t stackPeak;
+} BenchResult;
+
+typedef struct BenchBaseline {
+  char name[BENCH_NAME_LENGTH];
+  uint32_t p50Cycles;
+} BenchBaseline;
+
+typedef struct BenchJob {
+  const Benchmark *bench;
+  int iterations;
+  BenchResult *result;
+  TaskHandle_t caller;
+} BenchJob;
+
+STATIC_JSON_ARENA(BenchArena, 2048);
+static uint32_t samples[BENCH_MAX_ITERATIONS];
+static WebSocketMessage message;
+static JSONString recipeJson;
+static Recipe recipe;
+static Temperature reading;
+static char frame[WEBSOCKET_FRAME_LENGTH];
+#if CONFIG_HEAP_TRACING_STANDALONE
+static heap_trace_record_t traceRecords[BENCH_TRACE_RECORDS];
+#endif
+
+static void NoopRun(void) {}
+
+static void EnvelopeSetup(void) {
+  strlcpy(message.method, "mutation", sizeof(message.method));
+  strlcpy(message.path, "appliance.updateTemperature", sizeof(message.path));
+  message.dataString.length = snprintf(message.dataString.string, sizeof(message.dataString.string),
+                                       "{\"temperatureC\":180,\"temperatureF\":356,\"id\":\"%s\"}", ID);
+}
+
+static void EnvelopeRun(void) { WebsocketBuildFrame(&BenchArena, &message, frame, sizeof(frame)); }
+
+static void RecipeDecodeSetup(void) {
+  recipeJson.length = snprintf(recipeJson.string, sizeof(recipeJson.string),
+                               "{\"result\":{\"type\":\"data\",\"data\":{\"json\":{\"applianceMode\":\"Bake\",\"temperature\":180,"
+                               "\"temperatureUnit\":\"C\",\"applianceType\":\"%s\",\"cookingTime\":1800000,\"expiryDate\":1767225600000,"
+                               "\"id\":\"2f1c7d9e-6a4b-4c1e-9b2d-8e5f3a7c0d14\",\"name\":\"Frozen Pizza\"}}}}",
+                               APPLIANCE_TYPE);
+}
+
+static void RecipeDecodeRun(void) {
+  char name[LCD_COLS + 1];
+  RecipeDecode(&BenchArena, &recipeJson, &recipe, name, sizeof(name));
+}
+
+static void SensorSweepRun(void) {
+  SensorReading readings[SENSOR_BUS_MAX_CHANNELS];
+  SensorBusSweep(readings);
+}
+
+static void ControlStepSetup(void) {
+  RecipeDecodeSetup();
+  RecipeDecodeRun();
+}
+
+// Alternates either side of the band so every step switches the elements
+static void ControlStepRun(void) {
+  reading.c = reading.c == recipe.temperature - 30 ? recipe.temperature + 30 : recipe.temperature - 30;
+  CookingControlStep(&recipe, &reading, TOP_HEATING_ELEMENT | BOTTOM_HEATING_ELEMENT);
+}
+
+static void ControlStepTeardown(void) { xEventGroupClearBits(RelayControllerFlags, TOP_HEATING_ELEMENT | BOTTOM_HEATING_ELEMENT); }
+
+static void LCDFieldRun(void) { LCDSetField(LCD_FIELD_TEMPERATURE, "%03d C | %03d F", 180, 356); }
+
+static void FlashGetRun(void) {
+  char id[64];
+  FlashGet(NVS_TYPE_STR, ID_KEY, id, sizeof(id));
+}
+
+// The first entry is the harness itself, its cycles and stack are the floor under every other row
+static const Benchmark benchmarks[] = {
+    {"noop", NULL, NoopRun, NULL, COOKING_CONTROLLER_PRIORITY, COOKING_CONTROLLER_CORE},
+    {"envelope", EnvelopeSetup, EnvelopeRun, NULL, WEBSOCKET_PRIORITY, WEBSOCKET_CORE},
+    {"recipe_decode", RecipeDecodeSetup, RecipeDecodeRun, NULL, DB_MANAGER_PRIORITY, DB_MANAGER_CORE},
+    {"sensor_sweep", NULL, SensorSweepRun, NULL, TEMP_SENSOR_PRIORITY, TEMP_SENSOR_CORE},
+    {"control_step", ControlStepSetup, ControlStepRun, ControlStepTeardown, COOKING_CONTROLLER_PRIORITY, COOKING_CONTROLLER_CORE},
+    {"lcd_field", NULL, LCDFieldRun, NULL, TEMP_SENSOR_PRIORITY, TEMP_SENSOR_CORE},
+    {"flash_get", NULL, FlashGetRun, NULL, DB_MANAGER_PRIORITY, PRO_CPU_NUM},
+};
+#define BENCH_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int CompareCycles(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void BenchTask(void *args) {
+  BenchJob *job = args;
+  const Benchmark *bench = job->bench;
+  BenchResult *result = job->result;
+  uint64_t total = 0;
+  uint32_t start, jsonAllocs;
+
+  // Cycle counts only compare at one clock, keep dynamic frequency scaling out of it
+  PowerAcquire(POWER_LOCK_CONTROL);
+  if (bench->setup) bench->setup();
+  jsonAllocs = JsonHeapAllocations();
+  for (int i = 0; i < job->iterations; i++) {
+    start = esp_cpu_get_ccount();
+    bench->run();
+    samples[i] = esp_cpu_get_ccount() - start;
+    total += samples[i];
+  }
+
+  // Other tasks' cJSON work lands in the same counter, the other benchmarks are the only thing that stops them
+  result->allocsPerOp = (float)(JsonHeapAllocations() - jsonAllocs) / job->iterations;
+#if CONFIG_HEAP_TRACING_STANDALONE
+  heap_trace_start(HEAP_TRACE_ALL);
+  for (int i = 0; i < BENCH_TRACED_ITERATIONS; i++) bench->run();
+  heap_trace_stop();
+  result->allocsPerOp = (float)heap_trace_get_count() / BENCH_TRACED_ITERATIONS;
+  result->allocsSaturated = heap_trace_get_count() >= BENCH_TRACE_RECORDS;
+#endif
+  if (bench->teardown) bench->teardown();
+  PowerRelease(POWER_LOCK_CONTROL);
+
+  qsort(samples, job->iterations, sizeof(samples[0]), CompareCycles);
+  result->meanCycles = total / job->iterations;
+  result->p50Cycles = samples[job->iterations / 2];
+  result->p99Cycles = samples[job->iterations * 99 / 100];
+  result->stackPeak = BENCH_STACK - uxTaskGetStackHighWaterMark(NULL);
+
+  xTaskNotifyGive(job->caller);
+  vTaskDelete(NULL);
+}
+
+static bool BenchRun(const Benchmark *bench, int iterations, BenchResult *result) {
+  BenchJob job = {.bench = bench, .iterations = iterations, .result = result, .caller = xTaskGetCurrentTaskHandle()};
+  memset(result, 0, sizeof(*result));
+  if (xTaskCreatePinnedToCore(BenchTask, "BenchTask", BENCH_STACK, &job, bench->priority, NULL, bench->core) != pdPASS) return false;
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  return true;
+}
+
+static const BenchBaseline *FindBaseline(const BenchBaseline *baselines, const char *name) {
+  for (int i = 0; i < BENCH_COUNT; i++) {
+    if (strncmp(baselines[i].name, name, BENCH_NAME_LENGTH) == 0) return &baselines[i];
+  }
+  return NULL;
+}
+
+int BenchRunAll(const char *only, int iterations, bool save) {
+  static BenchBaseline baselines[BENCH_COUNT];
+  static BenchBaseline updated[BENCH_COUNT];
+  static BenchResult results[BENCH_COUNT];
+  bool ran[BENCH_COUNT] = {false};
+  BenchResult *noop = &results[0];
+  char allocs[12];
+  char change[24];
+  int regressions = 0;
+
+  memset(baselines, 0, sizeof(baselines));
+  bool haveBaseline = FlashGet(NVS_TYPE_BLOB, BENCH_BASELINE_KEY, baselines, sizeof(baselines)) == ESP_OK;
+
+  printf("%-14s %10s %10s %10s %8s %9s %6s %10s\n", "bench", "mean cyc", "p50 cyc", "p99 cyc", "p50 us", "allocs/op", "stack", "vs base");
+  for (int i = 0; i < BENCH_COUNT; i++) {
+    const Benchmark *bench = &benchmarks[i];
+    BenchResult *r = &results[i];
+    if (i > 0 && only != NULL && strcmp(only, bench->name) != 0) continue;
+    if (!BenchRun(bench, iterations, r)) {
+      printf("%-14s could not create the benchmark task\n", bench->name);
+      return -1;
+    }
+    ran[i] = true;
+
+    snprintf(allocs, sizeof(allocs), "%s%.2f", r->allocsSaturated ? ">" : "", r->allocsPerOp);
+    const BenchBaseline *base = haveBaseline ? FindBaseline(baselines, bench->name) : NULL;
+    if (base == NULL || base->p50Cycles == 0) {
+      strcpy(change, "-");
+    } else {
+      float percent = 100.0f * ((float)r->p50Cycles - base->p50Cycles) / base->p50Cycles;
+      snprintf(change, sizeof(change), "%+.1f%%%s", percent, percent > BENCH_REGRESSION_PERCENT ? " SLOWER" : "");
+      if (percent > BENCH_REGRESSION_PERCENT) regressions++;
+    }
+    // The harness' own stack is taken off every row but its own
+    uint32_t stack = i == 0 || r->stackPeak < noop->stackPeak ? r->stackPeak : r->stackPeak - noop->stackPeak;
+    printf("%-14s %10u %10u %10u %8.1f %9s %6u %10s\n", bench->name, r->meanCycles, r->p50Cycles, r->p99Cycles,
+           (float)r->p50Cycles / POWER_MAX_FREQ_MHZ, allocs, stack, change);
+  }
+#if !CONFIG_HEAP_TRACING_STANDALONE
+  printf("allocs/op counts cJSON heap allocations only, CONFIG_HEAP_TRACING_STANDALONE counts every one\n");
+#endif
+
+  if (save) {
+    // Benchmarks that were skipped keep whatever was saved for them before
+    for (int i = 0; i < BENCH_COUNT; i++) {
+      const BenchBaseline *saved = haveBaseline ? FindBaseline(baselines, benchmarks[i].name) : NULL;
+      strlcpy(updated[i].name, benchmarks[i].name, sizeof(updated[i].name));
+      updated[i].p50Cycles = ran[i] ? results[i].p50Cycles : saved != NULL ? saved->p50Cycles : 0;
+    }
+    if (FlashSet(NVS_TYPE_BLOB, BENCH_BASELINE_KEY, updated, sizeof(updated)) != ESP_OK) {
+      printf("Failed to save the baseline\n");
+      return -1;
+    }
+    printf("Baseline saved\n");
+  }
+  return regressions;
+}
+
+static struct {
+  struct arg_int *iterations;
+  struct arg_str *name;
+  struct arg_lit *save;
+  struct arg_end *end;
+} bench_args;
+
+static int BenchConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, bench_args.end, argv[0]);
+    return 1;
+  }
+  int iterations = bench_args.iterations->count ? bench_args.iterations->ival[0] : BENCH_DEFAULT_ITERATIONS;
+  if (iterations < 1 || iterations > BENCH_MAX_ITERATIONS) {
+    printf("Iterations must be 1 to %d\n", BENCH_MAX_ITERATIONS);
+    return 1;
+  }
+  // The control step drives the relay flags and the sensor sweep contends with the real one
+  if (xEventGroupGetBits(DeviceStatus) & IS_COOKING) {
+    printf("Cannot benchmark while cooking\n");
+    return 1;
+  }
+  return BenchRunAll(bench_args.name->count ? bench_args.name->sval[0] : NULL, iterations, bench_args.save->count) < 0;
+}
+
+void RegisterBench(void) {
+#if CONFIG_HEAP_TRACING_STANDALONE
+  ESP_ERROR_CHECK(heap_trace_init_standalone(traceRecords, BENCH_TRACE_RECORDS));
+#endif
+  bench_args.iterations = arg_int0("n", "iterations", "<n>", "Timed runs of each benchmark, default 200");
+  bench_args.name = arg_str0("b", "bench", "<name>", "Only run this benchmark");
+  bench_args.save = arg_lit0("s", "save", "Save the p50s as the baseline later runs are compared against");
+  bench_args.end = arg_end(3);
+  const esp_console_cmd_t cmd = {
+      .command = "bench",
+      .help = "Time the firmware hot paths in CPU cycles and compare them against the saved baseline",
+      .hint = NULL,
+      .func = &BenchConsoleCmd,
+      .argtable = &bench_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
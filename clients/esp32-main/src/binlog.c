@@ -0,0 +1,201 @@
+#include "binlog.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "memory_budget.h"
+#include "task_config.h"
+
+#define TAG "BINLOG"
+
+typedef struct BinlogRecord {
+  uint32_t stamp;  // slot index + 1, written last so the drain can tell a finished record from one being written
+  uint32_t timeUs;
+  const char *tag;
+  const char *format;
+  uint8_t level;
+  uint8_t argCount;
+  uint32_t args[BINLOG_MAX_ARGS];
+} BinlogRecord;
+
+// One ring per core, same scheme as the trace rings, the only writers racing for a slot share a core
+typedef struct BinlogRing {
+  uint32_t head;
+  BinlogRecord records[BINLOG_BUFFER_LENGTH];
+} BinlogRing;
+
+esp_log_level_t BinlogLevel = CONFIG_LOG_DEFAULT_LEVEL;
+static BinlogRing rings[portNUM_PROCESSORS];
+static bool raw;
+
+// Only touched by the drain task
+static uint32_t cursors[portNUM_PROCESSORS];
+static uint32_t drained;
+static uint32_t dropped;
+
+STATIC_TASK(BinlogDrain, BINLOG_DRAIN_STACK);
+
+static const char levelLetters[] = {'N', 'E', 'W', 'I', 'D', 'V'};
+static const char *levelColors[] = {"", LOG_COLOR_E, LOG_COLOR_W, LOG_COLOR_I, LOG_COLOR_D, LOG_COLOR_V};
+
+void BinlogWrite(esp_log_level_t level, const char *tag, const char *format, int argCount, const uint32_t *args) {
+  uint32_t timeUs = esp_timer_get_time();
+  BinlogRing *ring = &rings[xPortGetCoreID()];
+  uint32_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  BinlogRecord *record = &ring->records[index & (BINLOG_BUFFER_LENGTH - 1)];
+
+  __atomic_store_n(&record->stamp, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->timeUs = timeUs;
+  record->tag = tag;
+  record->format = format;
+  record->level = level;
+  record->argCount = argCount;
+  for (int i = 0; i < argCount; i++) record->args[i] = args[i];
+  __atomic_store_n(&record->stamp, index + 1, __ATOMIC_RELEASE);
+}
+
+// Copies out the next record on core without consuming it. False when the ring is empty or the writer of the next
+// slot hasn't finished, the slot is retried next pass, or counted as dropped once the ring laps it.
+static bool BinlogPeek(int core, BinlogRecord *out) {
+  BinlogRing *ring = &rings[core];
+  while (true) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (cursors[core] == head) return false;
+    if (head - cursors[core] > BINLOG_BUFFER_LENGTH) {
+      dropped += head - cursors[core] - BINLOG_BUFFER_LENGTH;
+      cursors[core] = head - BINLOG_BUFFER_LENGTH;
+    }
+
+    uint32_t index = cursors[core];
+    BinlogRecord *record = &ring->records[index & (BINLOG_BUFFER_LENGTH - 1)];
+    uint32_t stamp = __atomic_load_n(&record->stamp, __ATOMIC_ACQUIRE);
+    if (stamp == 0 || (int32_t)(stamp - (index + 1)) < 0) return false;
+    if (stamp == index + 1) {
+      *out = *record;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&record->stamp, __ATOMIC_RELAXED) == index + 1) return true;
+    }
+    dropped++;  // overwritten before or while it was copied
+    cursors[core]++;
+  }
+}
+
+static void BinlogEmitText(const BinlogRecord *record, int64_t now) {
+  static char line[BINLOG_LINE_LENGTH];
+  const uint32_t *args = record->args;
+  // Unused words are passed too, printf only reads as many as the format asks for
+  snprintf(line, sizeof(line), record->format, args[0], args[1], args[2], args[3]);
+  uint32_t ms = (now - (uint32_t)((uint32_t)now - record->timeUs)) / 1000;
+  esp_log_write(record->level, record->tag, "%s%c (%u) %s: %s%s\n", levelColors[record->level], levelLetters[record->level],
+                ms, record->tag, line, LOG_RESET_COLOR);
+}
+
+// sync, time us u32, level u8, arg count u8, tag address u32, format address u32, args u32 each, little endian
+static void BinlogEmitRaw(const BinlogRecord *record) {
+  uint8_t frame[2 + 4 + 1 + 1 + 4 + 4 + 4 * BINLOG_MAX_ARGS];
+  uint32_t tag = (uint32_t)(uintptr_t)record->tag;
+  uint32_t format = (uint32_t)(uintptr_t)record->format;
+  memcpy(frame, BINLOG_RAW_SYNC, 2);
+  memcpy(&frame[2], &record->timeUs, 4);
+  frame[6] = record->level;
+  frame[7] = record->argCount;
+  memcpy(&frame[8], &tag, 4);
+  memcpy(&frame[12], &format, 4);
+  memcpy(&frame[16], record->args, 4 * record->argCount);
+  fwrite(frame, 1, 16 + 4 * record->argCount, stdout);
+}
+
+// Merges the per-core rings oldest first, so lines from both cores come out in the order they were logged
+static void BinlogDrain(void) {
+  BinlogRecord next[portNUM_PROCESSORS];
+  bool ready[portNUM_PROCESSORS];
+  int64_t now = esp_timer_get_time();
+  int core, oldest;
+
+  for (core = 0; core < portNUM_PROCESSORS; core++) ready[core] = BinlogPeek(core, &next[core]);
+  while (true) {
+    oldest = -1;
+    for (core = 0; core < portNUM_PROCESSORS; core++) {
+      if (ready[core] && (oldest < 0 || (int32_t)(next[core].timeUs - next[oldest].timeUs) < 0)) oldest = core;
+    }
+    if (oldest < 0) break;
+
+    if (raw) {
+      BinlogEmitRaw(&next[oldest]);
+    } else {
+      BinlogEmitText(&next[oldest], now);
+    }
+    drained++;
+    cursors[oldest]++;
+    ready[oldest] = BinlogPeek(oldest, &next[oldest]);
+  }
+  if (raw) fflush(stdout);
+}
+
+static void BinlogDrainTask(void *pvParams) {
+  while (true) {
+    BinlogDrain();
+    vTaskDelay(pdMS_TO_TICKS(BINLOG_DRAIN_INTERVAL_MS));
+  }
+}
+
+static struct {
+  struct arg_lit *raw;
+  struct arg_lit *text;
+  struct arg_int *level;
+  struct arg_end *end;
+} binlog_args;
+
+static int BinlogConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&binlog_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, binlog_args.end, argv[0]);
+    return 1;
+  }
+
+  if (binlog_args.level->count) {
+    int level = binlog_args.level->ival[0];
+    if (level < ESP_LOG_NONE || level > ESP_LOG_VERBOSE) {
+      printf("Level must be 0 (none) to 5 (verbose)\n");
+      return 1;
+    }
+    BinlogLevel = level;
+  }
+  if (binlog_args.raw->count) raw = true;
+  if (binlog_args.text->count) raw = false;
+
+  uint32_t written = 0;
+  for (int core = 0; core < portNUM_PROCESSORS; core++) written += __atomic_load_n(&rings[core].head, __ATOMIC_RELAXED);
+  printf("%u records logged, %u drained, %u dropped\n", written, drained, dropped);
+  printf("Level %c, drained as %s\n", levelLetters[BinlogLevel], raw ? "raw records for tools/binlog_decode.py" : "text");
+  return 0;
+}
+
+static void RegisterBinlog(void) {
+  binlog_args.raw = arg_lit0("r", "raw", "Write records unformatted, for tools/binlog_decode.py");
+  binlog_args.text = arg_lit0("t", "text", "Format records on the device");
+  binlog_args.level = arg_int0("l", "level", "<0-5>", "Skip records above this level at the call site");
+  binlog_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "binlog",
+      .help = "Get deferred log counts, or switch the drain between text and raw output",
+      .hint = NULL,
+      .func = &BinlogConsoleCmd,
+      .argtable = &binlog_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupBinlog(void) {
+  BudgetCreateTask(TAG, BinlogDrainTask, "BinlogDrainTask", BINLOG_DRAIN_STACK, NULL, BINLOG_DRAIN_PRIORITY, BINLOG_DRAIN_CORE,
+                   BinlogDrainStack, &BinlogDrainTCB);
+  RegisterBinlog();
+}
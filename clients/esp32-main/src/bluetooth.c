@@ -1,30 +1,49 @@
 #include "bluetooth.h"
 
 #include <stdio.h>
+#include <string.h>
 
+#include "argtable3/argtable3.h"
 #include "cJSON.h"
 #include "config.h"
+#include "console.h"
+#include "cooking_controller.h"
+#include "db_manager.h"
+#include "esp_bt.h"
+#include "esp_console.h"
 #include "esp_event.h"  //"esp_event_loop.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_nimble_hci.h"
+#include "esp_timer.h"
 #include "flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
 #include "host/ble_hs.h"
+#include "json_arena.h"
 #include "lcd.h"
+#include "memory_budget.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "nvs_flash.h"
+#include "relay_controller.h"
 #include "sdkconfig.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
+#include "task_config.h"
+#include "temperature_sensor.h"
+#include "websocket.h"
 #include "wifi.h"
+#include "zone.h"
 
 #define DEVICE_INFO_SERVICE_UUID 0x180A
 #define SET_WIFI_CHAR 0x0000
 #define PAIR_APPLIANCE_CHAR 0x0001
 #define GET_DEVICE_NAME_CHAR 0x0002
+#define TELEMETRY_CHAR 0x0003
+#define RECIPE_TRANSFER_CHAR 0x0004
 
 #define TAG "BLE"
 
@@ -34,18 +53,129 @@ char *wifi_ssid;
 char *wifi_pass;
 char *ble_device_name;
 
+static TaskHandle_t BluetoothLifecycle;
+STATIC_TASK(BluetoothLifecycle, BLUETOOTH_LIFECYCLE_STACK);
+STATIC_JSON_ARENA(BluetoothArena, 1024);  // Credential writes and recipe transfers, both parsed on the NimBLE host task
+static bool ble_running;
+static bool ble_released;
+static int ble_connections;
+static int ble_heap_reclaimed;
+static int ble_largest_block_gain;
+
+#define BLE_REQUEST_START BIT0
+#define BLE_REQUEST_STOP BIT1
+
+static uint16_t telemetry_handle;
+static uint16_t telemetry_subscribers[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static uint16_t telemetry_sequence;
+static TimerHandle_t telemetry_timer;
+static StaticTimer_t telemetry_timer_buffer;
+
+// Recipe documents may arrive over several (long) writes and are reassembled in a pooled block until they parse
+static struct {
+  JSONString *json;  // NULL until the first write of a transfer
+  uint16_t conn_handle;
+  uint16_t writes;
+  int64_t started;
+  int64_t last_write;
+} recipe_transfer;
+
 void Advertise(void);
 
+static void BuildTelemetry(BLETelemetry *packet) {
+  Temperature temp;
+  CookingState cooking;
+  int zone = telemetry_sequence % ZONE_COUNT;  // Zones take turns, one per notification
+  TempSensorGetLatest(zone, &temp);
+  CookingControllerGetState(zone, &cooking);
+
+  packet->version = BLE_TELEMETRY_VERSION;
+  packet->sequence = telemetry_sequence++;
+  packet->zone = zone;
+  packet->temperatureC = temp.c;
+  packet->temperatureF = temp.f;
+  packet->setpoint = cooking.setpoint;
+  packet->temperatureUnit = cooking.temperatureUnit;
+  packet->remainingSeconds = cooking.remainingSeconds;
+  packet->relays = xEventGroupGetBits(RelayControllerFlags);
+  packet->status = xEventGroupGetBits(DeviceStatus);
+}
+
+static void NotifyTelemetry(TimerHandle_t xTimer) {
+  BLETelemetry packet;
+  BuildTelemetry(&packet);
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (telemetry_subscribers[i] == BLE_HS_CONN_HANDLE_NONE) continue;
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(&packet, sizeof(packet));
+    if (om == NULL) {
+      ESP_LOGW(TAG, "No mbufs left for telemetry");
+      return;
+    }
+    ble_gattc_notify_custom(telemetry_subscribers[i], telemetry_handle, om);
+  }
+}
+
+// Tracks which connections have notifications enabled and only runs the timer while someone listens
+static void SetTelemetrySubscriber(uint16_t conn_handle, bool subscribed) {
+  int active = 0;
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (telemetry_subscribers[i] == conn_handle) telemetry_subscribers[i] = BLE_HS_CONN_HANDLE_NONE;
+  }
+  for (int i = 0; subscribed && i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (telemetry_subscribers[i] == BLE_HS_CONN_HANDLE_NONE) {
+      telemetry_subscribers[i] = conn_handle;
+      break;
+    }
+  }
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) {
+    if (telemetry_subscribers[i] != BLE_HS_CONN_HANDLE_NONE) active++;
+  }
+
+  if (active > 0) {
+    xTimerStart(telemetry_timer, 0);
+  } else {
+    xTimerStop(telemetry_timer, 0);
+  }
+}
+
+static int MtuExchanged(uint16_t conn_handle, const struct ble_gatt_error *error, uint16_t mtu, void *arg) {
+  if (error->status == 0) {
+    ESP_LOGI(TAG, "MTU negotiated: %d", mtu);
+  } else {
+    ESP_LOGW(TAG, "MTU exchange failed: %d", error->status);
+  }
+  return 0;
+}
+
+// Asks for a bigger MTU and a shorter connection interval so a whole telemetry burst fits in one connection event
+static void TuneConnection(uint16_t conn_handle) {
+  struct ble_gap_upd_params params = {
+      .itvl_min = BLE_CONN_ITVL_MIN,
+      .itvl_max = BLE_CONN_ITVL_MAX,
+      .latency = 0,
+      .supervision_timeout = BLE_CONN_SUPERVISION_TIMEOUT,
+  };
+  int rc = ble_gattc_exchange_mtu(conn_handle, MtuExchanged, NULL);
+  if (rc != 0) ESP_LOGW(TAG, "Failed to start MTU exchange: %d", rc);
+  rc = ble_gap_update_params(conn_handle, &params);
+  if (rc != 0) ESP_LOGW(TAG, "Failed to request connection parameters: %d", rc);
+}
+
 static int ble_gap_event(struct ble_gap_event *event, void *arg) {
   switch (event->type) {
     case BLE_GAP_EVENT_CONNECT:
       ESP_LOGI("GAP", "BLE GAP EVENT CONNECT %s", event->connect.status == 0 ? "OK!" : "FAILED!");
       if (event->connect.status != 0) {
         Advertise();
+      } else {
+        ble_connections++;
+        TuneConnection(event->connect.conn_handle);
       }
       break;
     case BLE_GAP_EVENT_DISCONNECT:
       ESP_LOGI("GAP", "BLE GAP EVENT");
+      SetTelemetrySubscriber(event->disconnect.conn.conn_handle, false);
+      if (ble_connections > 0) ble_connections--;
       Advertise();
       break;
     case BLE_GAP_EVENT_ADV_COMPLETE:
@@ -54,6 +184,15 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg) {
       break;
     case BLE_GAP_EVENT_SUBSCRIBE:
       ESP_LOGI("GAP", "BLE GAP EVENT");
+      if (event->subscribe.attr_handle == telemetry_handle) {
+        SetTelemetrySubscriber(event->subscribe.conn_handle, event->subscribe.cur_notify);
+      }
+      break;
+    case BLE_GAP_EVENT_MTU:
+      ESP_LOGI("GAP", "MTU updated to %d", event->mtu.value);
+      break;
+    case BLE_GAP_EVENT_CONN_UPDATE:
+      ESP_LOGI("GAP", "Connection parameters %s", event->conn_update.status == 0 ? "updated" : "rejected");
       break;
     default:
       break;
@@ -91,29 +230,45 @@ void OnSync(void) {
   FlashSet(NVS_TYPE_STR, BLE_DEVICE_ID_KEY, BLEId, 64);
 }
 
-void HostTask(void *param) { nimble_port_run(); }
+void HostTask(void *param) {
+  nimble_port_run();  // Returns once nimble_port_stop is called
+  nimble_port_freertos_deinit();
+}
 
 void SetBLEDeviceName(char *name) {
-  LCDMessage msg = {
-      .row = 0,
-      .col = 0,
-  };
   FlashSet(NVS_TYPE_STR, BLE_DEVICE_NAME_KEY, name, 32);
-  ble_svc_gap_device_name_set(name);
-  strcpy(msg.text, name);
-  xQueueSend(LCDQueue, &msg, portMAX_DELAY);
+  if (ble_running) ble_svc_gap_device_name_set(name);
+  LCDSetField(LCD_FIELD_DEVICE_NAME, "%s", name);
   ESP_LOGI(TAG, "BLE Device Name Set to %s", name);
 }
 
+// Copies a possibly chained write into buf and NUL terminates it
+static int FlattenWrite(struct os_mbuf *om, char *buf, uint16_t size, uint16_t *length) {
+  if (OS_MBUF_PKTLEN(om) > size - 1) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  if (ble_hs_mbuf_to_flat(om, buf, size - 1, length) != 0) return BLE_ATT_ERR_UNLIKELY;
+  buf[*length] = '\0';
+  return 0;
+}
+
 // callback from characteristic 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
 static int SetWifiBLECmd(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
   // data pattern {"SSID": "PUT_YOUR_WIFI_NAME", "PASS": "PUT_YOUR_WIFI_PASS", "NAME": "PUT_YOUR_DEVICE_NAME"}
-  char *incoming_data = (char *)ctxt->om->om_data;
+  char incoming_data[256];
+  uint16_t length;
+  int rc = FlattenWrite(ctxt->om, incoming_data, sizeof(incoming_data), &length);
+  if (rc != 0) return rc;
   ESP_LOGI(TAG, "incoming message: %s\n", incoming_data);
-  cJSON *payload = cJSON_Parse(incoming_data);
+  JsonArenaBegin(&BluetoothArena);
+  cJSON *payload = cJSON_ParseWithLength(incoming_data, length);
   cJSON *name = cJSON_GetObjectItem(payload, "name");
   cJSON *ssid = cJSON_GetObjectItem(payload, "ssid");
   cJSON *pass = cJSON_GetObjectItem(payload, "pass");
+  if (!cJSON_IsString(name) || !cJSON_IsString(ssid) || !cJSON_IsString(pass)) {
+    ESP_LOGE(TAG, "Malformed wifi credentials");
+    cJSON_Delete(payload);
+    JsonArenaEnd(&BluetoothArena);
+    return BLE_ATT_ERR_UNLIKELY;
+  }
   wifi_ssid = ssid->valuestring;
   wifi_pass = pass->valuestring;
   ble_device_name = name->valuestring;
@@ -122,6 +277,7 @@ static int SetWifiBLECmd(uint16_t conn_handle, uint16_t attr_handle, struct ble_
   }
   SetBLEDeviceName(ble_device_name);
   cJSON_Delete(payload);
+  JsonArenaEnd(&BluetoothArena);
   return 0;
 }
 
@@ -138,6 +294,67 @@ static int GetApplianceNameBLECmd(uint16_t con_handle, uint16_t attr_handle, str
   return 0;
 }
 
+static int TelemetryBLECmd(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  BLETelemetry packet;
+  BuildTelemetry(&packet);
+  return os_mbuf_append(ctxt->om, &packet, sizeof(packet)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static void ResetRecipeTransfer(void) {
+  BufferRelease(recipe_transfer.json);
+  recipe_transfer.json = NULL;
+  recipe_transfer.writes = 0;
+  recipe_transfer.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+}
+
+// Accepts a recipe document sent as one or more writes, NimBLE has already merged prepared writes into one chain
+static int RecipeTransferBLECmd(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg) {
+  JSONString *json;
+  int64_t now = esp_timer_get_time();
+  uint16_t length;
+
+  // A half finished transfer from another connection or one that stalled is abandoned
+  if (recipe_transfer.writes > 0 &&
+      (recipe_transfer.conn_handle != conn_handle || now - recipe_transfer.last_write > BLE_RECIPE_TRANSFER_TIMEOUT_MS * 1000LL)) {
+    ESP_LOGW(TAG, "Dropping incomplete recipe transfer of %d bytes", recipe_transfer.json->length);
+    ResetRecipeTransfer();
+  }
+  if (recipe_transfer.writes == 0) {
+    // The host stack can't block, a transfer that finds the pool empty is refused and the client retries
+    recipe_transfer.json = BufferAlloc(&JSONStringPool, 0);
+    if (recipe_transfer.json == NULL) return BLE_ATT_ERR_INSUFFICIENT_RES;
+    recipe_transfer.json->length = 0;
+    recipe_transfer.started = now;
+    recipe_transfer.conn_handle = conn_handle;
+  }
+  json = recipe_transfer.json;
+
+  int rc = FlattenWrite(ctxt->om, &json->string[json->length], sizeof(json->string) - json->length, &length);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Recipe does not fit in %d bytes", sizeof(json->string));
+    ResetRecipeTransfer();
+    return rc;
+  }
+  json->length += length;
+  recipe_transfer.writes++;
+  recipe_transfer.last_write = now;
+
+  // Every partial write is parsed to see if the document is complete, the arena keeps those attempts off the heap
+  JsonArenaBegin(&BluetoothArena);
+  cJSON *recipe = cJSON_ParseWithLength(json->string, json->length);
+  bool complete = recipe != NULL;
+  cJSON_Delete(recipe);
+  JsonArenaEnd(&BluetoothArena);
+  if (!complete) return 0;  // Still waiting on the rest of the document
+
+  ESP_LOGI(TAG, "Recipe received: %d bytes in %d writes over %lld ms, MTU %d", json->length, recipe_transfer.writes,
+           (now - recipe_transfer.started) / 1000, ble_att_mtu(conn_handle));
+  DBManagerDecodeRecipe(json);
+  recipe_transfer.json = NULL;  // Now owned by the DB manager
+  ResetRecipeTransfer();
+  return 0;
+}
+
 static const struct ble_gatt_svc_def gatt_svcs[] = {
     {
         .type = BLE_GATT_SVC_TYPE_PRIMARY,
@@ -159,13 +376,27 @@ static const struct ble_gatt_svc_def gatt_svcs[] = {
                     .flags = BLE_GATT_CHR_F_READ,
                     .access_cb = GetApplianceNameBLECmd,
                 },
+                {
+                    .uuid = BLE_UUID16_DECLARE(TELEMETRY_CHAR),
+                    .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+                    .access_cb = TelemetryBLECmd,
+                    .val_handle = &telemetry_handle,
+                },
+                {
+                    .uuid = BLE_UUID16_DECLARE(RECIPE_TRANSFER_CHAR),
+                    .flags = BLE_GATT_CHR_F_WRITE,
+                    .access_cb = RecipeTransferBLECmd,
+                },
                 {0},
             },
     },
     {0},
 };
 
-void SetupBluetooth() {
+// Brings up the controller and host, every step is repeated on a restart since BluetoothStop tears all of it down
+static void BluetoothStart(void) {
+  if (ble_running) return;
+  size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
   esp_nimble_hci_and_controller_init();  // initialize bluetooth controller.
   nimble_port_init();                    // nimble library initialization.
   char deviceName[32];
@@ -175,6 +406,132 @@ void SetupBluetooth() {
   ble_svc_gatt_init();             // initailize the gatt service.
   ble_gatts_count_cfg(gatt_svcs);  // config all the gatt services that wanted to be used.
   ble_gatts_add_svcs(gatt_svcs);   // queues all services.
+  ble_att_set_preferred_mtu(CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU);
   ble_hs_cfg.sync_cb = OnSync;
+  for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++) telemetry_subscribers[i] = BLE_HS_CONN_HANDLE_NONE;
+  ResetRecipeTransfer();
+  ble_connections = 0;
   nimble_port_freertos_init(HostTask);
-}
\ No newline at end of file
+  ble_running = true;
+  ESP_LOGI(TAG, "BLE started, using %d bytes of heap", free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT));
+}
+
+static void BluetoothStop(void) {
+  if (!ble_running) return;
+  size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t largest_before = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+  xTimerStop(telemetry_timer, portMAX_DELAY);
+  if (nimble_port_stop() != 0) {
+    ESP_LOGE(TAG, "Failed to stop the NimBLE host");
+    return;
+  }
+  nimble_port_deinit();
+  esp_nimble_hci_and_controller_deinit();
+#if BLE_RELEASE_CONTROLLER_MEMORY
+  esp_bt_controller_mem_release(ESP_BT_MODE_BTDM);
+  ble_released = true;
+#endif
+  ble_running = false;
+
+  ble_heap_reclaimed = heap_caps_get_free_size(MALLOC_CAP_8BIT) - free_before;
+  ble_largest_block_gain = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) - largest_before;
+  ESP_LOGI(TAG, "BLE stopped, reclaimed %d bytes of heap, largest free block %d -> %d bytes", ble_heap_reclaimed, largest_before,
+           heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+void BluetoothRequest(void) {
+  if (BluetoothLifecycle != NULL) xTaskNotify(BluetoothLifecycle, BLE_REQUEST_START, eSetBits);
+}
+
+void BluetoothRelease(void) {
+  if (BluetoothLifecycle != NULL) xTaskNotify(BluetoothLifecycle, BLE_REQUEST_STOP, eSetBits);
+}
+
+bool BluetoothIsRunning(void) { return ble_running; }
+
+// Keeps BLE up through the window after boot or a request, then tears it down once the device is provisioned and idle
+static void BluetoothLifecycleTask(void *args) {
+  const EventBits_t provisioned = WIFI_CONNECTED | WEBSOCKET_READY;
+  const TickType_t window = pdMS_TO_TICKS(BLE_PROVISIONING_WINDOW_MS);
+  TickType_t window_start = 0;
+  TickType_t elapsed, wait;
+  uint32_t requests = BLE_REQUEST_START;  // BLE always comes up at boot
+
+  while (true) {
+    if (requests & BLE_REQUEST_START) {
+      if (ble_released) {
+        ESP_LOGE(TAG, "Controller memory was released, BLE cannot restart until reboot");
+      } else {
+        BluetoothStart();
+        window_start = xTaskGetTickCount();
+      }
+    }
+    if (requests & BLE_REQUEST_STOP) BluetoothStop();
+
+    wait = portMAX_DELAY;
+    if (ble_running) {
+      elapsed = xTaskGetTickCount() - window_start;
+      if (elapsed < window) {
+        wait = window - elapsed;
+      } else if ((xEventGroupGetBits(DeviceStatus) & provisioned) == provisioned && ble_connections == 0) {
+        ESP_LOGI(TAG, "Provisioned and provisioning window closed, shutting BLE down");
+        BluetoothStop();
+      } else {
+        wait = pdMS_TO_TICKS(BLE_LIFECYCLE_RECHECK_MS);  // Not provisioned yet or a phone is still connected
+      }
+    }
+
+    requests = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &requests, wait);
+  }
+}
+
+static struct {
+  struct arg_str *action;
+  struct arg_end *end;
+} ble_args;
+
+static int BluetoothConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&ble_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, ble_args.end, argv[0]);
+    return 1;
+  }
+
+  const char *action = ble_args.action->sval[0];
+  if (strcmp(action, "start") == 0) {
+    BluetoothRequest();
+  } else if (strcmp(action, "stop") == 0) {
+    BluetoothRelease();
+  } else if (strcmp(action, "status") == 0) {
+    printf("BLE: %s, connections: %d\n", ble_running ? "running" : "stopped", ble_connections);
+    printf("last shutdown reclaimed %d bytes, largest free block grew by %d bytes\n", ble_heap_reclaimed, ble_largest_block_gain);
+    printf("free heap: %d, largest free block: %d\n", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+           heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  } else {
+    printf("Unknown action %s\n", action);
+    return 1;
+  }
+  return 0;
+}
+
+static void RegisterBluetooth(void) {
+  ble_args.action = arg_str1(NULL, NULL, "<start|stop|status>", "start opens a new provisioning window, stop shuts BLE down now");
+  ble_args.end = arg_end(2);
+  const esp_console_cmd_t cmd = {
+      .command = "ble", .help = "Control the BLE provisioning lifecycle", .hint = NULL, .func = &BluetoothConsoleCmd, .argtable = &ble_args};
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupBluetooth() {
+  // The controller runs BLE only, its classic BT memory can go to the heap without stopping BLE from restarting
+  esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT);
+  telemetry_timer = BudgetCreateTimer(TAG, "BLE telemetry timer", pdMS_TO_TICKS(BLE_TELEMETRY_INTERVAL_MS), pdTRUE, NotifyTelemetry,
+                                      &telemetry_timer_buffer);
+  // The NimBLE host task is created by nimble_port_freertos_init and comes from the heap
+  BluetoothLifecycle = BudgetCreateTask(TAG, BluetoothLifecycleTask, "BluetoothLifecycleTask", BLUETOOTH_LIFECYCLE_STACK, NULL,
+                                        BLUETOOTH_LIFECYCLE_PRIORITY, BLUETOOTH_LIFECYCLE_CORE, BluetoothLifecycleStack,
+                                        &BluetoothLifecycleTCB);
+  RegisterBluetooth();
+}
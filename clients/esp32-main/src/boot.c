@@ -0,0 +1,226 @@
+#include "boot.h"
+
+#include <stdio.h>
+
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "memory_budget.h"
+#include "task_config.h"
+
+#define TAG "BOOT"
+#define BOOT_FINISHED BOOT_DEP(23)  // Set once BootRun has stopped waiting, above every module bit
+
+typedef struct BootTiming {
+  int64_t startUs;  // 0 until the step is picked up
+  int64_t readyUs;  // 0 until the module is ready
+  int worker;
+  bool skipped;  // A dependency wasn't ready within BOOT_TIMEOUT_MS so setup never ran
+} BootTiming;
+
+static const BootStep *steps;
+static int stepCount;
+static BootTiming timings[BOOT_MODULE_COUNT];
+static bool started[BOOT_MODULE_COUNT];
+static portMUX_TYPE bootLock = portMUX_INITIALIZER_UNLOCKED;
+static EventGroupHandle_t BootStatus;
+static StaticEventGroup_t BootStatusBuffer;
+static int64_t milestones[BOOT_MILESTONE_COUNT];
+static int64_t deadlineUs;
+static bool succeeded;
+
+static const char *milestoneNames[BOOT_MILESTONE_COUNT] = {
+    [BOOT_FIRST_TEMPERATURE] = "first temperature",
+    [BOOT_WIFI_CONNECTED] = "wifi connected",
+    [BOOT_WEBSOCKET_READY] = "websocket ready",
+};
+
+static const BootStep *FindStep(BootModule module) {
+  for (int i = 0; i < stepCount; i++) {
+    if (steps[i].module == module) return &steps[i];
+  }
+  return NULL;
+}
+
+void BootReady(BootModule module) {
+  if (module >= BOOT_MODULE_COUNT) return;
+  portENTER_CRITICAL(&bootLock);
+  if (timings[module].readyUs == 0) timings[module].readyUs = esp_timer_get_time();
+  portEXIT_CRITICAL(&bootLock);
+  if (BootStatus != NULL) xEventGroupSetBits(BootStatus, BOOT_DEP(module));
+}
+
+void BootMark(BootMilestone milestone) {
+  if (milestone >= BOOT_MILESTONE_COUNT) return;
+  int64_t expected = 0;
+  __atomic_compare_exchange_n(&milestones[milestone], &expected, esp_timer_get_time(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Gives up on every step not started yet, their dependencies will not be ready in time
+static void BootSkipRemaining(int worker) {
+  portENTER_CRITICAL(&bootLock);
+  for (int i = 0; i < stepCount; i++) {
+    if (started[steps[i].module]) continue;
+    started[steps[i].module] = true;
+    timings[steps[i].module].skipped = true;
+    timings[steps[i].module].worker = worker;
+  }
+  portEXIT_CRITICAL(&bootLock);
+
+  for (int i = 0; i < stepCount; i++) {
+    BootTiming *t = &timings[steps[i].module];
+    if (t->skipped && t->worker == worker) {
+      ESP_LOGE(TAG, "Skipped %s, its dependencies were not ready after %d ms", steps[i].name, BOOT_TIMEOUT_MS);
+    }
+  }
+}
+
+// Takes steps whose dependencies are ready until none are left to start or BOOT_TIMEOUT_MS runs out
+static void BootWork(int worker) {
+  EventBits_t ready, waitFor;
+  int next, remaining;
+  int64_t leftUs;
+
+  while (true) {
+    ready = xEventGroupGetBits(BootStatus);
+    next = -1;
+    remaining = 0;
+    waitFor = 0;
+    portENTER_CRITICAL(&bootLock);
+    for (int i = 0; i < stepCount; i++) {
+      if (started[steps[i].module]) continue;
+      if ((steps[i].dependsOn & ready) == steps[i].dependsOn) {
+        if (next < 0) {
+          next = i;
+          started[steps[i].module] = true;
+          timings[steps[i].module].startUs = esp_timer_get_time();
+          timings[steps[i].module].worker = worker;
+        }
+        continue;
+      }
+      remaining++;
+      waitFor |= steps[i].dependsOn & ~ready;
+    }
+    portEXIT_CRITICAL(&bootLock);
+
+    if (next >= 0) {
+      ESP_LOGD(TAG, "Worker %d setting up %s", worker, steps[next].name);
+      steps[next].setup();
+      if (!steps[next].signalsReady) BootReady(steps[next].module);
+      continue;
+    }
+    if (remaining == 0) return;
+    leftUs = deadlineUs - esp_timer_get_time();
+    if (leftUs <= 0) {
+      BootSkipRemaining(worker);
+      return;
+    }
+    // Wakes as soon as any missing dependency is ready, bits set since the read above return straight away
+    xEventGroupWaitBits(BootStatus, waitFor, pdFALSE, pdFALSE, pdMS_TO_TICKS(leftUs / 1000) + 1);
+  }
+}
+
+static void BootWorkerTask(void *args) {
+  BootWork((intptr_t)args);
+  vTaskDelete(NULL);
+}
+
+void BootRun(const BootStep *bootSteps, int count) {
+  EventBits_t all = 0;
+  steps = bootSteps;
+  stepCount = count;
+  for (int i = 0; i < count; i++) all |= BOOT_DEP(steps[i].module);
+  deadlineUs = esp_timer_get_time() + BOOT_TIMEOUT_MS * 1000LL;
+  BootStatus = BudgetCreateEventGroup(TAG, "BootStatus", &BootStatusBuffer);
+
+  // Only needed until boot finishes so these come from the heap and give it back
+  for (intptr_t i = 1; i <= BOOT_WORKERS; i++) {
+    BaseType_t created =
+        xTaskCreatePinnedToCore(BootWorkerTask, "BootWorker", BOOT_WORKER_STACK, (void *)i, BOOT_WORKER_PRIORITY, NULL, tskNO_AFFINITY);
+    if (created != pdPASS) {
+      ESP_LOGW(TAG, "Failed to create boot worker %d, continuing with fewer", (int)i);
+    }
+  }
+  BootWork(0);
+
+  int64_t leftUs = deadlineUs - esp_timer_get_time();
+  EventBits_t bits = xEventGroupWaitBits(BootStatus, all, pdFALSE, pdTRUE, leftUs > 0 ? pdMS_TO_TICKS(leftUs / 1000) + 1 : 0);
+  succeeded = (bits & all) == all;
+  if (!succeeded) ESP_LOGE(TAG, "Some modules were not ready after %d ms", BOOT_TIMEOUT_MS);
+  xEventGroupSetBits(BootStatus, BOOT_FINISHED);
+  BootReport();
+}
+
+bool BootSucceeded(uint32_t waitMs) {
+  if (BootStatus == NULL) return false;
+  EventBits_t bits = xEventGroupWaitBits(BootStatus, BOOT_FINISHED, pdFALSE, pdTRUE, pdMS_TO_TICKS(waitMs));
+  return (bits & BOOT_FINISHED) && succeeded;
+}
+
+// Walks back from a module through whichever dependency became ready last
+static void PrintCriticalPath(BootModule module) {
+  const BootStep *step = FindStep(module);
+  if (step == NULL) return;
+  int latest = -1;
+  for (int dep = 0; dep < BOOT_MODULE_COUNT; dep++) {
+    if (!(step->dependsOn & BOOT_DEP(dep))) continue;
+    if (latest < 0 || timings[dep].readyUs > timings[latest].readyUs) latest = dep;
+  }
+  if (latest >= 0) {
+    PrintCriticalPath(latest);
+    printf(" -> ");
+  }
+  printf("%s (%lld ms)", step->name, (timings[module].readyUs - timings[module].startUs) / 1000);
+}
+
+void BootReport(void) {
+  int i, last = -1;
+  printf("%-12s %6s %9s %9s %6s\n", "module", "worker", "start ms", "ready ms", "took");
+  for (i = 0; i < stepCount; i++) {
+    BootModule module = steps[i].module;
+    BootTiming *t = &timings[module];
+    if (t->skipped) {
+      printf("%-12s %6d %9s %9s %6s\n", steps[i].name, t->worker, "-", "skipped", "-");
+      continue;
+    }
+    if (t->readyUs == 0) {
+      printf("%-12s %6d %9lld %9s %6s\n", steps[i].name, t->worker, t->startUs / 1000, "-", "-");
+      continue;
+    }
+    printf("%-12s %6d %9lld %9lld %6lld\n", steps[i].name, t->worker, t->startUs / 1000, t->readyUs / 1000,
+           (t->readyUs - t->startUs) / 1000);
+    if (last < 0 || t->readyUs > timings[last].readyUs) last = module;
+  }
+
+  if (last >= 0) {
+    printf("critical path: ");
+    PrintCriticalPath(last);
+    printf("\n");
+  }
+  for (i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+    if (milestones[i] == 0) {
+      printf("%s: not yet\n", milestoneNames[i]);
+    } else {
+      printf("%s: %lld ms after startup\n", milestoneNames[i], milestones[i] / 1000);
+    }
+  }
+}
+
+static int BootConsoleCmd(int argc, char **argv) {
+  BootReport();
+  return 0;
+}
+
+void RegisterBoot(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "boot",
+      .help = "Get when each module started and became ready, the boot critical path and time to first temperature and websocket",
+      .hint = NULL,
+      .func = &BootConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
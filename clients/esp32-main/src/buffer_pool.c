@@ -0,0 +1,130 @@
+#include "buffer_pool.h"
+
+#include <stdio.h>
+
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "memory_budget.h"
+#include "perf.h"
+
+#define TAG "BUFFER_POOL"
+
+static BufferPool *pools[BUFFER_POOL_MAX_POOLS];
+static int poolCount;
+static portMUX_TYPE poolsLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t lastAllocs[BUFFER_POOL_MAX_POOLS];
+static int64_t lastSample;
+
+void BufferPoolCreate(const char *module, BufferPool *pool, const char *name, void *blocks, size_t blockSize, int count, uint8_t *refs,
+                      uint8_t *freeListStorage, StaticQueue_t *freeListBuffer) {
+  *pool = (BufferPool){.name = name, .blocks = blocks, .blockSize = blockSize, .count = count, .refs = refs};
+  pool->freeList = BudgetCreateQueue(module, name, count, sizeof(void *), freeListStorage, freeListBuffer);
+  PerfHideQueue(pool->freeList);
+  BudgetAddBuffers(module, name, blockSize * count + count);
+  for (int i = 0; i < count; i++) {
+    void *block = &pool->blocks[i * blockSize];
+    refs[i] = 0;
+    xQueueSend(pool->freeList, &block, 0);
+  }
+
+  portENTER_CRITICAL(&poolsLock);
+  bool full = poolCount >= BUFFER_POOL_MAX_POOLS;
+  if (!full) pools[poolCount++] = pool;
+  portEXIT_CRITICAL(&poolsLock);
+  if (full) ESP_LOGE(TAG, "Pool table full, %s blocks cannot be released", name);
+}
+
+static BufferPool *FindPool(const void *block, int *index) {
+  for (int i = 0; i < poolCount; i++) {
+    BufferPool *pool = pools[i];
+    const uint8_t *start = pool->blocks;
+    if ((const uint8_t *)block >= start && (const uint8_t *)block < start + pool->blockSize * pool->count) {
+      *index = ((const uint8_t *)block - start) / pool->blockSize;
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+void *BufferAlloc(BufferPool *pool, TickType_t wait) {
+  void *block;
+  if (xQueueReceive(pool->freeList, &block, wait) != pdTRUE) {
+    portENTER_CRITICAL(&poolsLock);
+    pool->failures++;
+    portEXIT_CRITICAL(&poolsLock);
+    return NULL;
+  }
+
+  int index = ((uint8_t *)block - pool->blocks) / pool->blockSize;
+  __atomic_store_n(&pool->refs[index], 1, __ATOMIC_RELAXED);
+  portENTER_CRITICAL(&poolsLock);
+  pool->allocs++;
+  pool->inUse++;
+  if (pool->inUse > pool->peakInUse) pool->peakInUse = pool->inUse;
+  portEXIT_CRITICAL(&poolsLock);
+  return block;
+}
+
+void BufferRetain(void *block) {
+  int index;
+  BufferPool *pool = FindPool(block, &index);
+  if (pool != NULL) __atomic_add_fetch(&pool->refs[index], 1, __ATOMIC_RELAXED);
+}
+
+void BufferRelease(void *block) {
+  int index;
+  if (block == NULL) return;
+  BufferPool *pool = FindPool(block, &index);
+  if (pool == NULL) {
+    ESP_LOGE(TAG, "Released %p which is not from any pool", block);
+    return;
+  }
+  if (__atomic_sub_fetch(&pool->refs[index], 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  portENTER_CRITICAL(&poolsLock);
+  pool->inUse--;
+  portEXIT_CRITICAL(&poolsLock);
+  xQueueSend(pool->freeList, &block, 0);  // Never full, it has room for every block
+}
+
+void BufferQueueOverwrite(QueueHandle_t queue, void *block) {
+  void *displaced;
+  while (xQueueSend(queue, &block, 0) != pdTRUE) {
+    if (xQueueReceive(queue, &displaced, 0) == pdTRUE) BufferRelease(displaced);
+  }
+}
+
+// Before pooling every hop copied the whole block into the queue and back out of it
+static int BufferPoolConsoleCmd(int argc, char **argv) {
+  int64_t now = esp_timer_get_time();
+  float seconds = (now - lastSample) / 1000000.0;
+  uint32_t saved = 0;
+
+  printf("%-20s %6s %5s %6s %5s %8s %8s %9s %12s\n", "pool", "block", "count", "in use", "peak", "allocs", "failures", "allocs/s",
+         "copy bytes/s");
+  for (int i = 0; i < poolCount; i++) {
+    BufferPool *p = pools[i];
+    uint32_t allocs = p->allocs;
+    float rate = (allocs - lastAllocs[i]) / seconds;
+    uint32_t bytes = rate * p->blockSize * 2;
+    printf("%-20s %6u %5d %6d %5d %8u %8u %9.2f %12u\n", p->name, p->blockSize, p->count, p->inUse, p->peakInUse, allocs, p->failures,
+           rate, bytes);
+    saved += bytes;
+    lastAllocs[i] = allocs;
+  }
+  printf("memcpy saved: %u bytes/s over the last %.1f s\n", saved, seconds);
+  lastSample = now;
+  return 0;
+}
+
+void RegisterBufferPool(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "pool",
+      .help = "Get buffer pool usage and the queue copy bytes per second it saves since the last call",
+      .hint = NULL,
+      .func = &BufferPoolConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
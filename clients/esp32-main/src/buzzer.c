@@ -1,71 +1,129 @@
 #include "buzzer.h"
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
+#include <freertos/semphr.h>
 
 #include "argtable3/argtable3.h"
+#include "binlog.h"
 #include "config.h"
+#include "console.h"
 #include "driver/ledc.h"
 #include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "helpers.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "soc/soc.h"
 
 #define TAG "BUZZER"
 
-QueueHandle_t BuzzerQueue;
-TaskHandle_t Buzzer;
-BuzzerNote ThermalRunAwayAlarm = {aH_NOTE, 500, 3};
-BuzzerNote MealStarted = {a_NOTE, 100, 6};
-BuzzerNote MealFinished = {b_NOTE, 100, 6};
-BuzzerNote EmergencyStop = {gSH_NOTE, 250, 12};
+static const BuzzerNote ThermalRunAwayAlarmNotes[] = {{aH_NOTE, 500}, {REST, 500}};
+static const BuzzerNote MealStartedNotes[] = {{a_NOTE, 100}, {REST, 100}};
+static const BuzzerNote MealFinishedNotes[] = {{a_NOTE, 150}, {REST, 50}, {cH_NOTE, 150}, {REST, 50}, {eH_NOTE, 150}, {REST, 50}};
+static const BuzzerNote EmergencyStopNotes[] = {{gSH_NOTE, 250}, {REST, 250}};
+static const BuzzerNote ScanRejectedNotes[] = {{e_NOTE, 200}, {REST, 100}};
+
+const BuzzerPattern ThermalRunAwayAlarm = {"ThermalRunAwayAlarm", BUZZER_PRIORITY_ALARM, ThermalRunAwayAlarmNotes, NELEMS(ThermalRunAwayAlarmNotes), 3};
+const BuzzerPattern MealStarted = {"MealStarted", BUZZER_PRIORITY_INFO, MealStartedNotes, NELEMS(MealStartedNotes), 6};
+const BuzzerPattern MealFinished = {"MealFinished", BUZZER_PRIORITY_INFO, MealFinishedNotes, NELEMS(MealFinishedNotes), 2};
+const BuzzerPattern EmergencyStop = {"EmergencyStop", BUZZER_PRIORITY_EMERGENCY, EmergencyStopNotes, NELEMS(EmergencyStopNotes), 12};
+const BuzzerPattern ScanRejected = {"ScanRejected", BUZZER_PRIORITY_INFO, ScanRejectedNotes, NELEMS(ScanRejectedNotes), 2};
 
 #define LEDC_TIMER LEDC_TIMER_0
 #define LEDC_MODE LEDC_LOW_SPEED_MODE
 #define LEDC_CHANNEL LEDC_CHANNEL_0
 #define LEDC_DUTY_RES LEDC_TIMER_10_BIT  // Set duty resolution to 10 bits
 #define LEDC_DUTY 511                    // Set duty to 50%. ((2 ** 10) - 1) * 50% = 511
-#define LEDC_FREQUENCY (5000)            // Frequency in Hertz. Set frequency at 5 kHz
+#define LEDC_FREQUENCY a_NOTE            // Initial frequency, every note sets its own
+#define EDGE_SLACK_US 100                // An edge firing earlier than this before its due time belongs to a preempted note
+// The timer runs from the APB clock through a divider with 10 integer bits, which bounds the frequencies it can make
+#define LEDC_MAX_FREQUENCY (APB_CLK_FREQ >> LEDC_DUTY_RES)
+#define LEDC_MIN_FREQUENCY (LEDC_MAX_FREQUENCY / 1024 + 1)
+
+static SemaphoreHandle_t sequencerLock;
+static StaticSemaphore_t sequencerLockBuffer;
+static esp_timer_handle_t edgeTimer;
+static const BuzzerPattern *current;
+static uint32_t noteIndex;
+static uint32_t repeatIndex;
+static int64_t edgeDue;
+
+// Drives the output for the current note and arms the timer for its trailing edge. Called with sequencerLock held.
+static void StartNote(void) {
+  const BuzzerNote *note = &current->notes[noteIndex];
+  esp_err_t err = ESP_OK;
+  if (note->freq != REST) err = ledc_set_freq(LEDC_MODE, LEDC_TIMER, note->freq);
+  if (err != ESP_OK) ESP_LOGE(TAG, "Skipping %u Hz note of %s: %s", note->freq, current->name, esp_err_to_name(err));
+  // A note the timer can't make is held silent for its duration so the rest of the pattern keeps time
+  if (note->freq != REST && err == ESP_OK) {
+    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, LEDC_DUTY));
+  } else {
+    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, 0));
+  }
+  ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, LEDC_CHANNEL));
 
-void sound(uint32_t freq, uint32_t duration, uint32_t repeats) {
-  static int i = 0;
+  edgeDue = esp_timer_get_time() + note->duration * 1000LL;
+  esp_timer_stop(edgeTimer);
+  ESP_ERROR_CHECK(esp_timer_start_once(edgeTimer, note->duration * 1000ULL));
+}
 
-  // Prepare and then apply the LEDC PWM timer configuration
-  ledc_timer_config_t ledc_timer = {.speed_mode = LEDC_MODE,
-                                    .timer_num = LEDC_TIMER,
-                                    .duty_resolution = LEDC_DUTY_RES,
-                                    .freq_hz = LEDC_FREQUENCY,  // Set output frequency at 5 kHz
-                                    .clk_cfg = LEDC_AUTO_CLK};
-  ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+// Silences the output and forgets the current pattern. Called with sequencerLock held.
+static void Silence(void) {
+  esp_timer_stop(edgeTimer);
+  if (current != NULL) PowerRelease(POWER_LOCK_BUZZER);
+  current = NULL;
+  ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, 0));
+  ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, LEDC_CHANNEL));
+}
 
-  // Prepare and then apply the LEDC PWM channel configuration
-  ledc_channel_config_t ledc_channel = {.speed_mode = LEDC_MODE,
-                                        .channel = LEDC_CHANNEL,
-                                        .timer_sel = LEDC_TIMER,
-                                        .intr_type = LEDC_INTR_DISABLE,
-                                        .gpio_num = BUZZER_PIN,
-                                        .duty = 0,  // Set duty to 0%
-                                        .hpoint = 0};
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+static void NoteEdge(void *arg) {
+  xSemaphoreTake(sequencerLock, portMAX_DELAY);
+  // The pattern was preempted or stopped after this edge was queued
+  if (current == NULL || esp_timer_get_time() < edgeDue - EDGE_SLACK_US) {
+    xSemaphoreGive(sequencerLock);
+    return;
+  }
 
-  for (i = 0; i < repeats; i++) {
-    // start
-    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, LEDC_DUTY));
-    ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, LEDC_CHANNEL));
-    vTaskDelay(pdMS_TO_TICKS(duration));
+  noteIndex++;
+  if (noteIndex >= current->length) {
+    noteIndex = 0;
+    repeatIndex++;
+  }
 
-    // stop
-    ESP_ERROR_CHECK(ledc_set_duty(LEDC_MODE, LEDC_CHANNEL, 0));
-    ESP_ERROR_CHECK(ledc_update_duty(LEDC_MODE, LEDC_CHANNEL));
-    vTaskDelay(pdMS_TO_TICKS(duration));
+  if (repeatIndex >= current->repeats) {
+    BINLOGD(TAG, "Finished %s", current->name);
+    Silence();
+  } else {
+    StartNote();
   }
+  xSemaphoreGive(sequencerLock);
 }
 
-void BuzzerTask(void *pvParameters) {
-  BuzzerNote note;
-  while (true) {
-    xQueueReceive(BuzzerQueue, &note, portMAX_DELAY);
-    ESP_LOGI(TAG, "duration: %d, freq: %d, repeats: %d", note.duration, note.freq, note.repeats);
-    sound(note.freq, note.duration, note.repeats);
+bool BuzzerPlay(const BuzzerPattern *pattern) {
+  if (pattern == NULL || pattern->length == 0 || pattern->repeats == 0) return false;
+
+  xSemaphoreTake(sequencerLock, portMAX_DELAY);
+  if (current != NULL && current->priority > pattern->priority) {
+    ESP_LOGW(TAG, "Dropping %s, %s is playing", pattern->name, current->name);
+    xSemaphoreGive(sequencerLock);
+    return false;
   }
+
+  BINLOGI(TAG, "Playing %s, notes: %d, repeats: %d", pattern->name, pattern->length, pattern->repeats);
+  if (current == NULL) PowerAcquire(POWER_LOCK_BUZZER);
+  current = pattern;
+  noteIndex = 0;
+  repeatIndex = 0;
+  StartNote();
+  xSemaphoreGive(sequencerLock);
+  return true;
+}
+
+void BuzzerStop(void) {
+  xSemaphoreTake(sequencerLock, portMAX_DELAY);
+  Silence();
+  xSemaphoreGive(sequencerLock);
 }
 
 static struct {
@@ -76,12 +134,29 @@ static struct {
 } console_note_args;
 
 static int BuzzerConsoleCmd(int argc, char **argv) {
+  static BuzzerNote notes[2];
+  static BuzzerPattern pattern = {"Console", BUZZER_PRIORITY_WARNING, notes, NELEMS(notes), 0};
+
   int nerrors = arg_parse(argc, argv, (void **)&console_note_args);
   if (nerrors != 0) {
     arg_print_errors(stderr, console_note_args.end, argv[0]);
     return 1;
   }
-  sound(console_note_args.freq->ival[0], console_note_args.duration->ival[0], console_note_args.repeats->ival[0]);
+  int freq = console_note_args.freq->ival[0];
+  if (freq < LEDC_MIN_FREQUENCY || freq > LEDC_MAX_FREQUENCY) {
+    printf("Frequency must be %d to %d Hz\n", LEDC_MIN_FREQUENCY, LEDC_MAX_FREQUENCY);
+    return 1;
+  }
+  if (console_note_args.duration->ival[0] < 1 || console_note_args.repeats->ival[0] < 1) {
+    printf("Duration and repeats must be at least 1\n");
+    return 1;
+  }
+
+  BuzzerStop();
+  notes[0] = (BuzzerNote){freq, console_note_args.duration->ival[0]};
+  notes[1] = (BuzzerNote){REST, console_note_args.duration->ival[0]};
+  pattern.repeats = console_note_args.repeats->ival[0];
+  BuzzerPlay(&pattern);
   return 0;
 }
 
@@ -93,12 +168,33 @@ void RegisterBuzzer(void) {
   const esp_console_cmd_t buzzer_cmd = {
       .command = "buzzer", .help = "Play a sound via the buzzer", .hint = NULL, .func = &BuzzerConsoleCmd, .argtable = &console_note_args};
 
-  ESP_ERROR_CHECK(esp_console_cmd_register(&buzzer_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&buzzer_cmd));
 }
 
 void SetupBuzzer(void) {
-  BuzzerQueue = xQueueCreate(3, sizeof(BuzzerNote));
-  xTaskCreate(BuzzerTask, "BuzzerTask", 2048, NULL, 1, &Buzzer);
-  vTaskDelay(pdMS_TO_TICKS(1000));
+  // Prepare and then apply the LEDC PWM timer configuration
+  ledc_timer_config_t ledc_timer = {.speed_mode = LEDC_MODE,
+                                    .timer_num = LEDC_TIMER,
+                                    .duty_resolution = LEDC_DUTY_RES,
+                                    .freq_hz = LEDC_FREQUENCY,
+                                    .clk_cfg = LEDC_AUTO_CLK};
+  ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+
+  // Prepare and then apply the LEDC PWM channel configuration
+  ledc_channel_config_t ledc_channel = {.speed_mode = LEDC_MODE,
+                                        .channel = LEDC_CHANNEL,
+                                        .timer_sel = LEDC_TIMER,
+                                        .intr_type = LEDC_INTR_DISABLE,
+                                        .gpio_num = BUZZER_PIN,
+                                        .duty = 0,  // Set duty to 0%
+                                        .hpoint = 0};
+  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+
+  sequencerLock = BudgetCreateMutex(TAG, "sequencerLock", &sequencerLockBuffer);
+  const esp_timer_create_args_t edge_timer_args = {
+      .callback = &NoteEdge,
+      .name = "BuzzerEdge",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&edge_timer_args, &edgeTimer));
   RegisterBuzzer();
-}
\ No newline at end of file
+}
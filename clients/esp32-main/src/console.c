@@ -16,11 +16,22 @@
 #include "esp_system.h"
 #include "flash.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "sdkconfig.h"
 
 #define TAG "CONSOLE"
 
+static SemaphoreHandle_t registerLock;
+static StaticSemaphore_t registerLockBuffer;
+
+esp_err_t ConsoleRegister(const esp_console_cmd_t *cmd) {
+  xSemaphoreTake(registerLock, portMAX_DELAY);
+  esp_err_t err = esp_console_cmd_register(cmd);
+  xSemaphoreGive(registerLock);
+  return err;
+}
+
 /* 'version' command */
 static int GetVersion(int argc, char **argv) {
   const char *model;
@@ -63,7 +74,7 @@ static void RegisterVersion(void) {
       .hint = NULL,
       .func = &GetVersion,
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 /** 'restart' command restarts the program */
@@ -80,7 +91,7 @@ static void RegisterRestart(void) {
       .hint = NULL,
       .func = &Restart,
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 /** 'free' command prints available heap memory */
@@ -97,7 +108,7 @@ static void RegisterFree(void) {
       .hint = NULL,
       .func = &FreeMem,
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 /* 'heap' command prints minumum heap size */
@@ -116,7 +127,7 @@ static void RegisterHeap(void) {
       .hint = NULL,
       .func = &HeapSize,
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&heap_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&heap_cmd));
 }
 
 static int TasksInfo(int argc, char **argv) {
@@ -144,7 +155,7 @@ static void RegisterTasks(void) {
       .hint = NULL,
       .func = &TasksInfo,
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 /** 'deep_sleep' command puts the chip into deep sleep mode */
@@ -223,7 +234,7 @@ static void RegisterDeepSleep(void) {
     .func = &DeepSleep,
     .argtable = &deep_sleep_args
   };
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 /** 'light_sleep' command puts the chip into light sleep mode */
@@ -310,7 +321,7 @@ static void RegisterLightSleep(void) {
                                  .hint = NULL,
                                  .func = &LightSleep,
                                  .argtable = &light_sleep_args};
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 static struct {
@@ -336,11 +347,12 @@ static void RegisterLogLevel(void) {
 
   const esp_console_cmd_t cmd = {
       .command = "log_level", .help = "Change log level. ", .hint = NULL, .func = &LogLevel, .argtable = &log_level_args};
-  ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
 }
 
 void SetupConsole(void) {
   ESP_LOGD(TAG, "Setting up console");
+  registerLock = xSemaphoreCreateMutexStatic(&registerLockBuffer);
   esp_console_repl_t *repl = NULL;
   esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
   esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
@@ -0,0 +1,155 @@
+#include "control_bench.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "config.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "task_config.h"
+
+#define TAG "CONTROL_BENCH"
+
+typedef struct ControlBenchResult {
+  uint32_t samples;
+  int64_t minLateUs;
+  int64_t maxLateUs;
+  int64_t sumLateUs;
+  int64_t sumSquaresLateUs;
+  uint32_t floodPackets;
+} ControlBenchResult;
+
+static ControlBenchResult result;
+static volatile bool running;
+static int64_t deadline;
+static TaskHandle_t caller;
+
+static void ProbeTask(void *args) {
+  const TickType_t period = pdMS_TO_TICKS(CONTROL_BENCH_PERIOD_MS);
+  const int64_t periodUs = CONTROL_BENCH_PERIOD_MS * 1000LL;
+  TickType_t wake = xTaskGetTickCount();
+  int64_t expected = esp_timer_get_time() + periodUs;
+  int64_t late;
+
+  while (esp_timer_get_time() < deadline) {
+    vTaskDelayUntil(&wake, period);
+    late = esp_timer_get_time() - expected;
+    expected += periodUs;
+    if (late < 0) late = 0;  // tick and esp_timer drift apart by a few us
+
+    result.samples++;
+    result.sumLateUs += late;
+    result.sumSquaresLateUs += late * late;
+    if (late < result.minLateUs) result.minLateUs = late;
+    if (late > result.maxLateUs) result.maxLateUs = late;
+  }
+  running = false;
+  xTaskNotifyGive(caller);
+  vTaskDelete(NULL);
+}
+
+// Keeps the Wi-Fi driver and LwIP as busy as they can be, both run on PRO_CPU
+static void FloodTask(void *args) {
+  static char payload[CONTROL_BENCH_FLOOD_PAYLOAD];
+  struct sockaddr_in dest = {
+      .sin_family = AF_INET,
+      .sin_port = htons(CONTROL_BENCH_FLOOD_PORT),
+      .sin_addr.s_addr = htonl(INADDR_BROADCAST),
+  };
+  int broadcast = 1;
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Failed to open flood socket");
+    vTaskDelete(NULL);
+  }
+  setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast));
+
+  while (running) {
+    if (sendto(sock, payload, sizeof(payload), 0, (struct sockaddr *)&dest, sizeof(dest)) > 0) {
+      result.floodPackets++;
+    } else {
+      vTaskDelay(1);  // Out of buffers, a yield would spin since nothing else at this priority frees them
+    }
+  }
+  close(sock);
+  vTaskDelete(NULL);
+}
+
+static struct {
+  struct arg_int *seconds;
+  struct arg_lit *flood;
+  struct arg_lit *unpinned;
+  struct arg_end *end;
+} bench_args;
+
+static int ControlBenchConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&bench_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, bench_args.end, argv[0]);
+    return 1;
+  }
+  if (running) {
+    printf("Benchmark already running\n");
+    return 1;
+  }
+
+  int seconds = bench_args.seconds->count ? bench_args.seconds->ival[0] : CONTROL_BENCH_DEFAULT_SECONDS;
+  bool flood = bench_args.flood->count > 0;
+  bool unpinned = bench_args.unpinned->count > 0;
+  if (flood && !(xEventGroupGetBits(DeviceStatus) & WIFI_CONNECTED)) {
+    printf("Wifi is not connected, cannot flood\n");
+    return 1;
+  }
+
+  memset(&result, 0, sizeof(result));
+  result.minLateUs = INT64_MAX;
+  running = true;
+  caller = xTaskGetCurrentTaskHandle();
+  deadline = esp_timer_get_time() + seconds * 1000000LL;
+
+  if (flood) {
+    xTaskCreatePinnedToCore(FloodTask, "ControlBenchFlood", CONTROL_BENCH_FLOOD_STACK, NULL, WEBSOCKET_PRIORITY, NULL,
+                            unpinned ? tskNO_AFFINITY : PRO_CPU_NUM);
+  }
+  xTaskCreatePinnedToCore(ProbeTask, "ControlBenchProbe", CONTROL_BENCH_PROBE_STACK, NULL, COOKING_CONTROLLER_PRIORITY, NULL,
+                          unpinned ? tskNO_AFFINITY : COOKING_CONTROLLER_CORE);
+
+  printf("Probing every %d ms for %d s%s%s\n", CONTROL_BENCH_PERIOD_MS, seconds, flood ? " under a UDP flood" : "",
+         unpinned ? ", unpinned" : "");
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  vTaskDelay(pdMS_TO_TICKS(100));  // let the flood task see running is false and close its socket
+
+  if (result.samples == 0) {
+    printf("No samples\n");
+    return 1;
+  }
+  double mean = (double)result.sumLateUs / result.samples;
+  double jitter = sqrt((double)result.sumSquaresLateUs / result.samples - mean * mean);
+  printf("samples: %u\n", result.samples);
+  printf("wake latency: min %lld us, avg %.1f us, max %lld us, jitter (std dev) %.1f us\n", result.minLateUs, mean, result.maxLateUs,
+         jitter);
+  if (flood) printf("flood packets sent: %u (%.0f/s)\n", result.floodPackets, (double)result.floodPackets / seconds);
+  return 0;
+}
+
+void RegisterControlBench(void) {
+  bench_args.seconds = arg_int0("d", "duration", "<s>", "Seconds to run, default 10");
+  bench_args.flood = arg_lit0("f", "flood", "Saturate the network stack with UDP broadcasts while probing");
+  bench_args.unpinned = arg_lit0("u", "unpinned", "Let the probe and flood run on either core");
+  bench_args.end = arg_end(3);
+  const esp_console_cmd_t cmd = {.command = "control_bench",
+                                 .help = "Measure control loop wake latency and jitter, optionally under a network flood",
+                                 .hint = NULL,
+                                 .func = &ControlBenchConsoleCmd,
+                                 .argtable = &bench_args};
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
@@ -2,8 +2,10 @@
 
 #include <string.h>
 
+#include "binlog.h"
 #include "buzzer.h"
 #include "config.h"
+#include "control_bench.h"
 #include "cooking_controller.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -11,108 +13,260 @@
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
 #include "lcd.h"
+#include "memory_budget.h"
+#include "perf.h"
+#include "power.h"
+#include "relay_accounting.h"
 #include "relay_controller.h"
+#include "simulation.h"
+#include "task_config.h"
 #include "temperature_sensor.h"
 #include "time.h"
+#include "trace.h"
+#include "zone.h"
 #define TAG "COOKING_CONTROLLER"
 
 TaskHandle_t CookingController;
-QueueHandle_t RecipeQueue;
+STATIC_TASK(CookingController, COOKING_CONTROLLER_STACK);
+BufferPool RecipePool;
+STATIC_BUFFER_POOL(RecipePool, RECIPE_POOL_SIZE, Recipe);
+QueueHandle_t CookingStatusQueue;
+static StaticQueue_t CookingStatusQueueBuffer;
 
-void CookingControllerTask(void *PvParams) {
-  float temperature = 0.0;
-  Recipe recipe;
-  Temperature temp_reading;
-  EventBits_t heat_element_mask;
-  EventBits_t bits;
-  int count = 0;
-  int hours;
-  int minutes;
-  int seconds;
-  LCDMessage msg = {
-      .row = 2,
-      .col = 0,
-      .text = "Time Left: ",
-  };
-  while (true) {
-    xQueueReceive(RecipeQueue, &recipe, portMAX_DELAY);
-    time_t startTime = time(NULL);
-    while ((long long)startTime < 30000) {
-      ESP_LOGW(TAG, "Time not yet synced. Waiting");
-      vTaskDelay(1000);
-      startTime = time(NULL);
+// One controller per zone, all stepped by CookingControllerTask
+typedef struct ZoneController {
+  QueueHandle_t recipes;  // Recipe pointers waiting to start, one deep
+  StaticQueue_t recipesBuffer;
+  uint8_t recipesStorage[sizeof(Recipe *)];
+  Recipe *recipe;  // NULL while idle
+  time_t startTime;
+  EventBits_t heatElements;
+  uint32_t lastSeq;
+  int staleCount;
+  TickType_t restUntil;
+} ZoneController;
+
+static ZoneController controllers[ZONE_COUNT];
+static const char *recipeQueueNames[] = {"RecipeQueue0", "RecipeQueue1", "RecipeQueue2"};
+static int cookingZones;
+static CookingState states[ZONE_COUNT];
+static CookUsage lastCooks[ZONE_COUNT];
+static portMUX_TYPE stateLock = portMUX_INITIALIZER_UNLOCKED;
+
+void CookingControllerGetState(int zone, CookingState *out) {
+  portENTER_CRITICAL(&stateLock);
+  *out = states[zone];
+  portEXIT_CRITICAL(&stateLock);
+}
+
+void CookingControllerLastCook(int zone, CookUsage *out) {
+  portENTER_CRITICAL(&stateLock);
+  *out = lastCooks[zone];
+  portEXIT_CRITICAL(&stateLock);
+}
+
+// A start or finish, published with the state it leads to so a reader never sees one without the other
+static void SetEdge(int zone, int setpoint, char temperatureUnit, int32_t remainingSeconds, const CookUsage *usage) {
+  portENTER_CRITICAL(&stateLock);
+  states[zone].setpoint = setpoint;
+  states[zone].temperatureUnit = temperatureUnit;
+  states[zone].remainingSeconds = remainingSeconds;
+  states[zone].edges++;
+  if (usage != NULL) {
+    lastCooks[zone] = *usage;
+    lastCooks[zone].edge = states[zone].edges;
+  }
+  portEXIT_CRITICAL(&stateLock);
+  xQueueSend(CookingStatusQueue, NULL, 0);
+}
+
+static void SetState(int zone, int setpoint, char temperatureUnit, int32_t remainingSeconds) {
+  portENTER_CRITICAL(&stateLock);
+  states[zone].setpoint = setpoint;
+  states[zone].temperatureUnit = temperatureUnit;
+  states[zone].remainingSeconds = remainingSeconds;
+  portEXIT_CRITICAL(&stateLock);
+}
+
+bool CookingControllerSubmit(Recipe *recipe, TickType_t wait) {
+  if (PerfQueueSend(controllers[recipe->zone].recipes, &recipe, wait) != pdTRUE) return false;
+  xTaskNotifyGive(CookingController);
+  return true;
+}
+
+int CookingControllerIdleZone(void) {
+  CookingState state;
+  if (CookingController == NULL) return -1;  // Called by the scanner, which can start first
+  for (int zone = 0; zone < ZONE_COUNT; zone++) {
+    CookingControllerGetState(zone, &state);
+    if (state.temperatureUnit == 0 && uxQueueMessagesWaiting(controllers[zone].recipes) == 0) return zone;
+  }
+  return -1;
+}
+
+void CookingControlStep(const Recipe *recipe, const Temperature *reading, EventBits_t heatElementMask) {
+  int temperature = strcmp(recipe->temperatureUnit, "C") == 0 ? reading->c : reading->f;
+  Trace(TRACE_CONTROL_DECISION, reading->seq);
+  if (abs(temperature - recipe->temperature) >= 5) {  // Leave the elements alone inside the band
+    RelayControllerSetCause(reading->seq);
+    if (temperature < recipe->temperature) {
+      xEventGroupSetBits(RelayControllerFlags, heatElementMask);
+    } else {
+      xEventGroupClearBits(RelayControllerFlags, heatElementMask);
     }
-    msg.col = 0;
-    strcpy(msg.text, "Time Left: ");
-    xQueueSend(LCDQueue, &msg, portMAX_DELAY);
-    msg.col = 11;
-    xQueueSend(BuzzerQueue, (void *)&MealStarted, 100);
+  }
+}
+
+static void ZoneStart(int zone, Recipe *recipe, time_t now) {
+  ZoneController *c = &controllers[zone];
+  const ZoneConfig *config = &Zones[zone];
+  c->recipe = recipe;
+  c->startTime = now;
+  c->lastSeq = 0;
+  c->staleCount = 0;
+  ESP_LOGI(TAG, "Zone %d cooking %s at %d %s", zone, recipe->applianceMode, recipe->temperature, recipe->temperatureUnit);
+  if (zone == 0) LCDSetField(LCD_FIELD_STATUS, "Cooking");
+  RelayAccountingCookStart(zone);
+  SetEdge(zone, recipe->temperature, recipe->temperatureUnit[0], recipe->cookingTime / 1000, NULL);
+  BuzzerPlay(&MealStarted);
+  if (cookingZones++ == 0) {
+    PowerSetCooking(true);
     xEventGroupSetBits(DeviceStatus, IS_COOKING);
     xEventGroupSetBits(RelayControllerFlags, INDICATOR_LIGHT);
+  }
+
+  c->heatElements = config->topElement | config->bottomElement;
+  if (strcmp(recipe->applianceMode, "Broil") == 0) {
+    c->heatElements = config->topElement;
+  } else if (strcmp(recipe->applianceMode, "Convection") == 0) {
+    xEventGroupSetBits(RelayControllerFlags, config->fan);
+  } else if (strcmp(recipe->applianceMode, "Rotisserie") == 0) {
+    xEventGroupSetBits(RelayControllerFlags, config->rotisserie);
+  }
+}
+
+static void ZoneFinish(int zone) {
+  ZoneController *c = &controllers[zone];
+  CookUsage usage;
+  xEventGroupClearBits(RelayControllerFlags, ZONE_RELAYS(&Zones[zone]));
+  if (--cookingZones == 0) {
+    xEventGroupClearBits(RelayControllerFlags, INDICATOR_LIGHT);
+    xEventGroupClearBits(DeviceStatus, IS_COOKING);
+    PowerSetCooking(false);
+  }
+  usage.count = RelayAccountingCookEnd(zone, usage.relays, ZONE_MAX_RELAYS);
+  SetEdge(zone, 0, 0, 0, &usage);
+  if (zone == 0) LCDSetField(LCD_FIELD_STATUS, "%s", (xEventGroupGetBits(DeviceStatus) & EMERGENCY_STOP) ? "E-STOP" : "Done");
+  BuzzerPlay(&MealFinished);
+  BufferRelease(c->recipe);
+  c->recipe = NULL;
+  c->restUntil = xTaskGetTickCount() + pdMS_TO_TICKS(COOKING_REST_MS);
+}
+
+// One period of one zone: starts a waiting recipe once the zone has rested, then runs the control loop
+static void ZoneStep(int zone, time_t now, bool emergencyStop) {
+  ZoneController *c = &controllers[zone];
+  Temperature reading;
+  int timeLeft, hours, minutes, seconds;
 
-    heat_element_mask = TOP_HEATING_ELEMENT | BOTTOM_HEATING_ELEMENT;
-    if (strcmp(recipe.applianceMode, "Broil") == 0) {
-      heat_element_mask = TOP_HEATING_ELEMENT;
-    } else if (strcmp(recipe.applianceMode, "Convection") == 0) {
-      xEventGroupSetBits(RelayControllerFlags, CONVECTION_FAN);
-    } else if (strcmp(recipe.applianceMode, "Rotisserie") == 0) {
-      xEventGroupSetBits(RelayControllerFlags, ROTISERRIE);
+  if (c->recipe == NULL) {
+    if (emergencyStop || (int32_t)(xTaskGetTickCount() - c->restUntil) < 0) return;
+    if (uxQueueMessagesWaiting(c->recipes) == 0) return;
+    if ((long long)now < 30000) {
+      ESP_LOGW(TAG, "Time not yet synced. Waiting");
+      return;
     }
-    ESP_LOGV("Appliance mode", "%s", recipe.applianceMode);
-
-    time_t remainingTime = time(NULL) - startTime;
-    while (remainingTime < (recipe.cookingTime / 1000)) {  // convert to seconds
-      if (!xQueuePeek(TempSensorQueue, &temp_reading, pdMS_TO_TICKS(1000))) {
-        count++;
-        if (count > 10) {
-          ESP_LOGE(TAG, "Unable to read temperature sensor");
-          break;
-        }
-      } else {
-        count = 0;
-      }
-
-      temperature = strcmp(recipe.temperatureUnit, "C") == 0 ? temp_reading.c : temp_reading.f;
-      if (abs(temperature - recipe.temperature) < 5) {
-        continue;
-      } else if (temperature < recipe.temperature) {
-        xEventGroupSetBits(RelayControllerFlags, heat_element_mask);
-      } else {
-        xEventGroupClearBits(RelayControllerFlags, heat_element_mask);
-      }
-
-      // If we get a replacement recipe
-      if (uxQueueMessagesWaiting(RecipeQueue)) {
-        ESP_LOGW(TAG, "Received new recipe");
-        break;
-      }
-
-      bits = xEventGroupWaitBits(DeviceStatus, EMERGENCY_STOP, pdFALSE, pdFALSE, pdMS_TO_TICKS(10));
-      if (bits & EMERGENCY_STOP) {
-        ESP_LOGE(TAG, "EMERGENCY STOP: STOPPING COOKING");
-        break;
-      }
-      remainingTime = time(NULL) - startTime;
-
-      // convert time in seconds to HH:MM:SS string
-      hours = remainingTime / 3600;
-      minutes = (remainingTime % 3600) / 60;
-      seconds = remainingTime % 60;
-      ESP_LOGI(TAG, "Remaining time: %02d:%02d:%02d", hours, minutes, seconds);
-      sprintf(msg.text, "%02d:%02d:%02d", hours, minutes, seconds);
-      xQueueSend(LCDQueue, &msg, pdMS_TO_TICKS(100));
+    Recipe *recipe;
+    xQueueReceive(c->recipes, &recipe, 0);
+    ZoneStart(zone, recipe, now);
+  }
+
+  if (emergencyStop) {
+    ZoneFinish(zone);
+    return;
+  }
+  if (uxQueueMessagesWaiting(c->recipes)) {  // A replacement recipe
+    ESP_LOGW(TAG, "Zone %d received new recipe", zone);
+    ZoneFinish(zone);
+    return;
+  }
+  timeLeft = (c->recipe->cookingTime / 1000) - (now - c->startTime);
+  if (timeLeft <= 0) {
+    ZoneFinish(zone);
+    return;
+  }
+
+  TempSensorGetLatest(zone, &reading);
+  if (reading.seq == c->lastSeq || reading.faults) {
+    // No heat on a reading that can't be trusted, and give up if the sensor doesn't come back
+    if (reading.faults) xEventGroupClearBits(RelayControllerFlags, c->heatElements);
+    if (++c->staleCount > COOKING_SENSOR_STALE_PERIODS) {
+      ESP_LOGE(TAG, "Unable to read zone %d temperature sensor, faults 0x%x", zone, reading.faults);
+      ZoneFinish(zone);
+      return;
+    }
+  } else {
+    c->lastSeq = reading.seq;
+    c->staleCount = 0;
+  }
+  if (reading.seq != 0 && !reading.faults) CookingControlStep(c->recipe, &reading, c->heatElements);
+
+  // convert time in seconds to HH:MM:SS string
+  SetState(zone, c->recipe->temperature, c->recipe->temperatureUnit[0], timeLeft);
+  hours = timeLeft / 3600;
+  minutes = (timeLeft % 3600) / 60;
+  seconds = timeLeft % 60;
+  BINLOGI(TAG, "Zone %d remaining time: %02d:%02d:%02d", zone, hours, minutes, seconds);
+  if (zone == 0) LCDSetField(LCD_FIELD_TIME_REMAINING, "%02d:%02d:%02d", hours, minutes, seconds);
+}
+
+static bool ZonesBusy(void) {
+  for (int zone = 0; zone < ZONE_COUNT; zone++) {
+    if (controllers[zone].recipe != NULL || uxQueueMessagesWaiting(controllers[zone].recipes)) return true;
+  }
+  return false;
+}
+
+// Control executive, steps every zone once a period. Sleeps until a recipe is submitted when there's nothing to do.
+void CookingControllerTask(void *PvParams) {
+  bool emergencyStop;
+  bool wasStopped = false;
+  while (true) {
+    if (!ZonesBusy()) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    emergencyStop = xEventGroupGetBits(DeviceStatus) & EMERGENCY_STOP;
+    if (emergencyStop && !wasStopped && cookingZones > 0) {
+      ESP_LOGE(TAG, "EMERGENCY STOP: STOPPING COOKING");
+      BuzzerPlay(&EmergencyStop);
+    }
+    wasStopped = emergencyStop;
+
+    PowerAcquire(POWER_LOCK_CONTROL);
+    time_t now = SIM_TIME();
+    for (int zone = 0; zone < ZONE_COUNT; zone++) ZoneStep(zone, now, emergencyStop);
+    PowerRelease(POWER_LOCK_CONTROL);
+
+    // Paces the loop to the sensor and still reacts to an emergency stop straight away
+    if (emergencyStop) {
+      vTaskDelay(SIM_TICKS(COOKING_CONTROL_PERIOD_MS));
+    } else {
+      xEventGroupWaitBits(DeviceStatus, EMERGENCY_STOP, pdFALSE, pdFALSE, SIM_TICKS(COOKING_CONTROL_PERIOD_MS));
     }
-    xEventGroupClearBits(RelayControllerFlags, INDICATOR_LIGHT | TOP_HEATING_ELEMENT | BOTTOM_HEATING_ELEMENT | CONVECTION_FAN | ROTISERRIE);
-    xEventGroupClearBits(DeviceStatus, IS_COOKING);
-    xQueueSend(BuzzerQueue, (void *)&MealFinished, 100);
-    vTaskDelay(5000);
   }
 }
 
 void SetupCookingController(void) {
   ESP_LOGD(TAG, "Setting up cooking controller");
-  RecipeQueue = xQueueCreate(1, sizeof(Recipe));
-  BaseType_t task = xTaskCreate(CookingControllerTask, "CookingControllerTask", 2048, NULL, 5, &CookingController);
-  if (task == pdFALSE) ESP_LOGE(TAG, "Failed to create cooking controller task");
+  BufferPoolCreate(TAG, &RecipePool, "RecipePool", RecipePoolBlocks, sizeof(Recipe), RECIPE_POOL_SIZE, RecipePoolRefs,
+                   RecipePoolFreeListStorage, &RecipePoolFreeListBuffer);
+  CookingStatusQueue = BudgetCreateQueue(TAG, "CookingStatusQueue", 1, 0, NULL, &CookingStatusQueueBuffer);
+  for (int zone = 0; zone < ZONE_COUNT; zone++) {
+    controllers[zone].recipes = BudgetCreateQueue(TAG, recipeQueueNames[zone], 1, sizeof(Recipe *), controllers[zone].recipesStorage,
+                                                  &controllers[zone].recipesBuffer);
+  }
+  CookingController = BudgetCreateTask(TAG, CookingControllerTask, "CookingControllerTask", COOKING_CONTROLLER_STACK, NULL,
+                                       COOKING_CONTROLLER_PRIORITY, COOKING_CONTROLLER_CORE, CookingControllerStack, &CookingControllerTCB);
+  if (CookingController == NULL) ESP_LOGE(TAG, "Failed to create cooking controller task");
+  RegisterControlBench();
   ESP_LOGD(TAG, "Finished setting up cooking controller");
 }
@@ -2,131 +2,269 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "buzzer.h"
 #include "cJSON.h"
 #include "config.h"
+#include "console.h"
 #include "cooking_controller.h"
+#include "esp_console.h"
 #include "esp_crt_bundle.h"
 #include "esp_http_client.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_tls.h"
 #include "esp_wifi.h"
 #include "helpers.h"
+#include "json_arena.h"
 #include "lcd.h"
+#include "memory_budget.h"
+#include "perf.h"
 #include "qr_scanner.h"
+#include "task_config.h"
 #include "temperature_sensor.h"
+#include "trace.h"
 #include "websocket.h"
 
 #define TAG "DB_MANAGER"
 #define BASE_URL "https://capstone-29ebb-default-rtdb.firebaseio.com"
 
-QueueHandle_t DecodeRecipeQueue;
+typedef enum DBEvent {
+  DB_EVENT_TEMPERATURE,
+  DB_EVENT_STATUS,
+  DB_EVENT_QR_CODE,
+  DB_EVENT_COOKING_STATUS,
+  DB_EVENT_RECIPE,
+  DB_EVENT_COUNT,
+} DBEvent;
 
+typedef struct DBEventHandler {
+  const char *name;
+  QueueHandle_t *queue;  // Member of the queue set, the handler takes one item from it
+  bool (*handle)(void);  // False when the queue turned out empty
+} DBEventHandler;
+
+typedef struct DBEventStats {
+  uint32_t handled;
+  uint32_t dropped;  // Messages for the server that found WebsocketPool exhausted
+  uint32_t maxUs;
+  uint64_t totalUs;
+} DBEventStats;
+
+static QueueHandle_t DecodeRecipeQueue;
+STATIC_QUEUE(DecodeRecipeQueue, DECODE_RECIPE_QUEUE_LENGTH, JSONString *);
+static QueueSetHandle_t events;
+TaskHandle_t DBManager;
+STATIC_TASK(DBManager, DB_MANAGER_STACK);
+STATIC_JSON_ARENA(DBManagerArena, 2048);  // Sized for recipe parsing, the other handlers build small documents
+
+// Built messages waiting for room in WebsocketQueue, handlers never block on the websocket
+static WebSocketMessage *outbox[WEBSOCKET_POOL_SIZE];
+static int outboxCount;
+static bool cookingStatusPending;          // A zone edge couldn't be reported yet
+static uint32_t reportedEdges[ZONE_COUNT];  // CookingState.edges the server has been told about
+static DBEvent current;
+
+static DBEventStats stats[DB_EVENT_COUNT];
+static uint32_t wakeups;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Prints straight into the message, a document too big for it is dropped rather than overflowing
 void createDataString(JSONString *jsonString, cJSON *data) {
-  char *dataString = cJSON_Print(data);
-  strcpy(jsonString->string, dataString);
-  jsonString->length = strlen(dataString);
-  cJSON_free(dataString);
+  if (!cJSON_PrintPreallocated(data, jsonString->string, sizeof(jsonString->string), false)) {
+    ESP_LOGE(TAG, "Data does not fit in %d bytes", sizeof(jsonString->string));
+    jsonString->string[0] = '\0';
+  }
+  jsonString->length = strlen(jsonString->string);
 }
 
-void PostTemperatureTask(void *args) {
+static void OutboxFlush(void) {
+  int sent = 0;
+  while (sent < outboxCount && PerfQueueSend(WebsocketQueue, &outbox[sent], 0) == pdTRUE) {
+    if (outbox[sent]->seq != 0) Trace(TRACE_TEMPERATURE_ENQUEUE, outbox[sent]->seq);
+    sent++;
+  }
+  outboxCount -= sent;
+  memmove(outbox, &outbox[sent], outboxCount * sizeof(outbox[0]));
+}
+
+// Only called with a message from WebsocketPool, so the outbox always has room for it
+static void OutboxPost(WebSocketMessage *msg) {
+  outbox[outboxCount++] = msg;
+  OutboxFlush();
+}
+
+static WebSocketMessage *MessageAlloc(const char *method, const char *path) {
+  WebSocketMessage *msg = WebsocketMessageAlloc(method, path, 0);
+  if (msg == NULL) {
+    portENTER_CRITICAL(&statsLock);
+    stats[current].dropped++;
+    portEXIT_CRITICAL(&statsLock);
+  }
+  return msg;
+}
+
+static bool PostTemperature(void) {
   Temperature temp;
-  cJSON *data = cJSON_CreateObject();
-  cJSON_AddNumberToObject(data, "temperatureC", 0);
-  cJSON_AddNumberToObject(data, "temperatureF", 0);
+  cJSON *data;
+  WebSocketMessage *msg;
+
+  if (xQueueReceive(TempSensorQueue, &temp, 0) != pdTRUE) return false;
+  if (temp.faults) return true;  // No temperature to report, the appliance stops heating a zone that stays faulted
+  msg = MessageAlloc("mutation", "appliance.updateTemperature");
+  if (msg == NULL) return true;  // The next reading replaces it
+  JsonArenaBegin(&DBManagerArena);
+  data = cJSON_CreateObject();
+  cJSON_AddNumberToObject(data, "temperatureC", temp.c);
+  cJSON_AddNumberToObject(data, "temperatureF", temp.f);
+  cJSON_AddNumberToObject(data, "zone", temp.zone);
   cJSON_AddStringToObject(data, "id", ID);
-  WebSocketMessage msg = {.method = "mutation", .path = "appliance.updateTemperature"};
-  while (true) {
-    xQueueReceive(TempSensorQueue, &temp, portMAX_DELAY);
-    cJSON_ReplaceItemInObjectCaseSensitive(data, "temperatureC", cJSON_CreateNumber(temp.c));
-    cJSON_ReplaceItemInObjectCaseSensitive(data, "temperatureF", cJSON_CreateNumber(temp.f));
-    createDataString(&msg.dataString, data);
-    ESP_LOGV(TAG, "Sending temperature data: %s", msg.dataString.string);
-    xQueueSend(WebsocketQueue, &msg, portMAX_DELAY);
-  }
+  createDataString(&msg->dataString, data);
   cJSON_Delete(data);
+  JsonArenaEnd(&DBManagerArena);
+  msg->seq = temp.seq;
+  ESP_LOGV(TAG, "Sending temperature data: %s", msg->dataString.string);
+  OutboxPost(msg);
+  return true;
 }
 
-void UpdateStatusTask(void *args) {
-  cJSON *data = cJSON_CreateObject();
-  cJSON_AddStringToObject(data, "id", ID);
-  cJSON_AddStringToObject(data, "type", "unknown");
-  cJSON_AddStringToObject(data, "message", "unknown");
-  WebSocketMessage msg = {.method = "mutation", .path = "appliance.updateStatus"};
+static bool UpdateStatus(void) {
+  cJSON *data;
+  WebSocketMessage *msg;
   StatusMessage status;
 
-  while (true) {
-    xQueueReceive(StatusMessageQueue, &status, portMAX_DELAY);
-    cJSON_ReplaceItemInObjectCaseSensitive(data, "type", cJSON_CreateString(status.type));
-    cJSON_ReplaceItemInObjectCaseSensitive(data, "message", cJSON_CreateString(status.message));
-    createDataString(&msg.dataString, data);
-    ESP_LOGV(TAG, "Sending status update: %s", msg.dataString.string);
-    xQueueSend(WebsocketQueue, &msg, portMAX_DELAY);
+  if (xQueueReceive(StatusMessageQueue, &status, 0) != pdTRUE) return false;
+  msg = MessageAlloc("mutation", "appliance.updateStatus");
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Dropping status %s: %s", status.type, status.message);
+    return true;
   }
+  JsonArenaBegin(&DBManagerArena);
+  data = cJSON_CreateObject();
+  cJSON_AddStringToObject(data, "id", ID);
+  cJSON_AddStringToObject(data, "type", status.type);
+  cJSON_AddStringToObject(data, "message", status.message);
+  cJSON_AddNumberToObject(data, "zone", status.zone);
+  createDataString(&msg->dataString, data);
   cJSON_Delete(data);
+  JsonArenaEnd(&DBManagerArena);
+  ESP_LOGV(TAG, "Sending status update: %s", msg->dataString.string);
+  OutboxPost(msg);
+  return true;
 }
 
-void SetQRCodeTask(void *args) {
-  cJSON *data = cJSON_CreateObject();
-  cJSON_AddStringToObject(data, "id", ID);
-  cJSON_AddStringToObject(data, "qrCode", "unknown");
-  char qrCode[QR_CODE_LENGTH] = "";
-  WebSocketMessage msg = {.method = "mutation", .path = "appliance.setRecipe"};
+static bool SetQRCode(void) {
+  static const StatusMessage busy = {"alarm", "Every zone is cooking, scan the recipe again once one is free", 0};
+  cJSON *data;
+  QRCode code;
+  int zone;
+  char qrCode[UUID_STRING_LENGTH + 1] = "";
+  WebSocketMessage *msg;
 
-  while (true) {
-    xQueueReceive(QRCodeQueue, &qrCode, portMAX_DELAY);
-    cJSON_ReplaceItemInObjectCaseSensitive(data, "qrCode", cJSON_CreateString(qrCode));
-    createDataString(&msg.dataString, data);
-    ESP_LOGV(TAG, "Sending QR Code: %s", qrCode);
-    xQueueSend(WebsocketQueue, &msg, portMAX_DELAY);
+  if (xQueueReceive(QRCodeQueue, &code, 0) != pdTRUE) return false;
+  UUIDFormat(code.uuid, qrCode);
+  zone = CookingControllerIdleZone();
+  if (zone < 0) {
+    ESP_LOGW(TAG, "Every zone is busy, rejecting QR Code %s", qrCode);
+    BuzzerPlay(&ScanRejected);
+    xQueueSend(StatusMessageQueue, &busy, 0);  // Handled on a later pass of this task
+    return true;
   }
+  msg = MessageAlloc("mutation", "appliance.setRecipe");
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Dropping QR Code %s, scan it again", qrCode);
+    return true;
+  }
+  JsonArenaBegin(&DBManagerArena);
+  data = cJSON_CreateObject();
+  cJSON_AddStringToObject(data, "id", ID);
+  cJSON_AddStringToObject(data, "qrCode", qrCode);
+  cJSON_AddNumberToObject(data, "zone", zone);  // The server sends it back with the recipe
+  createDataString(&msg->dataString, data);
   cJSON_Delete(data);
+  JsonArenaEnd(&DBManagerArena);
+  ESP_LOGV(TAG, "Sending QR Code: %s", qrCode);
+  OutboxPost(msg);
+  return true;
 }
 
-void MonitorCookingStatusTask(void *args) {
-  cJSON *data = cJSON_CreateObject();
-  cJSON_AddStringToObject(data, "id", ID);
-  EventBits_t bits;
-  LCDMessage LCDMsg = {
-      .row = 3,
-      .col = 0,
-  };
-  bool cookingStatus = false;
-  bool newestCookingStatus = false;
+// What the zone's relays did over the cook that ended on edge, and their lifetime wear as of then. The controller only
+// keeps the last cook's usage, a stop reported after the zone already finished another one goes without it.
+static void AddCookUsage(cJSON *data, int zone, uint32_t edge) {
+  CookUsage usage;
+  float energyWh = 0;
+  CookingControllerLastCook(zone, &usage);
+  if (usage.edge != edge) {
+    ESP_LOGW(TAG, "Zone %d finished again before its stop was sent, no usage for it", zone);
+    return;
+  }
+  cJSON *relays = cJSON_AddArrayToObject(data, "relays");
+  for (int i = 0; i < usage.count; i++) {
+    cJSON *relay = cJSON_CreateObject();
+    cJSON_AddNumberToObject(relay, "channel", usage.relays[i].channel);
+    cJSON_AddNumberToObject(relay, "onSeconds", usage.relays[i].onSeconds);
+    cJSON_AddNumberToObject(relay, "cycles", usage.relays[i].cycles);
+    cJSON_AddNumberToObject(relay, "energyWh", roundf(usage.relays[i].energyWh * 10) / 10);
+    cJSON_AddNumberToObject(relay, "lifetimeCycles", usage.relays[i].lifetimeCycles);
+    cJSON_AddNumberToObject(relay, "lifetimeHours", roundf(usage.relays[i].lifetimeHours * 100) / 100);
+    cJSON_AddItemToArray(relays, relay);
+    energyWh += usage.relays[i].energyWh;
+  }
+  cJSON_AddNumberToObject(data, "energyWh", roundf(energyWh * 10) / 10);
+}
 
-  WebSocketMessage msg = {.method = "mutation"};
-  createDataString(&msg.dataString, data);
-  while (true) {
-    bits = xEventGroupGetBits(DeviceStatus);
-    newestCookingStatus = bits & IS_COOKING;
-    if (cookingStatus != newestCookingStatus) {
-      cookingStatus = newestCookingStatus;
-      strcpy(msg.path, cookingStatus ? "appliance.cookingStart" : "appliance.cookingStop");
-      ESP_LOGV(TAG, "Setting cooking status to %s", cookingStatus ? "true" : "false");
-      xQueueSend(WebsocketQueue, &msg, portMAX_DELAY);
-
-      if (!cookingStatus) {  // Clear the LCD
-        LCDMsg.row = 2;
-        xQueueSend(LCDQueue, &LCDMsg, pdMS_TO_TICKS(1000));
-        LCDMsg.row = 3;
-        xQueueSend(LCDQueue, &LCDMsg, pdMS_TO_TICKS(1000));
+// Tells the server about every start and stop it hasn't heard yet, in order, so a zone that stops and starts again
+// while messages can't be sent still shows up as both. Whatever can't be sent yet stays pending and is retried.
+static void ReportCookingStatus(void) {
+  cJSON *data;
+  CookingState state;
+  bool start, stopped;
+  WebSocketMessage *msg;
+
+  cookingStatusPending = false;
+  for (int zone = 0; zone < ZONE_COUNT; zone++) {
+    CookingControllerGetState(zone, &state);
+    stopped = false;
+    while (reportedEdges[zone] != state.edges) {
+      start = reportedEdges[zone] % 2 == 0;  // Edges alternate from a start
+      msg = MessageAlloc("mutation", start ? "appliance.cookingStart" : "appliance.cookingStop");
+      if (msg == NULL) {
+        cookingStatusPending = true;
+        break;
       }
+      reportedEdges[zone]++;
+      JsonArenaBegin(&DBManagerArena);
+      data = cJSON_CreateObject();
+      cJSON_AddStringToObject(data, "id", ID);
+      cJSON_AddNumberToObject(data, "zone", zone);
+      if (!start) {
+        AddCookUsage(data, zone, reportedEdges[zone]);
+        stopped = true;
+      }
+      createDataString(&msg->dataString, data);
+      cJSON_Delete(data);
+      JsonArenaEnd(&DBManagerArena);
+      ESP_LOGV(TAG, "Setting zone %d cooking status to %s", zone, start ? "true" : "false");
+      OutboxPost(msg);
+    }
 
-    } else {
-      vTaskDelay(pdMS_TO_TICKS(1000));
+    if (zone == 0 && stopped && reportedEdges[zone] == state.edges && state.temperatureUnit == 0) {  // Clear the LCD
+      LCDSetField(LCD_FIELD_TIME_REMAINING, "");
+      LCDSetField(LCD_FIELD_RECIPE_NAME, "");
     }
   }
-  cJSON_Delete(data);
 }
 
-void SetRecipeTask(void *args) {
-  JSONString jsonString;
-  Recipe recipe;
-  LCDMessage msg = {
-      .col = 0,
-      .row = 3,
-  };
+static bool CookingStatusChanged(void) {
+  if (xQueueReceive(CookingStatusQueue, NULL, 0) != pdTRUE) return false;
+  ReportCookingStatus();
+  return true;
+}
+
+bool RecipeDecode(JsonArena *arena, const JSONString *jsonString, Recipe *recipe, char *name, size_t nameSize) {
   const cJSON *result = NULL;
   const cJSON *data = NULL;
   const cJSON *recipeJson = NULL;
@@ -137,59 +275,184 @@ void SetRecipeTask(void *args) {
   const cJSON *cookingTime = NULL;
   const cJSON *expiryDate = NULL;
   const cJSON *id = NULL;
-  const cJSON *name = NULL;
+  const cJSON *recipeName = NULL;
+  const cJSON *zone = NULL;
 
-  while (true) {
-    xQueueReceive(DecodeRecipeQueue, &jsonString, portMAX_DELAY);
-    cJSON *json = cJSON_ParseWithLength(jsonString.string, jsonString.length);
+  JsonArenaBegin(arena);
+  cJSON *json = cJSON_ParseWithLength(jsonString->string, jsonString->length);
 
-    result = cJSON_GetObjectItemCaseSensitive(json, "result");
-    data = cJSON_GetObjectItemCaseSensitive(result, "data");
-    recipeJson = cJSON_GetObjectItemCaseSensitive(data, "json");
+  result = cJSON_GetObjectItemCaseSensitive(json, "result");
+  data = cJSON_GetObjectItemCaseSensitive(result, "data");
+  recipeJson = cJSON_GetObjectItemCaseSensitive(data, "json");
+  if (result == NULL) recipeJson = json;  // Pushed over BLE without the websocket envelope
 
-    applianceMode = cJSON_GetObjectItemCaseSensitive(recipeJson, "applianceMode");
-    strcpy(recipe.applianceMode, applianceMode->valuestring);
-    ESP_LOGV(TAG, "applianceMode: %s", recipe.applianceMode);
+  applianceMode = cJSON_GetObjectItemCaseSensitive(recipeJson, "applianceMode");
+  temperature = cJSON_GetObjectItemCaseSensitive(recipeJson, "temperature");
+  temperatureUnit = cJSON_GetObjectItemCaseSensitive(recipeJson, "temperatureUnit");
+  applianceType = cJSON_GetObjectItemCaseSensitive(recipeJson, "applianceType");
+  cookingTime = cJSON_GetObjectItemCaseSensitive(recipeJson, "cookingTime");
+  expiryDate = cJSON_GetObjectItemCaseSensitive(recipeJson, "expiryDate");
+  id = cJSON_GetObjectItemCaseSensitive(recipeJson, "id");
+  recipeName = cJSON_GetObjectItemCaseSensitive(recipeJson, "name");
+  zone = cJSON_GetObjectItemCaseSensitive(recipeJson, "zone");
 
-    temperature = cJSON_GetObjectItemCaseSensitive(recipeJson, "temperature");
-    recipe.temperature = temperature->valuedouble;
-    ESP_LOGV(TAG, "temperature: %d", recipe.temperature);
+  if (!cJSON_IsString(applianceMode) || !cJSON_IsNumber(temperature) || !cJSON_IsString(temperatureUnit) || !cJSON_IsString(applianceType) ||
+      !cJSON_IsNumber(cookingTime) || !cJSON_IsNumber(expiryDate) || !cJSON_IsString(id) || !cJSON_IsString(recipeName) ||
+      (zone != NULL && (!cJSON_IsNumber(zone) || zone->valueint < 0 || zone->valueint >= ZONE_COUNT))) {
+    cJSON_Delete(json);
+    JsonArenaEnd(arena);
+    return false;
+  }
 
-    temperatureUnit = cJSON_GetObjectItemCaseSensitive(recipeJson, "temperatureUnit");
-    strcpy(recipe.temperatureUnit, temperatureUnit->valuestring);
-    ESP_LOGV(TAG, "temperatureUnit: %s", recipe.temperatureUnit);
+  strlcpy(recipe->applianceMode, applianceMode->valuestring, sizeof(recipe->applianceMode));
+  ESP_LOGV(TAG, "applianceMode: %s", recipe->applianceMode);
 
-    applianceType = cJSON_GetObjectItemCaseSensitive(recipeJson, "applianceType");
-    strcpy(recipe.applianceType, applianceType->valuestring);
-    ESP_LOGV(TAG, "applianceType: %s", recipe.applianceType);
+  recipe->temperature = temperature->valuedouble;
+  ESP_LOGV(TAG, "temperature: %d", recipe->temperature);
 
-    cookingTime = cJSON_GetObjectItemCaseSensitive(recipeJson, "cookingTime");
-    recipe.cookingTime = cookingTime->valuedouble;
-    ESP_LOGV(TAG, "cookingTime: %f", recipe.cookingTime);
+  strlcpy(recipe->temperatureUnit, temperatureUnit->valuestring, sizeof(recipe->temperatureUnit));
+  ESP_LOGV(TAG, "temperatureUnit: %s", recipe->temperatureUnit);
 
-    expiryDate = cJSON_GetObjectItemCaseSensitive(recipeJson, "expiryDate");
-    recipe.expiryDate = expiryDate->valuedouble;
-    ESP_LOGV(TAG, "expiryDate: %f", recipe.expiryDate);
+  strlcpy(recipe->applianceType, applianceType->valuestring, sizeof(recipe->applianceType));
+  ESP_LOGV(TAG, "applianceType: %s", recipe->applianceType);
 
-    id = cJSON_GetObjectItemCaseSensitive(recipeJson, "id");
-    strcpy(recipe.id, id->valuestring);
-    ESP_LOGV(TAG, "id: %s", recipe.id);
+  recipe->cookingTime = cookingTime->valuedouble;
+  ESP_LOGV(TAG, "cookingTime: %f", recipe->cookingTime);
 
-    xQueueSend(RecipeQueue, &recipe, portMAX_DELAY);
+  recipe->expiryDate = expiryDate->valuedouble;
+  ESP_LOGV(TAG, "expiryDate: %f", recipe->expiryDate);
 
-    name = cJSON_GetObjectItemCaseSensitive(recipeJson, "name");
-    strcpy(msg.text, name->valuestring);
-    xQueueSend(LCDQueue, &msg, portMAX_DELAY);
+  strlcpy(recipe->id, id->valuestring, sizeof(recipe->id));
+  ESP_LOGV(TAG, "id: %s", recipe->id);
 
-    cJSON_Delete(json);
+  recipe->zone = zone != NULL ? zone->valueint : 0;
+  ESP_LOGV(TAG, "zone: %d", recipe->zone);
+
+  strlcpy(name, recipeName->valuestring, nameSize);
+
+  cJSON_Delete(json);
+  JsonArenaEnd(arena);
+  return true;
+}
+
+static bool SetRecipe(void) {
+  JSONString *jsonString;
+  Recipe *recipe;
+  char name[LCD_COLS + 1];
+
+  if (xQueueReceive(DecodeRecipeQueue, &jsonString, 0) != pdTRUE) return false;
+  if (uxQueueMessagesWaiting(DecodeRecipeQueue)) {  // A newer recipe is right behind it and replaces it anyway
+    BufferRelease(jsonString);
+    return true;
+  }
+  // Filled in place, the cooking controller releases it once the cook is over
+  recipe = BufferAlloc(&RecipePool, 0);
+  if (recipe == NULL) {
+    ESP_LOGE(TAG, "No recipe buffer free, dropping the recipe");
+    BufferRelease(jsonString);
+    return true;
+  }
+  bool decoded = RecipeDecode(&DBManagerArena, jsonString, recipe, name, sizeof(name));
+  BufferRelease(jsonString);
+  if (!decoded) {
+    ESP_LOGE(TAG, "Malformed recipe, ignoring it");
+    BufferRelease(recipe);
+    return true;
+  }
+
+  if (recipe->zone == 0) LCDSetField(LCD_FIELD_RECIPE_NAME, "%s", name);
+  if (!CookingControllerSubmit(recipe, 0)) {
+    ESP_LOGE(TAG, "Zone %d already has a recipe waiting, dropping this one", recipe->zone);
+    BufferRelease(recipe);
+  }
+  return true;
+}
+
+static const DBEventHandler handlers[DB_EVENT_COUNT] = {
+    [DB_EVENT_TEMPERATURE] = {"temperature", &TempSensorQueue, PostTemperature},
+    [DB_EVENT_STATUS] = {"status", &StatusMessageQueue, UpdateStatus},
+    [DB_EVENT_QR_CODE] = {"qr code", &QRCodeQueue, SetQRCode},
+    [DB_EVENT_COOKING_STATUS] = {"cooking status", &CookingStatusQueue, CookingStatusChanged},
+    [DB_EVENT_RECIPE] = {"recipe", &DecodeRecipeQueue, SetRecipe},
+};
+
+static void DBManagerHandle(DBEvent event) {
+  current = event;
+  int64_t start = esp_timer_get_time();
+  if (!handlers[event].handle()) return;
+  uint32_t us = esp_timer_get_time() - start;
+
+  portENTER_CRITICAL(&statsLock);
+  stats[event].handled++;
+  stats[event].totalUs += us;
+  if (us > stats[event].maxUs) stats[event].maxUs = us;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+// The only consumer of every queue below, one handler runs at a time so they share the stack and the JSON arena
+void DBManagerTask(void *args) {
+  QueueSetMemberHandle_t member;
+  int event;
+
+  // A queue can only join the set while it's empty, anything sent before the task started is handled first
+  for (event = 0; event < DB_EVENT_COUNT; event++) {
+    while (xQueueAddToSet(*handlers[event].queue, events) != pdPASS) DBManagerHandle(event);
+  }
+
+  while (true) {
+    // Only wakes on a timer while something is waiting on the websocket
+    member = xQueueSelectFromSet(events, outboxCount || cookingStatusPending ? pdMS_TO_TICKS(DB_MANAGER_RETRY_MS) : portMAX_DELAY);
+    wakeups++;
+    for (event = 0; event < DB_EVENT_COUNT; event++) {
+      if (member == *handlers[event].queue) DBManagerHandle(event);
+    }
+    OutboxFlush();
+    if (cookingStatusPending) {
+      current = DB_EVENT_COOKING_STATUS;
+      ReportCookingStatus();
+    }
+  }
+}
+
+static int DBManagerConsoleCmd(int argc, char **argv) {
+  DBEventStats s[DB_EVENT_COUNT];
+  portENTER_CRITICAL(&statsLock);
+  memcpy(s, stats, sizeof(s));
+  portEXIT_CRITICAL(&statsLock);
+
+  printf("%-15s %8s %8s %9s %9s\n", "event", "handled", "dropped", "mean us", "max us");
+  for (int event = 0; event < DB_EVENT_COUNT; event++) {
+    printf("%-15s %8u %8u %9llu %9u\n", handlers[event].name, s[event].handled, s[event].dropped,
+           s[event].handled ? s[event].totalUs / s[event].handled : 0, s[event].maxUs);
+  }
+  printf("%u wakeups, %d messages waiting on the websocket\n", wakeups, outboxCount);
+  return 0;
+}
+
+static void RegisterDBManager(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "dbmanager",
+      .help = "Get per event counts and handling times of the DB manager task",
+      .hint = NULL,
+      .func = &DBManagerConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void DBManagerDecodeRecipe(JSONString *json) {
+  if (xQueueSend(DecodeRecipeQueue, &json, 0) != pdTRUE) {
+    ESP_LOGE(TAG, "Recipes are arriving faster than they can be decoded, dropping one");
+    BufferRelease(json);
   }
 }
 
 void SetupDBManager(void) {
-  DecodeRecipeQueue = xQueueCreate(1, sizeof(JSONString));
-  xTaskCreate(PostTemperatureTask, "PostTemperatureTask", 4096, NULL, 2, NULL);
-  xTaskCreate(UpdateStatusTask, "UpdateStatusTask", 4096, NULL, 3, NULL);
-  xTaskCreate(SetQRCodeTask, "SetQRCodeTask", 4096, NULL, 1, NULL);
-  xTaskCreate(MonitorCookingStatusTask, "MonitorCookingStatusTask", 4096, NULL, 3, NULL);
-  xTaskCreate(SetRecipeTask, "SetRecipeTask", 4096, NULL, 1, NULL);
-}
\ No newline at end of file
+  DecodeRecipeQueue = BudgetCreateQueue(TAG, "DecodeRecipeQueue", DECODE_RECIPE_QUEUE_LENGTH, sizeof(JSONString *),
+                                        DecodeRecipeQueueStorage, &DecodeRecipeQueueBuffer);
+  // Created once at boot and never freed, FreeRTOS has no static queue set. One entry per item its members can hold.
+  events = xQueueCreateSet(ZONE_COUNT + STATUS_MESSAGE_QUEUE_LENGTH + QR_CODE_QUEUE_LENGTH + 1 + DECODE_RECIPE_QUEUE_LENGTH);
+  DBManager = BudgetCreateTask(TAG, DBManagerTask, "DBManagerTask", DB_MANAGER_STACK, NULL, DB_MANAGER_PRIORITY, DB_MANAGER_CORE,
+                               DBManagerStack, &DBManagerTCB);
+  if (DBManager == NULL) ESP_LOGE(TAG, "Failed to create DB manager task");
+  RegisterDBManager();
+}
@@ -5,6 +5,7 @@
 #include <string.h>
 
 #include "argtable3/argtable3.h"
+#include "console.h"
 #include "esp_console.h"
 #include "esp_err.h"
 #include "esp_log.h"
@@ -542,10 +543,10 @@ void RegisterFlash(void) {
                                              .func = &ListEntries,
                                              .argtable = &list_args};
 
-  ESP_ERROR_CHECK(esp_console_cmd_register(&set_cmd));
-  ESP_ERROR_CHECK(esp_console_cmd_register(&get_cmd));
-  ESP_ERROR_CHECK(esp_console_cmd_register(&Erase_cmd));
-  ESP_ERROR_CHECK(esp_console_cmd_register(&namespace_cmd));
-  ESP_ERROR_CHECK(esp_console_cmd_register(&ListEntries_cmd));
-  ESP_ERROR_CHECK(esp_console_cmd_register(&EraseNamespace_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&set_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&get_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&Erase_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&namespace_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&ListEntries_cmd));
+  ESP_ERROR_CHECK(ConsoleRegister(&EraseNamespace_cmd));
 }
\ No newline at end of file
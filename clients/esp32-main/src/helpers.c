@@ -10,4 +10,37 @@ void GetUniqueID(char *str) {
   uint8_t mac[6] = {0};
   esp_efuse_mac_get_default(mac);
   sprintf(str, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-}
\ No newline at end of file
+}
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Validates a canonical 8-4-4-4-12 UUID and optionally decodes it into 16 bytes
+bool UUIDParse(const char *str, size_t length, uint8_t *uuid) {
+  int byte = 0;
+  if (length != UUID_STRING_LENGTH) return false;
+
+  for (int i = 0; i < UUID_STRING_LENGTH;) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      if (str[i] != '-') return false;
+      i++;
+      continue;
+    }
+    int high = HexValue(str[i]);
+    int low = HexValue(str[i + 1]);
+    if (high < 0 || low < 0) return false;
+    if (uuid != NULL) uuid[byte] = (high << 4) | low;
+    byte++;
+    i += 2;
+  }
+  return true;
+}
+
+// Writes the canonical lower case form, str needs UUID_STRING_LENGTH + 1 bytes
+void UUIDFormat(const uint8_t *uuid, char *str) {
+  sprintf(str, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5],
+          uuid[6], uuid[7], uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
+}
@@ -0,0 +1,102 @@
+#include "json_arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cJSON.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "JSON_ARENA"
+
+static JsonArena *arenas;
+static portMUX_TYPE arenasLock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t heapAllocations;  // cJSON allocations made outside any arena
+static uint32_t heapTotal;        // Those plus every arena fallback
+
+static void *JsonMalloc(size_t size) {
+  JsonArena *arena = pvTaskGetThreadLocalStoragePointer(NULL, JSON_ARENA_TLS_INDEX);
+  if (arena == NULL) {
+    __atomic_fetch_add(&heapAllocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&heapTotal, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+  }
+
+  size_t start = (arena->used + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1);
+  if (start + size > arena->size) {
+    arena->fallbacks++;
+    __atomic_fetch_add(&heapTotal, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+  }
+  arena->used = start + size;
+  if (arena->used > arena->highWater) arena->highWater = arena->used;
+  return &arena->buffer[start];
+}
+
+static bool InArena(const JsonArena *arena, const void *ptr) {
+  return (const uint8_t *)ptr >= arena->buffer && (const uint8_t *)ptr < arena->buffer + arena->size;
+}
+
+static void JsonFree(void *ptr) {
+  // Arena memory goes back all at once in JsonArenaEnd, check every open scope in case one is nested
+  for (JsonArena *arena = pvTaskGetThreadLocalStoragePointer(NULL, JSON_ARENA_TLS_INDEX); arena != NULL; arena = arena->previous) {
+    if (InArena(arena, ptr)) return;
+  }
+  free(ptr);
+}
+
+uint32_t JsonHeapAllocations(void) { return __atomic_load_n(&heapTotal, __ATOMIC_RELAXED); }
+
+void JsonArenaBegin(JsonArena *arena) {
+  if (arena->scopes == 0) {
+    portENTER_CRITICAL(&arenasLock);
+    arena->next = arenas;
+    arenas = arena;
+    portEXIT_CRITICAL(&arenasLock);
+  }
+  arena->scopes++;
+  arena->used = 0;
+  arena->previous = pvTaskGetThreadLocalStoragePointer(NULL, JSON_ARENA_TLS_INDEX);
+  vTaskSetThreadLocalStoragePointer(NULL, JSON_ARENA_TLS_INDEX, arena);
+}
+
+void JsonArenaEnd(JsonArena *arena) {
+  vTaskSetThreadLocalStoragePointer(NULL, JSON_ARENA_TLS_INDEX, arena->previous);
+  arena->previous = NULL;
+  arena->used = 0;
+}
+
+static int JsonArenaConsoleCmd(int argc, char **argv) {
+  printf("%-24s %6s %10s %8s %9s\n", "arena", "size", "high water", "scopes", "fallbacks");
+  portENTER_CRITICAL(&arenasLock);
+  JsonArena *arena = arenas;
+  portEXIT_CRITICAL(&arenasLock);
+  for (; arena != NULL; arena = arena->next) {
+    printf("%-24s %6u %10u %8u %9u\n", arena->name, arena->size, arena->highWater, arena->scopes, arena->fallbacks);
+  }
+  printf("cJSON heap allocations outside an arena: %u\n", heapAllocations);
+  printf("free heap: %u, largest free block: %u\n", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+         heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  return 0;
+}
+
+static void RegisterJsonArena(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "json",
+      .help = "Get cJSON arena high water marks, heap fallbacks and the largest free heap block",
+      .hint = NULL,
+      .func = &JsonArenaConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+// Must run before anything touches cJSON, the hooks are global
+void SetupJsonArena(void) {
+  cJSON_Hooks hooks = {.malloc_fn = JsonMalloc, .free_fn = JsonFree};
+  cJSON_InitHooks(&hooks);
+  RegisterJsonArena();
+}
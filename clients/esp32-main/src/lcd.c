@@ -1,44 +1,65 @@
 #include "lcd.h"
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
+#include "boot.h"
+#include "console.h"
 #include "driver/i2c.h"
+#include "esp_console.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "memory_budget.h"
+#include "task_config.h"
 #include "unistd.h"
 
 #define SLAVE_ADDRESS_LCD 0x4E >> 1  // change this according to ur setup
-esp_err_t err;
 #define I2C_NUM I2C_NUM_0
+#define I2C_TIMEOUT_MS 50
 #define TAG "LCD"
-QueueHandle_t LCDQueue;
 
-void lcd_send_cmd(char cmd) {
+// Bytes per HD44780 byte when driven through the PCF8574 in 4 bit mode
+#define NIBBLE_BYTES 4
+// Address byte sent at the start of every I2C transaction
+#define ADDRESS_BYTES 1
+// Unchanged cells shorter than this between two changed runs are resent rather than paying for a new cursor command
+#define RUN_MERGE_GAP 1
+
+TaskHandle_t LCDRenderer;
+STATIC_TASK(LCDRenderer, LCD_RENDERER_STACK);
+
+// Blank from the start rather than from SetupLCD, which other modules' boot steps may run before
+static char frame[LCD_ROWS][LCD_COLS] = {[0 ... LCD_ROWS - 1] = {[0 ... LCD_COLS - 1] = ' '}};  // what the display should show
+static char shown[LCD_ROWS][LCD_COLS] = {[0 ... LCD_ROWS - 1] = {[0 ... LCD_COLS - 1] = ' '}};  // what was last sent to the display
+static LCDStats stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+static const uint8_t rowOffsets[LCD_ROWS] = {0x80, 0xC0, 0x94, 0xD4};
+
+static int lcd_pack(uint8_t *out, char value, uint8_t flags) {
   char data_u, data_l;
-  uint8_t data_t[4];
-  data_u = (cmd & 0xf0);
-  data_l = ((cmd << 4) & 0xf0);
-  data_t[0] = data_u | 0x0C;  // en=1, rs=0
-  data_t[1] = data_u | 0x08;  // en=0, rs=0
-  data_t[2] = data_l | 0x0C;  // en=1, rs=0
-  data_t[3] = data_l | 0x08;  // en=0, rs=0
-  err = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, data_t, 4, 1000);
-  if (err != 0) ESP_LOGE(TAG, "Error in sending command");
+  data_u = (value & 0xf0);
+  data_l = ((value << 4) & 0xf0);
+  out[0] = data_u | 0x0C | flags;  // en=1
+  out[1] = data_u | 0x08 | flags;  // en=0
+  out[2] = data_l | 0x0C | flags;  // en=1
+  out[3] = data_l | 0x08 | flags;  // en=0
+  return NIBBLE_BYTES;
 }
 
-void lcd_send_data(char data) {
-  char data_u, data_l;
-  uint8_t data_t[4];
-  data_u = (data & 0xf0);
-  data_l = ((data << 4) & 0xf0);
-  data_t[0] = data_u | 0x0D;  // en=1, rs=0
-  data_t[1] = data_u | 0x09;  // en=0, rs=0
-  data_t[2] = data_l | 0x0D;  // en=1, rs=0
-  data_t[3] = data_l | 0x09;  // en=0, rs=0
-  err = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, data_t, 4, 1000);
-  if (err != 0) ESP_LOGE(TAG, "Error in sending command");
+static esp_err_t lcd_write(const uint8_t *data, size_t length) {
+  esp_err_t err = i2c_master_write_to_device(I2C_NUM, SLAVE_ADDRESS_LCD, data, length, pdMS_TO_TICKS(I2C_TIMEOUT_MS));
+  if (err != ESP_OK) ESP_LOGE(TAG, "Error in sending %d bytes: %s", length, esp_err_to_name(err));
+  return err;
+}
+
+void lcd_send_cmd(char cmd) {
+  uint8_t data_t[NIBBLE_BYTES];
+  lcd_pack(data_t, cmd, 0x00);  // rs=0
+  lcd_write(data_t, NIBBLE_BYTES);
 }
 
 void lcd_clear(void) {
@@ -46,25 +67,6 @@ void lcd_clear(void) {
   usleep(5000);
 }
 
-void lcd_put_cur(int row, int col) {
-  switch (row) {
-    case 0:
-      col |= 0x80;
-      break;
-    case 1:
-      col |= 0xC0;
-      break;
-    case 2:
-      col |= 0x94;
-      break;
-    case 3:
-      col |= 0xD4;
-      break;
-  }
-
-  lcd_send_cmd(col);
-}
-
 void lcd_init(void) {
   // 4 bit initialisation
   usleep(50000);  // wait for >40ms
@@ -91,23 +93,181 @@ void lcd_init(void) {
   usleep(1000);
 }
 
-void lcd_send_string(char *str) {
-  while (*str) lcd_send_data(*str++);
+// Sends the cursor command and every character of the run in one transaction, returns the bytes put on the bus
+static int lcd_send_run(int row, int start, int end) {
+  uint8_t data_t[NIBBLE_BYTES * (LCD_COLS + 1)];
+  int length = lcd_pack(data_t, rowOffsets[row] | start, 0x00);  // rs=0
+  for (int col = start; col < end; col++) {
+    length += lcd_pack(&data_t[length], frame[row][col], 0x01);  // rs=1
+  }
+
+  if (lcd_write(data_t, length) == ESP_OK) {
+    memcpy(&shown[row][start], &frame[row][start], end - start);
+  }
+  return length + ADDRESS_BYTES;
+}
+
+// Diffs the framebuffer against the display and only sends the changed runs of cells
+static void LCDRender(void) {
+  int64_t start = esp_timer_get_time();
+  int row, col, runStart, runEnd;
+  uint32_t transactions = 0;
+  uint32_t busBytes = 0;
+
+  for (row = 0; row < LCD_ROWS; row++) {
+    col = 0;
+    while (col < LCD_COLS) {
+      if (frame[row][col] == shown[row][col]) {
+        col++;
+        continue;
+      }
+
+      runStart = col;
+      runEnd = col + 1;
+      for (col = runEnd; col < LCD_COLS; col++) {
+        if (frame[row][col] != shown[row][col]) {
+          runEnd = col + 1;
+        } else if (col - runEnd >= RUN_MERGE_GAP) {
+          break;
+        }
+      }
+      busBytes += lcd_send_run(row, runStart, runEnd);
+      transactions++;
+      col = runEnd;
+    }
+  }
+
+  uint32_t elapsed = esp_timer_get_time() - start;
+  portENTER_CRITICAL(&statsLock);
+  stats.frames++;
+  stats.transactions += transactions;
+  stats.busBytes += busBytes;
+  stats.lastRenderUs = elapsed;
+  stats.totalRenderUs += elapsed;
+  if (elapsed > stats.maxRenderUs) stats.maxRenderUs = elapsed;
+  portEXIT_CRITICAL(&statsLock);
 }
 
-void LCDTask(void *pvParameters) {
-  LCDMessage msg;
+typedef struct LCDFieldLayout {
+  int row;
+  int col;
+  int width;
+  const char *label;  // only drawn while the field has a value
+} LCDFieldLayout;
+
+static const LCDFieldLayout layout[LCD_FIELD_COUNT] = {
+    [LCD_FIELD_DEVICE_NAME] = {.row = 0, .col = 0, .width = 12, .label = ""},
+    [LCD_FIELD_STATUS] = {.row = 0, .col = 12, .width = 8, .label = ""},
+    [LCD_FIELD_TEMPERATURE] = {.row = 1, .col = 0, .width = LCD_COLS, .label = "Temp: "},
+    [LCD_FIELD_TIME_REMAINING] = {.row = 2, .col = 0, .width = LCD_COLS, .label = "Time Left: "},
+    [LCD_FIELD_RECIPE_NAME] = {.row = 3, .col = 0, .width = LCD_COLS, .label = ""},
+};
+
+static char fields[LCD_FIELD_COUNT][LCD_COLS + 1];
+static uint32_t pendingUpdates;
+static portMUX_TYPE fieldsLock = portMUX_INITIALIZER_UNLOCKED;
+
+void LCDSetField(LCDField field, const char *fmt, ...) {
+  char text[LCD_COLS + 1];
+  va_list args;
+  if (field >= LCD_FIELD_COUNT) return;
+
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+
+  portENTER_CRITICAL(&fieldsLock);
+  strcpy(fields[field], text);
+  pendingUpdates++;
+  portEXIT_CRITICAL(&fieldsLock);
+
+  // The old path moved the cursor and then sent every character as its own transaction
+  portENTER_CRITICAL(&statsLock);
+  stats.legacyBusBytes += (strlen(layout[field].label) + strlen(text) + 1) * (NIBBLE_BYTES + ADDRESS_BYTES);
+  portEXIT_CRITICAL(&statsLock);
+
+  if (LCDRenderer != NULL) xTaskNotifyGive(LCDRenderer);
+}
+
+// Lays every field out into the framebuffer
+static uint32_t LCDCompose(void) {
+  char snapshot[LCD_FIELD_COUNT][LCD_COLS + 1];
+  uint32_t updates;
+
+  portENTER_CRITICAL(&fieldsLock);
+  memcpy(snapshot, fields, sizeof(snapshot));
+  updates = pendingUpdates;
+  pendingUpdates = 0;
+  portEXIT_CRITICAL(&fieldsLock);
+
+  for (int i = 0; i < LCD_FIELD_COUNT; i++) {
+    const LCDFieldLayout *l = &layout[i];
+    char *cell = &frame[l->row][l->col];
+    memset(cell, ' ', l->width);
+    if (snapshot[i][0] == '\0') continue;
+
+    int labelLength = strlen(l->label);
+    int valueLength = strlen(snapshot[i]);
+    if (labelLength > l->width) labelLength = l->width;
+    if (valueLength > l->width - labelLength) valueLength = l->width - labelLength;
+    memcpy(cell, l->label, labelLength);
+    memcpy(cell + labelLength, snapshot[i], valueLength);
+  }
+  return updates;
+}
+
+void LCDRendererTask(void *pvParameters) {
+  const TickType_t framePeriod = pdMS_TO_TICKS(1000 / LCD_FRAME_RATE_HZ);
+  uint32_t updates;
+  // The controller needs about 80 ms of settling between init commands, spend it here rather than in boot
+  lcd_init();
+  lcd_clear();
+  BootReady(BOOT_LCD);
   while (1) {
-    xQueueReceive(LCDQueue, &msg, portMAX_DELAY);
-    if (msg.row == -1) {
-      ESP_LOGE(TAG, "Message: %s, row: %d, col: %d", msg.text, msg.row, msg.col);
-      lcd_put_cur(msg.row, msg.col);
-      lcd_send_string(&msg.text[0]);
-      vTaskDelay(pdMS_TO_TICKS(10));
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    updates = LCDCompose();
+    LCDRender();
+    if (updates > 1) {
+      portENTER_CRITICAL(&statsLock);
+      stats.coalescedUpdates += updates - 1;
+      portEXIT_CRITICAL(&statsLock);
     }
+    // Anything written while we wait is picked up by the next frame
+    vTaskDelay(framePeriod);
   }
 }
 
+void LCDGetStats(LCDStats *out) {
+  portENTER_CRITICAL(&statsLock);
+  *out = stats;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static int LCDStatsConsoleCmd(int argc, char **argv) {
+  LCDStats s;
+  LCDGetStats(&s);
+  if (s.frames == 0) {
+    printf("No frames rendered yet\n");
+    return 0;
+  }
+  printf("frames: %u, transactions: %u\n", s.frames, s.transactions);
+  printf("bus bytes: %u (%u per frame), per character path: %u (%u per frame)\n", s.busBytes, s.busBytes / s.frames, s.legacyBusBytes,
+         s.legacyBusBytes / s.frames);
+  printf("field updates coalesced: %u\n", s.coalescedUpdates);
+  printf("render time: last %u us, avg %u us, max %u us\n", s.lastRenderUs, (uint32_t)(s.totalRenderUs / s.frames), s.maxRenderUs);
+  return 0;
+}
+
+static void RegisterLCD(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "lcd",
+      .help = "Get LCD render statistics",
+      .hint = NULL,
+      .func = &LCDStatsConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
 void SetupLCD(void) {
   int i2c_master_port = I2C_NUM_0;
 
@@ -126,21 +286,8 @@ void SetupLCD(void) {
 
   ESP_LOGI(TAG, "I2C initialized successfully");
 
-  lcd_init();
-  lcd_clear();
-
-  // lcd_put_cur(0, 0);
-  // lcd_send_string("SafeEats");
-
-  // lcd_put_cur(1, 0);
-  // lcd_send_string("from ESP32 abcdefghi");
-
-  lcd_put_cur(2, 0);
-  lcd_send_string("from ESP32 abcdefghi");
-
-  lcd_put_cur(3, 0);
-  lcd_send_string("from ESP32 abcdefghi");
-
-  LCDQueue = xQueueCreate(3, sizeof(LCDMessage));
-  // xTaskCreate(LCDTask, "LCDTask", 2048, NULL, 2, NULL);
-}
\ No newline at end of file
+  LCDRenderer = BudgetCreateTask(TAG, LCDRendererTask, "LCDRendererTask", LCD_RENDERER_STACK, NULL, LCD_RENDERER_PRIORITY, LCD_RENDERER_CORE,
+                                 LCDRendererStack, &LCDRendererTCB);
+  xTaskNotifyGive(LCDRenderer);
+  RegisterLCD();
+}
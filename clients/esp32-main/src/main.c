@@ -4,6 +4,10 @@
 #include <stdio.h>
 
 #include "bluetooth.h"
+#include "bench.h"
+#include "binlog.h"
+#include "boot.h"
+#include "buffer_pool.h"
 #include "buzzer.h"
 #include "config.h"
 #include "console.h"
@@ -13,12 +17,20 @@
 #include "esp_sntp.h"
 #include "flash.h"
 #include "helpers.h"
+#include "json_arena.h"
 #include "lcd.h"
+#include "ota.h"
+#include "memory_budget.h"
+#include "perf.h"
+#include "power.h"
 #include "qr_scanner.h"
 #include "relay_controller.h"
+#include "simulation.h"
 #include "temperature_sensor.h"
+#include "trace.h"
 #include "websocket.h"
 #include "wifi.h"
+#include "zone.h"
 
 QueueHandle_t StatusMessageQueue;
 EventGroupHandle_t DeviceStatus;
@@ -26,9 +38,10 @@ char ID[64];
 char APPLIANCE_TYPE[64];
 #define TAG "Main"
 
-void app_main() {
-  DeviceStatus = xEventGroupCreate();
-  SetupConsole();
+static StaticEventGroup_t DeviceStatusBuffer;
+STATIC_QUEUE(StatusMessageQueue, STATUS_MESSAGE_QUEUE_LENGTH, StatusMessage);
+
+static void SetupIdentity(void) {
   SetupFlash();
 
   // Get the device ID from the flash
@@ -41,23 +54,59 @@ void app_main() {
 
   FlashStringFallback(NVS_TYPE_STR, APPLIANCE_TYPE_KEY, APPLIANCE_TYPE, 64, DEFAULT_APPLIANCE_TYPE);
   ESP_LOGI(TAG, "Appliance Type: %s", APPLIANCE_TYPE);
+}
 
-  // Setup timesync
+static void SetupTimeSync(void) {
   sntp_setoperatingmode(SNTP_OPMODE_POLL);
   sntp_setservername(0, "pool.ntp.org");
   sntp_init();
   ESP_LOGD(TAG, "Time synced setup");
+}
 
-  StatusMessageQueue = xQueueCreate(3, sizeof(StatusMessage));
-
-  SetupLCD();
-  SetupWifi();
-  SetupTempSensor();
-  SetupQRScanner();
-  SetupWebsocket();
-  SetupRelayController();
-  SetupBuzzer();
-  SetupCookingController();
-  SetupDBManager();
-  SetupBluetooth();
+// Each module lists what must be ready before its setup runs, everything else runs in parallel
+static const BootStep bootSteps[] = {
+    {BOOT_FLASH, "flash", SetupIdentity, 0},
+    {BOOT_LCD, "lcd", SetupLCD, 0, true},
+    {BOOT_TEMP_SENSOR, "temp sensor", SetupTempSensor, 0},
+    {BOOT_RELAY, "relay", SetupRelayController, BOOT_DEP(BOOT_FLASH)},  // Restores the relay counters from NVS
+    {BOOT_QR_SCANNER, "qr scanner", SetupQRScanner, 0},
+    {BOOT_BUZZER, "buzzer", SetupBuzzer, 0},
+    {BOOT_WIFI, "wifi", SetupWifi, BOOT_DEP(BOOT_FLASH)},
+    {BOOT_SNTP, "sntp", SetupTimeSync, BOOT_DEP(BOOT_WIFI)},  // lwIP only exists once Wi-Fi has set up the netif
+    {BOOT_POWER, "power", SetupPower, BOOT_DEP(BOOT_WIFI) | BOOT_DEP(BOOT_QR_SCANNER)},
+    {BOOT_WEBSOCKET, "websocket", SetupWebsocket, BOOT_DEP(BOOT_WIFI)},
+    {BOOT_COOKING, "cooking", SetupCookingController,
+     BOOT_DEP(BOOT_RELAY) | BOOT_DEP(BOOT_TEMP_SENSOR) | BOOT_DEP(BOOT_BUZZER) | BOOT_DEP(BOOT_POWER)},
+    {BOOT_DB_MANAGER, "db manager", SetupDBManager,
+     BOOT_DEP(BOOT_WEBSOCKET) | BOOT_DEP(BOOT_TEMP_SENSOR) | BOOT_DEP(BOOT_QR_SCANNER) | BOOT_DEP(BOOT_COOKING)},
+    // Recipes written over BLE go to DBManagerDecodeRecipe
+    {BOOT_BLUETOOTH, "bluetooth", SetupBluetooth, BOOT_DEP(BOOT_WIFI) | BOOT_DEP(BOOT_DB_MANAGER)},
+    {BOOT_PERF, "perf", SetupPerf, BOOT_DEP(BOOT_WEBSOCKET)},
+    {BOOT_OTA, "ota", SetupOta, 0},
+#ifdef SIMULATION
+    // Loops the scanner UART back on itself and queues recipes from RecipePool
+    {BOOT_SIMULATION, "simulation", SetupSimulation, BOOT_DEP(BOOT_QR_SCANNER) | BOOT_DEP(BOOT_COOKING)},
+#endif
+};
+
+void AppStart(void) {
+  DeviceStatus = BudgetCreateEventGroup(TAG, "DeviceStatus", &DeviceStatusBuffer);
+  StatusMessageQueue = BudgetCreateQueue(TAG, "StatusMessageQueue", STATUS_MESSAGE_QUEUE_LENGTH, sizeof(StatusMessage),
+                                         StatusMessageQueueStorage, &StatusMessageQueueBuffer);
+  SetupConsole();
+  SetupBinlog();
+  SetupJsonArena();
+  RegisterBudget();
+  RegisterBufferPool();
+  RegisterTrace();
+  RegisterBoot();
+  RegisterBench();
+  RegisterZones();
+
+  BootRun(bootSteps, NELEMS(bootSteps));
+  BudgetReport();
 }
+
+#ifndef PIO_UNIT_TESTING  // The test runner brings its own app_main
+void app_main() { AppStart(); }
+#endif
@@ -0,0 +1,135 @@
+#include "memory_budget.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "console.h"
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "perf.h"
+
+#define TAG "MEMORY_BUDGET"
+
+typedef struct BudgetEntry {
+  const char *module;
+  const char *name;
+  BudgetKind kind;
+  size_t bytes;
+  TaskHandle_t task;  // only for BUDGET_TASK, for the high water mark
+} BudgetEntry;
+
+static const char *kindNames[] = {
+    [BUDGET_TASK] = "task",
+    [BUDGET_QUEUE] = "queue",
+    [BUDGET_EVENT_GROUP] = "event group",
+    [BUDGET_TIMER] = "timer",
+    [BUDGET_MUTEX] = "mutex",
+    [BUDGET_BUFFERS] = "buffers",
+};
+
+// Only written during setup, which runs on several boot workers at once
+static BudgetEntry entries[BUDGET_MAX_ENTRIES];
+static int entryCount;
+static portMUX_TYPE entriesLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void BudgetAdd(const char *module, const char *name, BudgetKind kind, size_t bytes, TaskHandle_t task) {
+  portENTER_CRITICAL(&entriesLock);
+  bool full = entryCount >= BUDGET_MAX_ENTRIES;
+  if (!full) entries[entryCount++] = (BudgetEntry){.module = module, .name = name, .kind = kind, .bytes = bytes, .task = task};
+  portEXIT_CRITICAL(&entriesLock);
+  if (full) ESP_LOGE(TAG, "Budget table full, not tracking %s %s", module, name);
+}
+
+TaskHandle_t BudgetCreateTask(const char *module, TaskFunction_t function, const char *name, uint32_t stackDepth, void *params,
+                              UBaseType_t priority, BaseType_t core, StackType_t *stack, StaticTask_t *tcb) {
+  TaskHandle_t task = xTaskCreateStaticPinnedToCore(function, name, stackDepth, params, priority, stack, tcb, core);
+  if (task == NULL) {
+    ESP_LOGE(TAG, "Failed to create %s", name);
+    return NULL;
+  }
+  BudgetAdd(module, name, BUDGET_TASK, stackDepth * sizeof(StackType_t) + sizeof(StaticTask_t), task);
+  return task;
+}
+
+QueueHandle_t BudgetCreateQueue(const char *module, const char *name, UBaseType_t length, UBaseType_t itemSize, uint8_t *storage,
+                                StaticQueue_t *buffer) {
+  QueueHandle_t queue = xQueueCreateStatic(length, itemSize, storage, buffer);
+  if (queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create %s", name);
+    return NULL;
+  }
+  BudgetAdd(module, name, BUDGET_QUEUE, length * itemSize + sizeof(StaticQueue_t), NULL);
+  PerfTrackQueue(name, queue, length);
+  return queue;
+}
+
+EventGroupHandle_t BudgetCreateEventGroup(const char *module, const char *name, StaticEventGroup_t *buffer) {
+  EventGroupHandle_t group = xEventGroupCreateStatic(buffer);
+  BudgetAdd(module, name, BUDGET_EVENT_GROUP, sizeof(StaticEventGroup_t), NULL);
+  return group;
+}
+
+TimerHandle_t BudgetCreateTimer(const char *module, const char *name, TickType_t period, UBaseType_t autoReload,
+                                TimerCallbackFunction_t callback, StaticTimer_t *buffer) {
+  TimerHandle_t timer = xTimerCreateStatic(name, period, autoReload, NULL, callback, buffer);
+  BudgetAdd(module, name, BUDGET_TIMER, sizeof(StaticTimer_t), NULL);
+  return timer;
+}
+
+SemaphoreHandle_t BudgetCreateMutex(const char *module, const char *name, StaticSemaphore_t *buffer) {
+  SemaphoreHandle_t mutex = xSemaphoreCreateMutexStatic(buffer);
+  BudgetAdd(module, name, BUDGET_MUTEX, sizeof(StaticSemaphore_t), NULL);
+  return mutex;
+}
+
+void BudgetAddBuffers(const char *module, const char *name, size_t bytes) { BudgetAdd(module, name, BUDGET_BUFFERS, bytes, NULL); }
+
+void BudgetReport(void) {
+  size_t total = 0, moduleTotal = 0, stackTotal = 0, stackUnused = 0;
+  int i, j;
+  bool printed[BUDGET_MAX_ENTRIES] = {false};
+
+  printf("%-20s %-26s %-12s %7s %9s %9s\n", "module", "name", "kind", "bytes", "peak used", "headroom");
+  // Group by module in registration order without sorting the table
+  for (i = 0; i < entryCount; i++) {
+    if (printed[i]) continue;
+    moduleTotal = 0;
+    for (j = i; j < entryCount; j++) {
+      const BudgetEntry *e = &entries[j];
+      if (printed[j] || strcmp(e->module, entries[i].module) != 0) continue;
+      printed[j] = true;
+      moduleTotal += e->bytes;
+      if (e->kind == BUDGET_TASK) {
+        UBaseType_t unused = uxTaskGetStackHighWaterMark(e->task);
+        stackTotal += e->bytes - sizeof(StaticTask_t);
+        stackUnused += unused;
+        printf("%-20s %-26s %-12s %7u %9u %9u\n", e->module, e->name, kindNames[e->kind], e->bytes,
+               e->bytes - sizeof(StaticTask_t) - unused, unused);
+      } else {
+        printf("%-20s %-26s %-12s %7u %9s %9s\n", e->module, e->name, kindNames[e->kind], e->bytes, "", "");
+      }
+    }
+    printf("%-20s %-26s %-12s %7u\n\n", entries[i].module, "total", "", moduleTotal);
+    total += moduleTotal;
+  }
+
+  printf("static total: %u bytes, stacks: %u bytes with %u never touched\n", total, stackTotal, stackUnused);
+  printf("heap free: %u, minimum free: %u, largest free block: %u\n", heap_caps_get_free_size(MALLOC_CAP_8BIT),
+         heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+static int BudgetConsoleCmd(int argc, char **argv) {
+  BudgetReport();
+  return 0;
+}
+
+void RegisterBudget(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "budget",
+      .help = "Get the RAM pinned by every task, queue and event group with stack headroom",
+      .hint = NULL,
+      .func = &BudgetConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
@@ -0,0 +1,443 @@
+#include "ota.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "boot.h"
+#include "config.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_crt_bundle.h"
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "mbedtls/sha256.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "task_config.h"
+#include "temperature_sensor.h"
+#include "zone.h"
+
+#define TAG "OTA"
+
+STATIC_TASK(OtaVerify, OTA_VERIFY_STACK);
+
+typedef enum OtaState {
+  OTA_STATE_SNIFF,   // waiting on enough bytes to tell a patch from a full image
+  OTA_STATE_HEADER,
+  OTA_STATE_OP,
+  OTA_STATE_ARGS,
+  OTA_STATE_DATA,
+  OTA_STATE_END,
+  OTA_STATE_FULL,    // full image, bytes go straight to the slot
+} OtaState;
+
+// Everything the applier needs between HTTP reads, the patch is never held whole
+typedef struct OtaUpdate {
+  OtaState state;
+  esp_ota_handle_t handle;
+  const esp_partition_t *running;
+  uint8_t header[OTA_HEADER_LENGTH];
+  uint8_t args[8];
+  size_t need;  // bytes the header or args still need
+  size_t have;
+  uint8_t op;
+  uint32_t remaining;  // of the current DATA op
+  uint32_t targetSize;
+  uint8_t targetHash[OTA_HASH_LENGTH];
+  mbedtls_sha256_context sha;
+} OtaUpdate;
+
+static OtaStats stats = {.result = ESP_OK};
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+static char url[OTA_URL_LENGTH];
+static uint8_t rxBuffer[OTA_CHUNK_LENGTH];
+static uint8_t copyBuffer[OTA_CHUNK_LENGTH];
+static OtaUpdate update;
+
+static uint32_t ReadU32(const uint8_t *bytes) { return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24; }
+
+static void AddStats(uint32_t downloaded, uint32_t written, uint32_t copied) {
+  portENTER_CRITICAL(&statsLock);
+  stats.downloaded += downloaded;
+  stats.written += written;
+  stats.copied += copied;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static esp_err_t WriteImage(OtaUpdate *u, const uint8_t *data, size_t length) {
+  if (u->state != OTA_STATE_FULL && stats.written + length > u->targetSize) {
+    ESP_LOGE(TAG, "Patch writes past the %u byte target", u->targetSize);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  esp_err_t err = esp_ota_write(u->handle, data, length);
+  if (err != ESP_OK) return err;
+  mbedtls_sha256_update_ret(&u->sha, data, length);
+  AddStats(0, length, 0);
+  return ESP_OK;
+}
+
+static esp_err_t CopyFromRunning(OtaUpdate *u, uint32_t offset, uint32_t length) {
+  if (offset > u->running->size || length > u->running->size - offset) {
+    ESP_LOGE(TAG, "Copy of %u bytes at 0x%x is outside the running slot", length, offset);
+    return ESP_ERR_INVALID_ARG;
+  }
+  while (length > 0) {
+    size_t n = length < sizeof(copyBuffer) ? length : sizeof(copyBuffer);
+    esp_err_t err = esp_partition_read(u->running, offset, copyBuffer, n);
+    if (err == ESP_OK) err = WriteImage(u, copyBuffer, n);
+    if (err != ESP_OK) return err;
+    AddStats(0, 0, n);
+    offset += n;
+    length -= n;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t CheckHeader(OtaUpdate *u) {
+  uint8_t runningDigest[OTA_HASH_LENGTH];
+  const uint8_t *sourceDigest = &u->header[5];
+
+  if (u->header[4] != OTA_PATCH_VERSION) {
+    ESP_LOGE(TAG, "Patch version %d is not supported", u->header[4]);
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  esp_err_t err = esp_partition_get_sha256(u->running, runningDigest);
+  if (err != ESP_OK) return err;
+  if (memcmp(runningDigest, sourceDigest, OTA_HASH_LENGTH) != 0) {
+    ESP_LOGE(TAG, "Patch was built against a different image than the one running");
+    return ESP_ERR_INVALID_VERSION;
+  }
+  memcpy(u->targetHash, &u->header[5 + OTA_HASH_LENGTH], OTA_HASH_LENGTH);
+  u->targetSize = ReadU32(&u->header[5 + OTA_HASH_LENGTH * 2]);
+  ESP_LOGI(TAG, "Applying patch for a %u byte image", u->targetSize);
+  return ESP_OK;
+}
+
+// Takes as many bytes as the header or op arguments still need, true once they're all in
+static bool Gather(OtaUpdate *u, uint8_t *into, const uint8_t **data, size_t *length) {
+  size_t n = u->need - u->have < *length ? u->need - u->have : *length;
+  memcpy(&into[u->have], *data, n);
+  u->have += n;
+  *data += n;
+  *length -= n;
+  return u->have == u->need;
+}
+
+// Advances the applier over one HTTP read, chunks may split the header, op arguments or data anywhere
+static esp_err_t OtaFeed(OtaUpdate *u, const uint8_t *data, size_t length) {
+  esp_err_t err = ESP_OK;
+  size_t n;
+
+  while (length > 0 && err == ESP_OK) {
+    switch (u->state) {
+      case OTA_STATE_SNIFF:
+        if (!Gather(u, u->header, &data, &length)) break;
+        if (memcmp(u->header, OTA_PATCH_MAGIC, 4) == 0) {
+          u->state = OTA_STATE_HEADER;
+          u->need = OTA_HEADER_LENGTH;
+        } else {
+          u->state = OTA_STATE_FULL;
+          err = WriteImage(u, u->header, u->have);
+        }
+        break;
+      case OTA_STATE_HEADER:
+        if (!Gather(u, u->header, &data, &length)) break;
+        err = CheckHeader(u);
+        u->state = OTA_STATE_OP;
+        break;
+      case OTA_STATE_OP:
+        u->op = *data++;
+        length--;
+        u->have = 0;
+        u->need = u->op == OTA_OP_COPY ? 8 : 4;
+        if (u->op == OTA_OP_END) {
+          u->state = OTA_STATE_END;
+        } else if (u->op == OTA_OP_COPY || u->op == OTA_OP_DATA) {
+          u->state = OTA_STATE_ARGS;
+        } else {
+          ESP_LOGE(TAG, "Unknown patch op 0x%02x", u->op);
+          err = ESP_ERR_INVALID_ARG;
+        }
+        break;
+      case OTA_STATE_ARGS:
+        if (!Gather(u, u->args, &data, &length)) break;
+        if (u->op == OTA_OP_COPY) {
+          err = CopyFromRunning(u, ReadU32(u->args), ReadU32(&u->args[4]));
+          u->state = OTA_STATE_OP;
+        } else {
+          u->remaining = ReadU32(u->args);
+          u->state = u->remaining > 0 ? OTA_STATE_DATA : OTA_STATE_OP;
+        }
+        break;
+      case OTA_STATE_DATA:
+        n = u->remaining < length ? u->remaining : length;
+        err = WriteImage(u, data, n);
+        data += n;
+        length -= n;
+        u->remaining -= n;
+        if (u->remaining == 0) u->state = OTA_STATE_OP;
+        break;
+      case OTA_STATE_FULL:
+        err = WriteImage(u, data, length);
+        length = 0;
+        break;
+      case OTA_STATE_END:
+        ESP_LOGE(TAG, "%d bytes after the end of the patch", length);
+        err = ESP_ERR_INVALID_SIZE;
+        break;
+    }
+  }
+  return err;
+}
+
+static esp_err_t OtaFinish(OtaUpdate *u) {
+  uint8_t hash[OTA_HASH_LENGTH];
+  mbedtls_sha256_finish_ret(&u->sha, hash);
+
+  if (u->state != OTA_STATE_FULL) {
+    if (u->state != OTA_STATE_END || stats.written != u->targetSize) {
+      ESP_LOGE(TAG, "Patch ended early, %u of %u bytes written", stats.written, u->targetSize);
+      esp_ota_abort(u->handle);
+      return ESP_ERR_INVALID_SIZE;
+    }
+    if (memcmp(hash, u->targetHash, OTA_HASH_LENGTH) != 0) {
+      ESP_LOGE(TAG, "Patched image does not match the target hash");
+      esp_ota_abort(u->handle);
+      return ESP_ERR_INVALID_CRC;
+    }
+  }
+  // Checks the image structure and the digest esptool appended, for full images this is the only integrity check
+  return esp_ota_end(u->handle);
+}
+
+static esp_err_t OtaDownload(OtaUpdate *u) {
+  esp_http_client_config_t config = {
+      .url = url,
+      .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+      .crt_bundle_attach = esp_crt_bundle_attach,
+  };
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (client == NULL) return ESP_FAIL;
+
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err == ESP_OK && esp_http_client_fetch_headers(client) < 0) err = ESP_FAIL;
+  if (err == ESP_OK && esp_http_client_get_status_code(client) != 200) {
+    ESP_LOGE(TAG, "Server answered %d", esp_http_client_get_status_code(client));
+    err = ESP_FAIL;
+  }
+
+  while (err == ESP_OK) {
+    int read = esp_http_client_read(client, (char *)rxBuffer, sizeof(rxBuffer));
+    if (read < 0) {
+      err = ESP_FAIL;
+    } else if (read == 0) {
+      if (!esp_http_client_is_complete_data_received(client)) err = ESP_ERR_INVALID_SIZE;
+      break;
+    } else {
+      AddStats(read, 0, 0);
+      err = OtaFeed(u, rxBuffer, read);
+    }
+  }
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+  return err;
+}
+
+static void OtaTask(void *args) {
+  OtaUpdate *u = &update;
+  int64_t start = esp_timer_get_time();
+  const esp_partition_t *target;
+
+  PowerAcquire(POWER_LOCK_NETWORK);
+  memset(u, 0, sizeof(*u));
+  u->state = OTA_STATE_SNIFF;
+  u->need = 4;
+  u->running = esp_ota_get_running_partition();
+  target = esp_ota_get_next_update_partition(NULL);
+  mbedtls_sha256_init(&u->sha);
+  mbedtls_sha256_starts_ret(&u->sha, false);
+
+  esp_err_t err = target != NULL ? esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &u->handle) : ESP_ERR_NOT_FOUND;
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "Updating %s from %s", target->label, url);
+    err = OtaDownload(u);
+    if (err == ESP_OK) {
+      err = OtaFinish(u);
+    } else {
+      esp_ota_abort(u->handle);
+    }
+  }
+  if (err == ESP_OK) err = esp_ota_set_boot_partition(target);
+  mbedtls_sha256_free(&u->sha);
+  PowerRelease(POWER_LOCK_NETWORK);
+
+  portENTER_CRITICAL(&statsLock);
+  stats.patch = u->state != OTA_STATE_FULL;
+  stats.durationMs = (esp_timer_get_time() - start) / 1000;
+  stats.result = err;
+  stats.running = false;
+  portEXIT_CRITICAL(&statsLock);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Update failed: %s", esp_err_to_name(err));
+  } else {
+    ESP_LOGW(TAG, "Downloaded %u bytes for a %u byte image, restarting into %s", stats.downloaded, stats.written, target->label);
+    vTaskDelay(pdMS_TO_TICKS(OTA_REBOOT_DELAY_MS));
+    esp_restart();
+  }
+  vTaskDelete(NULL);
+}
+
+esp_err_t OtaStart(const char *source) {
+  if (strlen(source) >= sizeof(url)) return ESP_ERR_INVALID_SIZE;
+  portENTER_CRITICAL(&statsLock);
+  bool busy = stats.running;
+  if (!busy) stats = (OtaStats){.running = true};
+  portEXIT_CRITICAL(&statsLock);
+  if (busy) return ESP_ERR_INVALID_STATE;
+
+  strlcpy(url, source, sizeof(url));
+  if (xTaskCreatePinnedToCore(OtaTask, "OtaTask", OTA_STACK, NULL, OTA_PRIORITY, NULL, OTA_CORE) != pdPASS) {
+    portENTER_CRITICAL(&statsLock);
+    stats.running = false;
+    portEXIT_CRITICAL(&statsLock);
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void OtaGetStats(OtaStats *out) {
+  portENTER_CRITICAL(&statsLock);
+  *out = stats;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+// True once every zone has had a fault free reading, polled until OTA_VERIFY_TIMEOUT_MS after the call
+static bool OtaSensorsRead(void) {
+  Temperature temp;
+  int64_t deadlineUs = esp_timer_get_time() + OTA_VERIFY_TIMEOUT_MS * 1000LL;
+  int zone = 0;
+  while (zone < ZONE_COUNT) {
+    TempSensorGetLatest(zone, &temp);
+    if (temp.seq != 0 && temp.faults == 0) {
+      zone++;
+      continue;
+    }
+    if (esp_timer_get_time() >= deadlineUs) {
+      ESP_LOGE(TAG, "Zone %d has no fault free reading, faults 0x%x", zone, temp.faults);
+      return false;
+    }
+    vTaskDelay(pdMS_TO_TICKS(OTA_VERIFY_POLL_MS));
+  }
+  return true;
+}
+
+// Keeps a freshly updated image once it has passed its own checks, otherwise boots the old one. The checks are local
+// so a router or server outage can't roll back a good image, connectivity is only watched and logged afterwards.
+static void OtaVerifyTask(void *args) {
+  // Boot covers the relays being configured from NVS and every other module coming up
+  if (!BootSucceeded(BOOT_TIMEOUT_MS + OTA_VERIFY_TIMEOUT_MS)) {
+    ESP_LOGE(TAG, "New image did not finish booting, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+  if (!OtaSensorsRead()) {
+    ESP_LOGE(TAG, "New image could not read its sensors, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+  ESP_LOGI(TAG, "New image passed its self checks, cancelling rollback");
+  esp_ota_mark_app_valid_cancel_rollback();
+
+  EventBits_t bits = xEventGroupWaitBits(DeviceStatus, WIFI_CONNECTED, pdFALSE, pdTRUE, pdMS_TO_TICKS(OTA_CONNECT_TIMEOUT_MS));
+  if (bits & WIFI_CONNECTED) {
+    ESP_LOGI(TAG, "New image joined Wi-Fi");
+  } else {
+    ESP_LOGW(TAG, "New image has not joined Wi-Fi within %d s, it stays installed", OTA_CONNECT_TIMEOUT_MS / 1000);
+  }
+  vTaskDelete(NULL);
+}
+
+static const char *OtaStateName(esp_ota_img_states_t state) {
+  switch (state) {
+    case ESP_OTA_IMG_NEW:
+      return "new";
+    case ESP_OTA_IMG_PENDING_VERIFY:
+      return "pending verify";
+    case ESP_OTA_IMG_VALID:
+      return "valid";
+    case ESP_OTA_IMG_INVALID:
+      return "invalid";
+    case ESP_OTA_IMG_ABORTED:
+      return "aborted";
+    default:
+      return "undefined";
+  }
+}
+
+static struct {
+  struct arg_str *url;
+  struct arg_end *end;
+} ota_args;
+
+static int OtaConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&ota_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, ota_args.end, argv[0]);
+    return 1;
+  }
+  if (ota_args.url->count) {
+    esp_err_t err = OtaStart(ota_args.url->sval[0]);
+    if (err != ESP_OK) {
+      printf("Could not start the update: %s\n", esp_err_to_name(err));
+      return 1;
+    }
+    printf("Update started\n");
+    return 0;
+  }
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state = ESP_OTA_IMG_UNDEFINED;
+  esp_ota_get_state_partition(running, &state);
+  printf("running: %s (%s), version %s\n", running->label, OtaStateName(state), esp_ota_get_app_description()->version);
+
+  OtaStats s;
+  OtaGetStats(&s);
+  if (s.running) {
+    printf("update in progress: %u bytes downloaded, %u written\n", s.downloaded, s.written);
+  } else if (s.written > 0) {
+    printf("last update: %s, %s, %u bytes downloaded for a %u byte image (%.1f %%), %u copied from the running image, %u ms\n",
+           s.result == ESP_OK ? "ok" : esp_err_to_name(s.result), s.patch ? "patch" : "full image", s.downloaded, s.written,
+           100.0 * s.downloaded / s.written, s.copied, s.durationMs);
+  }
+  return 0;
+}
+
+static void RegisterOta(void) {
+  ota_args.url = arg_str0("u", "url", "<url>", "Fetch a patch or full image from this URL and restart into it");
+  ota_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "ota",
+      .help = "Show the running slot and the last update, or start one",
+      .hint = NULL,
+      .func = &OtaConsoleCmd,
+      .argtable = &ota_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupOta(void) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+    ESP_LOGW(TAG, "First boot of %s, rolling back unless it boots and reads its sensors", running->label);
+    BudgetCreateTask(TAG, OtaVerifyTask, "OtaVerifyTask", OTA_VERIFY_STACK, NULL, OTA_PRIORITY, OTA_CORE, OtaVerifyStack, &OtaVerifyTCB);
+  }
+  RegisterOta();
+}
@@ -0,0 +1,352 @@
+#include "perf.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "cJSON.h"
+#include "config.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "json_arena.h"
+#include "memory_budget.h"
+#include "task_config.h"
+#include "websocket.h"
+
+#define TAG "PERF"
+
+typedef struct PerfQueue {
+  QueueHandle_t queue;
+  PerfQueueStats stats;
+} PerfQueue;
+
+typedef struct PerfSample {
+  TaskHandle_t handle;
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t runtime;
+  uint32_t stackFree;
+  BaseType_t core;
+} PerfSample;
+
+typedef struct PerfTaskUsage {
+  char name[configMAX_TASK_NAME_LEN];
+  float cpu;  // percent of one core over the window
+  uint32_t stackFree;
+  BaseType_t core;
+} PerfTaskUsage;
+
+typedef struct PerfWindow {
+  PerfTaskUsage tasks[PERF_MAX_TASKS];
+  int count;
+  float seconds;
+} PerfWindow;
+
+static PerfQueue queues[PERF_MAX_QUEUES];
+static int queueCount;
+static portMUX_TYPE queuesLock = portMUX_INITIALIZER_UNLOCKED;
+
+static PerfSample previous[PERF_MAX_TASKS];
+static int previousCount;
+static int64_t previousTime;
+static PerfWindow latest;
+static SemaphoreHandle_t latestLock;
+static StaticSemaphore_t latestLockBuffer;
+
+STATIC_TASK(Perf, PERF_STACK);
+STATIC_JSON_ARENA(DiagnosticsArena, 4096);  // About 3.5 kB of nodes and keys for the worst case document
+
+void PerfTrackQueue(const char *name, QueueHandle_t queue, UBaseType_t length) {
+  portENTER_CRITICAL(&queuesLock);
+  if (queueCount < PERF_MAX_QUEUES) {
+    queues[queueCount].queue = queue;
+    queues[queueCount].stats = (PerfQueueStats){.name = name, .length = length};
+    queueCount++;
+  }
+  portEXIT_CRITICAL(&queuesLock);
+}
+
+static PerfQueue *FindQueue(QueueHandle_t queue) {
+  for (int i = 0; i < queueCount; i++) {
+    if (queues[i].queue == queue) return &queues[i];
+  }
+  return NULL;
+}
+
+void PerfHideQueue(QueueHandle_t queue) {
+  portENTER_CRITICAL(&queuesLock);
+  PerfQueue *q = FindQueue(queue);
+  if (q != NULL) q->stats.hidden = true;
+  portEXIT_CRITICAL(&queuesLock);
+}
+
+BaseType_t PerfQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+  BaseType_t sent = xQueueSend(queue, item, wait);
+  UBaseType_t depth = uxQueueMessagesWaiting(queue);
+
+  PerfQueue *q = FindQueue(queue);
+  if (q == NULL) return sent;
+  portENTER_CRITICAL(&queuesLock);
+  q->stats.sends++;
+  if (sent != pdTRUE) q->stats.failed++;
+  if (depth > q->stats.peak) q->stats.peak = depth;
+  portEXIT_CRITICAL(&queuesLock);
+  return sent;
+}
+
+static int PerfGetQueues(PerfQueueStats *out) {
+  int i, count;
+  UBaseType_t depth;
+  portENTER_CRITICAL(&queuesLock);
+  count = queueCount;
+  portEXIT_CRITICAL(&queuesLock);
+
+  for (i = 0; i < count; i++) {
+    depth = uxQueueMessagesWaiting(queues[i].queue);
+    portENTER_CRITICAL(&queuesLock);
+    queues[i].stats.depth = depth;
+    if (depth > queues[i].stats.peak) queues[i].stats.peak = depth;  // catches xQueueOverwrite users too
+    out[i] = queues[i].stats;
+    portEXIT_CRITICAL(&queuesLock);
+  }
+  return count;
+}
+
+// Reads every task's run time counter, only ever called from the perf task
+static int PerfTakeSamples(PerfSample *samples) {
+  static TaskStatus_t status[PERF_MAX_TASKS];
+  UBaseType_t count = uxTaskGetSystemState(status, PERF_MAX_TASKS, NULL);
+  for (int i = 0; i < count; i++) {
+    samples[i].handle = status[i].xHandle;
+    strlcpy(samples[i].name, status[i].pcTaskName, sizeof(samples[i].name));
+    samples[i].runtime = status[i].ulRunTimeCounter;
+    samples[i].stackFree = status[i].usStackHighWaterMark;
+    samples[i].core = status[i].xCoreID;
+  }
+  return count;
+}
+
+static void PerfUpdateWindow(void) {
+  static PerfSample current[PERF_MAX_TASKS];
+  static PerfWindow window;
+  int64_t now = esp_timer_get_time();
+  int count = PerfTakeSamples(current);
+  int i, j, k;
+  uint32_t elapsed = now - previousTime;
+
+  window.count = 0;
+  window.seconds = elapsed / 1000000.0;
+  for (i = 0; i < count; i++) {
+    uint32_t used = current[i].runtime;  // tasks created during the window count from zero
+    for (j = 0; j < previousCount; j++) {
+      if (previous[j].handle == current[i].handle) {
+        used = current[i].runtime - previous[j].runtime;
+        break;
+      }
+    }
+
+    PerfTaskUsage usage = {.cpu = elapsed ? 100.0 * used / elapsed : 0, .stackFree = current[i].stackFree, .core = current[i].core};
+    strlcpy(usage.name, current[i].name, sizeof(usage.name));
+    // Keep the window sorted busiest first
+    for (k = window.count; k > 0 && window.tasks[k - 1].cpu < usage.cpu; k--) window.tasks[k] = window.tasks[k - 1];
+    window.tasks[k] = usage;
+    window.count++;
+  }
+
+  memcpy(previous, current, sizeof(PerfSample) * count);
+  previousCount = count;
+  previousTime = now;
+
+  xSemaphoreTake(latestLock, portMAX_DELAY);
+  latest = window;
+  xSemaphoreGive(latestLock);
+}
+
+// Prints the diagnostics document into the message, false if it didn't fit
+static bool PerfPrintDiagnostics(WebSocketMessage *msg, const PerfWindow *window, const PerfQueueStats *stats, int count, uint32_t uptime,
+                                 uint32_t heap) {
+  char name[configMAX_TASK_NAME_LEN];
+  int i, queued = 0;
+
+  JsonArenaBegin(&DiagnosticsArena);
+  cJSON *data = cJSON_CreateObject();
+  cJSON_AddStringToObject(data, "id", ID);
+  cJSON_AddNumberToObject(data, "uptime", uptime);
+  cJSON_AddNumberToObject(data, "heap", heap);
+  cJSON *tasks = cJSON_AddArrayToObject(data, "tasks");
+  for (i = 0; i < window->count && i < PERF_DIAGNOSTICS_TASKS; i++) {
+    cJSON *task = cJSON_CreateObject();
+    cJSON_AddStringToObject(task, "name", window->tasks[i].name);
+    cJSON_AddNumberToObject(task, "cpu", (int)(window->tasks[i].cpu * 10) / 10.0);
+    cJSON_AddNumberToObject(task, "stack", window->tasks[i].stackFree);
+    cJSON_AddItemToArray(tasks, task);
+  }
+  cJSON *queueArray = cJSON_AddArrayToObject(data, "queues");
+  for (i = 0; i < count && queued < PERF_DIAGNOSTICS_QUEUES; i++) {
+    if (stats[i].hidden) continue;
+    strlcpy(name, stats[i].name, sizeof(name));
+    cJSON *queue = cJSON_CreateObject();
+    cJSON_AddStringToObject(queue, "name", name);
+    cJSON_AddNumberToObject(queue, "depth", stats[i].depth);
+    cJSON_AddNumberToObject(queue, "peak", stats[i].peak);
+    cJSON_AddNumberToObject(queue, "failed", stats[i].failed);
+    cJSON_AddItemToArray(queueArray, queue);
+    queued++;
+  }
+
+  bool printed = cJSON_PrintPreallocated(data, msg->dataString.string, sizeof(msg->dataString.string), false);
+  msg->dataString.length = printed ? strlen(msg->dataString.string) : 0;
+  cJSON_Delete(data);
+  JsonArenaEnd(&DiagnosticsArena);
+  return printed;
+}
+
+static void PerfSendDiagnostics(void) {
+  WebSocketMessage *msg;
+  static PerfWindow window;
+  PerfQueueStats stats[PERF_MAX_QUEUES];
+  int count;
+
+  if (!(xEventGroupGetBits(DeviceStatus) & WEBSOCKET_READY)) return;
+  // Diagnostics are the first thing to give way when the websocket is backed up
+  msg = WebsocketMessageAlloc("mutation", "appliance.diagnostics", 0);
+  if (msg == NULL) {
+    ESP_LOGD(TAG, "No websocket message free, skipping diagnostics");
+    return;
+  }
+
+  xSemaphoreTake(latestLock, portMAX_DELAY);
+  window = latest;
+  xSemaphoreGive(latestLock);
+  count = PerfGetQueues(stats);
+
+  if (!PerfPrintDiagnostics(msg, &window, stats, count, esp_timer_get_time() / 1000000, heap_caps_get_free_size(MALLOC_CAP_8BIT))) {
+    ESP_LOGW(TAG, "Diagnostics do not fit in a websocket message");
+    BufferRelease(msg);
+  } else if (xQueueSend(WebsocketQueue, &msg, 0) != pdTRUE) {
+    ESP_LOGD(TAG, "Websocket queue full, skipping diagnostics");
+    BufferRelease(msg);
+  }
+}
+
+// Prints the largest diagnostics document the limits allow once at boot: every name as long as a task name, every
+// number as wide as it gets. Stops here if it doesn't fit a JSONString or spills out of DiagnosticsArena.
+static void PerfCheckDiagnostics(void) {
+  static PerfWindow window;
+  PerfQueueStats stats[PERF_DIAGNOSTICS_QUEUES];
+  char name[configMAX_TASK_NAME_LEN];
+  int i;
+
+  WebSocketMessage *msg = WebsocketMessageAlloc("mutation", "appliance.diagnostics", 0);
+  if (msg == NULL) {
+    ESP_LOGW(TAG, "No websocket message free, diagnostics size not checked");
+    return;
+  }
+  memset(name, 'W', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  window.count = PERF_DIAGNOSTICS_TASKS;
+  for (i = 0; i < PERF_DIAGNOSTICS_TASKS; i++) {
+    window.tasks[i] = (PerfTaskUsage){.cpu = 99.9, .stackFree = 99999};  // No stack is near 100 kB
+    strlcpy(window.tasks[i].name, name, sizeof(window.tasks[i].name));
+  }
+  for (i = 0; i < PERF_DIAGNOSTICS_QUEUES; i++) {
+    stats[i] = (PerfQueueStats){.name = name, .depth = 999, .peak = 999, .failed = UINT32_MAX};
+  }
+
+  uint32_t fallbacks = JsonHeapAllocations();
+  bool printed = PerfPrintDiagnostics(msg, &window, stats, PERF_DIAGNOSTICS_QUEUES, UINT32_MAX, 999999);
+  bool inArena = JsonHeapAllocations() == fallbacks;
+  ESP_LOGI(TAG, "Worst case diagnostics, %d of %d bytes: %s", msg->dataString.length, sizeof(msg->dataString.string) - 1,
+           printed ? msg->dataString.string : "(did not fit)");
+  if (!inArena) ESP_LOGE(TAG, "Worst case diagnostics outgrew DiagnosticsArena");
+  BufferRelease(msg);
+  configASSERT(printed && inArena);
+}
+
+static void PerfTask(void *args) {
+  TickType_t wake = xTaskGetTickCount();
+  int64_t lastDiagnostics = esp_timer_get_time();
+  previousCount = PerfTakeSamples(previous);
+  previousTime = esp_timer_get_time();
+
+  while (true) {
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(PERF_WINDOW_MS));
+    PerfUpdateWindow();
+    if (esp_timer_get_time() - lastDiagnostics >= PERF_DIAGNOSTICS_INTERVAL_MS * 1000LL) {
+      lastDiagnostics = esp_timer_get_time();
+      PerfSendDiagnostics();
+    }
+  }
+}
+
+static void PerfPrint(void) {
+  static PerfWindow window;
+  PerfQueueStats stats[PERF_MAX_QUEUES];
+  int i, count;
+
+  xSemaphoreTake(latestLock, portMAX_DELAY);
+  window = latest;
+  xSemaphoreGive(latestLock);
+
+  printf("%-16s %4s %7s %10s   (last %.1f s)\n", "task", "core", "cpu %", "stack free", window.seconds);
+  for (i = 0; i < window.count; i++) {
+    PerfTaskUsage *t = &window.tasks[i];
+    printf("%-16s %4s %7.1f %10u\n", t->name, t->core == tskNO_AFFINITY ? "-" : (t->core == PRO_CPU_NUM ? "0" : "1"), t->cpu, t->stackFree);
+  }
+
+  count = PerfGetQueues(stats);
+  printf("\n%-20s %5s %4s %6s %8s %8s\n", "queue", "depth", "peak", "length", "sends", "failed");
+  for (i = 0; i < count; i++) {
+    PerfQueueStats *q = &stats[i];
+    printf("%-20s %5u %4u %6u %8u %8u\n", q->name, q->depth, q->peak, q->length, q->sends, q->failed);
+  }
+}
+
+static struct {
+  struct arg_int *repeat;
+  struct arg_end *end;
+} perf_args;
+
+static int PerfConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&perf_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, perf_args.end, argv[0]);
+    return 1;
+  }
+
+  int repeat = perf_args.repeat->count ? perf_args.repeat->ival[0] : 1;
+  for (int i = 0; i < repeat; i++) {
+    if (i > 0) {
+      vTaskDelay(pdMS_TO_TICKS(PERF_WINDOW_MS));
+      printf("\n");
+    }
+    PerfPrint();
+  }
+  return 0;
+}
+
+static void RegisterPerf(void) {
+  perf_args.repeat = arg_int0("n", "repeat", "<n>", "Print a fresh window n times, top style");
+  perf_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "perf",
+      .help = "Get per task CPU usage over the last window, queue depths and sends that found them full",
+      .hint = NULL,
+      .func = &PerfConsoleCmd,
+      .argtable = &perf_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupPerf(void) {
+  PerfCheckDiagnostics();
+  latestLock = BudgetCreateMutex(TAG, "latestLock", &latestLockBuffer);
+  BudgetCreateTask(TAG, PerfTask, "PerfTask", PERF_STACK, NULL, PERF_PRIORITY, PERF_CORE, PerfStack, &PerfTCB);
+  RegisterPerf();
+}
@@ -0,0 +1,122 @@
+#include "power.h"
+
+#include <stdio.h>
+
+#include "console.h"
+#include "driver/uart.h"
+#include "esp_console.h"
+#include "esp_err.h"
+#include "esp_freertos_hooks.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "qr_scanner.h"
+#include "sdkconfig.h"
+
+#define TAG "POWER"
+
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t locks[POWER_LOCK_COUNT];
+static const struct {
+  esp_pm_lock_type_t type;
+  const char *name;
+} lockConfig[POWER_LOCK_COUNT] = {
+    [POWER_LOCK_CONTROL] = {ESP_PM_CPU_FREQ_MAX, "control"},
+    [POWER_LOCK_SENSOR] = {ESP_PM_APB_FREQ_MAX, "sensor"},
+    [POWER_LOCK_NETWORK] = {ESP_PM_CPU_FREQ_MAX, "network"},
+    [POWER_LOCK_BUZZER] = {ESP_PM_APB_FREQ_MAX, "buzzer"},
+    [POWER_LOCK_SCANNER] = {ESP_PM_NO_LIGHT_SLEEP, "scanner"},
+};
+#endif
+
+// Every pass of the idle loop follows a wake up, so counting them per core gives wake ups per second
+static volatile uint32_t idleLoops[portNUM_PROCESSORS];
+static uint32_t lastIdleLoops[portNUM_PROCESSORS];
+static int64_t lastSample;
+
+static bool CountWakeUp(void) {
+  idleLoops[xPortGetCoreID()]++;
+  return true;
+}
+
+void PowerAcquire(PowerLock lock) {
+#ifdef CONFIG_PM_ENABLE
+  if (lock < POWER_LOCK_COUNT && locks[lock] != NULL) esp_pm_lock_acquire(locks[lock]);
+#endif
+}
+
+void PowerRelease(PowerLock lock) {
+#ifdef CONFIG_PM_ENABLE
+  if (lock < POWER_LOCK_COUNT && locks[lock] != NULL) esp_pm_lock_release(locks[lock]);
+#endif
+}
+
+void PowerSetCooking(bool cooking) {
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config = {
+      .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+      .min_freq_mhz = cooking ? POWER_COOKING_MIN_FREQ_MHZ : POWER_IDLE_MIN_FREQ_MHZ,
+      .light_sleep_enable = !cooking && POWER_IDLE_LIGHT_SLEEP,
+  };
+  esp_err_t err = esp_pm_configure(&config);
+  if (err != ESP_OK) ESP_LOGE(TAG, "Failed to configure power management: %s", esp_err_to_name(err));
+#endif
+  // Telemetry goes out every second while cooking so wake for every DTIM, between cooks follow the listen interval
+  esp_wifi_set_ps(cooking ? WIFI_PS_MIN_MODEM : WIFI_PS_MAX_MODEM);
+  ESP_LOGI(TAG, "Using %s power policy", cooking ? "cooking" : "idle");
+}
+
+static int PowerConsoleCmd(int argc, char **argv) {
+  int64_t now = esp_timer_get_time();
+  float seconds = (now - lastSample) / 1000000.0;
+  for (int i = 0; i < portNUM_PROCESSORS; i++) {
+    uint32_t loops = idleLoops[i];
+    printf("core %d: %.1f wake ups/s\n", i, (loops - lastIdleLoops[i]) / seconds);
+    lastIdleLoops[i] = loops;
+  }
+  printf("over the last %.1f s\n", seconds);
+  lastSample = now;
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_dump_locks(stdout);
+#else
+  printf("Power management is disabled\n");
+#endif
+  return 0;
+}
+
+static void RegisterPower(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "power",
+      .help = "Get wake ups per second since the last call and time spent in each power mode",
+      .hint = NULL,
+      .func = &PowerConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupPower(void) {
+  ESP_LOGD(TAG, "Setting up power management");
+#ifdef CONFIG_PM_ENABLE
+  for (int i = 0; i < POWER_LOCK_COUNT; i++) {
+    ESP_ERROR_CHECK(esp_pm_lock_create(lockConfig[i].type, 0, lockConfig[i].name, &locks[i]));
+  }
+  // UART0 and UART1 are the only UARTs that can wake the chip, and the waking bytes are lost. The console on UART0
+  // wakes it on a keystroke and the scanner on UART1 on a scan, though the scanner keeps it awake while a scan is wanted.
+  if (CONFIG_ESP_CONSOLE_UART_NUM >= 0 && CONFIG_ESP_CONSOLE_UART_NUM <= UART_NUM_1 && CONFIG_ESP_CONSOLE_UART_NUM != UART_PORT) {
+    ESP_ERROR_CHECK(uart_set_wakeup_threshold(CONFIG_ESP_CONSOLE_UART_NUM, 3));
+    ESP_ERROR_CHECK(esp_sleep_enable_uart_wakeup(CONFIG_ESP_CONSOLE_UART_NUM));
+  }
+  ESP_ERROR_CHECK(uart_set_wakeup_threshold(UART_PORT, 3));
+  ESP_ERROR_CHECK(esp_sleep_enable_uart_wakeup(UART_PORT));
+#endif
+  for (int i = 0; i < portNUM_PROCESSORS; i++) {
+    ESP_ERROR_CHECK(esp_register_freertos_idle_hook_for_cpu(CountWakeUp, i));
+  }
+  lastSample = esp_timer_get_time();
+  PowerSetCooking(false);
+  RegisterPower();
+  ESP_LOGD(TAG, "Power management setup complete");
+}
@@ -5,31 +5,235 @@
 #include <string.h>
 
 #include "config.h"
+#include "console.h"
+#include "cooking_controller.h"
 #include "driver/gpio.h"
+#include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "helpers.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "task_config.h"
 
 #define TAG "QR_SCANNER"
+// Idle time in baud cycles after the terminator before the pattern interrupt fires
+#define PATTERN_CHR_TIMEOUT 9
+// Time the terminator itself spends on the wire, 1 start + 8 data + 1 stop bit
+#define TERMINATOR_WIRE_US (10 * 1000000 / UART_BAUD)
+
 QueueHandle_t QRCodeQueue;
-char qrCode[QR_CODE_LENGTH];
+static QueueHandle_t UartQueue;
+STATIC_QUEUE(QRCodeQueue, QR_CODE_QUEUE_LENGTH, QRCode);
+STATIC_TASK(QRScanner, QR_SCANNER_STACK);
+static char qrCode[QR_CODE_LENGTH];
+static QRScannerStats stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct RecentScan {
+  uint8_t uuid[UUID_BYTES];
+  int64_t expires;  // 0 when the slot has never been used
+} RecentScan;
+
+static RecentScan recentScans[QR_RECENT_SCANS];
+
+// FNV-1a over the binary UUID
+static uint32_t HashUUID(const uint8_t *uuid) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < UUID_BYTES; i++) {
+    hash ^= uuid[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Open addressing set with linear probing. Returns true if the code is still live, otherwise records it.
+// Either way the code's TTL restarts so a label left in front of the scanner stays suppressed.
+static bool SeenRecently(const uint8_t *uuid, int64_t now) {
+  const uint32_t mask = QR_RECENT_SCANS - 1;
+  uint32_t slot = HashUUID(uuid) & mask;
+  int reusable = -1;
+  int oldest = slot;
+
+  for (int i = 0; i < QR_RECENT_SCANS; i++, slot = (slot + 1) & mask) {
+    RecentScan *entry = &recentScans[slot];
+    if (entry->expires == 0) {  // End of the probe chain
+      if (reusable < 0) reusable = slot;
+      break;
+    }
+    if (memcmp(entry->uuid, uuid, UUID_BYTES) == 0) {
+      bool live = entry->expires > now;
+      entry->expires = now + QR_DEDUP_TTL_MS * 1000LL;
+      return live;
+    }
+    if (entry->expires <= now && reusable < 0) reusable = slot;
+    if (entry->expires < recentScans[oldest].expires) oldest = slot;
+  }
+
+  if (reusable < 0) reusable = oldest;  // Every slot is live, evict the one closest to expiring
+  memcpy(recentScans[reusable].uuid, uuid, UUID_BYTES);
+  recentScans[reusable].expires = now + QR_DEDUP_TTL_MS * 1000LL;
+  return false;
+}
+
+// Drops a code SeenRecently just recorded so the next scan of it goes through. The slot is left expired rather than
+// empty, an empty slot would end the probe chain of any code stored past it.
+static void ForgetScan(const uint8_t *uuid) {
+  const uint32_t mask = QR_RECENT_SCANS - 1;
+  uint32_t slot = HashUUID(uuid) & mask;
+
+  for (int i = 0; i < QR_RECENT_SCANS && recentScans[slot].expires != 0; i++, slot = (slot + 1) & mask) {
+    if (memcmp(recentScans[slot].uuid, uuid, UUID_BYTES) == 0) {
+      recentScans[slot].expires = 1;
+      return;
+    }
+  }
+}
+
+static void ResetUart(void) {
+  uart_flush_input(UART_PORT);
+  uart_pattern_queue_reset(UART_PORT, QR_PATTERN_QUEUE_LENGTH);
+  xQueueReset(UartQueue);
+}
+
+// Reads everything up to and including the next terminator, returns the frame length or -1 if it had to be dropped
+static int ReadFrame(void) {
+  int pos = uart_pattern_pop_pos(UART_PORT);
+  if (pos < 0) {  // The pattern position queue overflowed so frame boundaries are lost
+    ESP_LOGW(TAG, "Lost track of frame boundaries, flushing");
+    ResetUart();
+    return -1;
+  }
+
+  int length = 0;
+  int remaining = pos + 1;  // frame plus terminator
+  while (remaining > 0) {
+    int space = (QR_CODE_LENGTH - 1) - length;
+    if (space <= 0) {  // Oversized frame, drain it without keeping it
+      char discard[32];
+      int read = uart_read_bytes(UART_PORT, discard, remaining < sizeof(discard) ? remaining : sizeof(discard), 0);
+      if (read <= 0) break;
+      remaining -= read;
+      length = QR_CODE_LENGTH;
+      continue;
+    }
+    int read = uart_read_bytes(UART_PORT, &qrCode[length], remaining < space ? remaining : space, 0);
+    if (read <= 0) break;
+    length += read;
+    remaining -= read;
+  }
+  if (length >= QR_CODE_LENGTH) return -1;
+
+  // Strip the terminator along with any CR/LF left over from the previous frame
+  while (length > 0 && (qrCode[length - 1] == QR_TERMINATOR || qrCode[length - 1] == '\r' || qrCode[length - 1] == '\n')) length--;
+  qrCode[length] = '\0';
+  int start = strspn(qrCode, "\r\n");
+  if (start > 0) {
+    length -= start;
+    memmove(qrCode, &qrCode[start], length + 1);
+  }
+  return length;
+}
+
 void QRScannerTask(void *args) {
-  int size = 0;
-  uart_flush(UART_PORT);
+  uart_event_t event;
+  int64_t detected;
+  QRCode code;
+  uint32_t latency;
+  int length;
+  bool received, listen;
+  bool awake = false;
 
   while (true) {
-    size = uart_read_bytes(UART_PORT, qrCode, (QR_CODE_LENGTH - 1), pdMS_TO_TICKS(50));
-    if (size) {
-      qrCode[size] = '\0';
-      ESP_LOGI(TAG, "QR code: %s", qrCode);
-      xQueueOverwrite(QRCodeQueue, (void *)qrCode);
-      uart_flush(UART_PORT);
-      vTaskDelay(pdMS_TO_TICKS(5000));
+    // Light sleep stops the UART and loses the bytes that wake it, which would cut the front off a scan. Stay out of it
+    // while some zone can take a recipe and for a while after any traffic, re-checked every QR_AWAKE_MS.
+    received = xQueueReceive(UartQueue, &event, pdMS_TO_TICKS(QR_AWAKE_MS)) == pdTRUE;
+    listen = received || CookingControllerIdleZone() >= 0;
+    if (listen && !awake) PowerAcquire(POWER_LOCK_SCANNER);
+    if (!listen && awake) PowerRelease(POWER_LOCK_SCANNER);
+    awake = listen;
+    if (!received) continue;
+
+    switch (event.type) {
+      case UART_PATTERN_DET:
+        detected = esp_timer_get_time();
+        length = ReadFrame();
+        if (length < 0) break;
+
+        portENTER_CRITICAL(&statsLock);
+        stats.frames++;
+        portEXIT_CRITICAL(&statsLock);
+
+        if (!UUIDParse(qrCode, length, code.uuid)) {
+          ESP_LOGW(TAG, "Rejected frame of %d bytes, not a UUID", length);
+          portENTER_CRITICAL(&statsLock);
+          stats.rejected++;
+          portEXIT_CRITICAL(&statsLock);
+          break;
+        }
+
+        if (SeenRecently(code.uuid, detected)) {
+          ESP_LOGD(TAG, "Ignoring repeat scan of %s", qrCode);
+          portENTER_CRITICAL(&statsLock);
+          stats.duplicates++;
+          portEXIT_CRITICAL(&statsLock);
+          break;
+        }
+
+        if (xQueueSend(QRCodeQueue, &code, 0) != pdTRUE) {
+          ESP_LOGW(TAG, "QR code queue full, dropping %s", qrCode);
+          ForgetScan(code.uuid);  // It was never handled, a rescan isn't a repeat
+          break;
+        }
+        latency = esp_timer_get_time() - detected + TERMINATOR_WIRE_US + PATTERN_CHR_TIMEOUT * 1000000 / UART_BAUD;
+        portENTER_CRITICAL(&statsLock);
+        stats.accepted++;
+        stats.lastLatencyUs = latency;
+        if (latency > stats.maxLatencyUs) stats.maxLatencyUs = latency;
+        portEXIT_CRITICAL(&statsLock);
+        ESP_LOGI(TAG, "QR code: %s, latency: %u us", qrCode, latency);
+        break;
+      case UART_FIFO_OVF:
+      case UART_BUFFER_FULL:
+        ESP_LOGW(TAG, "UART overflow, flushing");
+        portENTER_CRITICAL(&statsLock);
+        stats.overflows++;
+        portEXIT_CRITICAL(&statsLock);
+        ResetUart();
+        break;
+      default:  // Data stays buffered in the driver until its terminator arrives
+        break;
     }
-    vTaskDelay(pdMS_TO_TICKS(1000));
   }
 }
 
+void QRScannerGetStats(QRScannerStats *out) {
+  portENTER_CRITICAL(&statsLock);
+  *out = stats;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static int QRScannerStatsConsoleCmd(int argc, char **argv) {
+  QRScannerStats s;
+  QRScannerGetStats(&s);
+  printf("frames: %u, accepted: %u, duplicates: %u, rejected: %u, overflows: %u\n", s.frames, s.accepted, s.duplicates, s.rejected,
+         s.overflows);
+  printf("last byte to enqueue: last %u us, max %u us\n", s.lastLatencyUs, s.maxLatencyUs);
+  return 0;
+}
+
+static void RegisterQRScanner(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "qr",
+      .help = "Get QR scanner statistics",
+      .hint = NULL,
+      .func = &QRScannerStatsConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
 void SetupQRScanner(void) {
   ESP_LOGD(TAG, "Setting up QR scanner");
   uart_config_t uart_config = {
@@ -41,13 +245,17 @@ void SetupQRScanner(void) {
       .source_clk = UART_SCLK_REF_TICK,
   };
 
-  ESP_ERROR_CHECK(uart_driver_install(UART_PORT, QR_CODE_LENGTH * 2, 0, 0, NULL, 0));
+  ESP_ERROR_CHECK(uart_driver_install(UART_PORT, QR_CODE_LENGTH * 2, 0, QR_UART_EVENT_QUEUE_LENGTH, &UartQueue, 0));
   ESP_ERROR_CHECK(uart_param_config(UART_PORT, &uart_config));
   ESP_ERROR_CHECK(uart_set_pin(UART_PORT, UART_TXD, UART_RXD, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+  ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(UART_PORT, QR_TERMINATOR, 1, PATTERN_CHR_TIMEOUT, 0, 0));
+  ESP_ERROR_CHECK(uart_pattern_queue_reset(UART_PORT, QR_PATTERN_QUEUE_LENGTH));
   ESP_LOGD(TAG, "QR Scanner UART Configured");
 
-  QRCodeQueue = xQueueCreate(1, sizeof(qrCode));
-  BaseType_t task = xTaskCreate(QRScannerTask, "QRScannerTask", QR_CODE_LENGTH * 2, NULL, 1, NULL);
-  if (task == pdFALSE) ESP_LOGE(TAG, "Failed to create QR scanner task");
+  QRCodeQueue = BudgetCreateQueue(TAG, "QRCodeQueue", QR_CODE_QUEUE_LENGTH, sizeof(QRCode), QRCodeQueueStorage, &QRCodeQueueBuffer);
+  TaskHandle_t task = BudgetCreateTask(TAG, QRScannerTask, "QRScannerTask", QR_SCANNER_STACK, NULL, QR_SCANNER_PRIORITY, QR_SCANNER_CORE,
+                                       QRScannerStack, &QRScannerTCB);
+  if (task == NULL) ESP_LOGE(TAG, "Failed to create QR scanner task");
+  RegisterQRScanner();
   ESP_LOGD(TAG, "QR scanner task created");
 }
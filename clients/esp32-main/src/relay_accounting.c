@@ -0,0 +1,218 @@
+#include "relay_accounting.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+#include "memory_budget.h"
+#include "task_config.h"
+#include "zone.h"
+
+#define TAG "RELAY_ACCOUNTING"
+
+typedef struct RelayChannel {
+  uint64_t onMs;  // Lifetime, finished on intervals only
+  uint32_t cycles;
+  bool on;
+  int64_t onSinceMs;
+  // Lifetime values at the start of the channel's current or last cook, and what the last finished cook used
+  uint64_t cookStartOnMs;
+  uint32_t cookStartCycles;
+  uint32_t lastCookOnMs;
+  uint32_t lastCookCycles;
+} RelayChannel;
+
+typedef struct RelayCheckpointBlob {
+  uint8_t version;
+  uint32_t checkpoints;
+  uint64_t onMs[RELAY_MAX_CHANNELS];
+  uint32_t cycles[RELAY_MAX_CHANNELS];
+} RelayCheckpointBlob;
+
+static const char *channelNames[RELAY_MAX_CHANNELS] = {
+    "indicator", "top", "bottom", "fan", "rotisserie", "zone 1 top", "zone 1 bottom", "zone 2",
+};
+static const uint16_t channelWatts[RELAY_MAX_CHANNELS] = {
+    INDICATOR_LIGHT_WATTS,           TOP_HEATING_ELEMENT_WATTS,          BOTTOM_HEATING_ELEMENT_WATTS, CONVECTION_FAN_WATTS,
+    ROTISERRIE_WATTS,                ZONE1_TOP_HEATING_ELEMENT_WATTS,    ZONE1_BOTTOM_HEATING_ELEMENT_WATTS,
+    ZONE2_HEATING_ELEMENT_WATTS,
+};
+
+static RelayChannel channels[RELAY_MAX_CHANNELS];
+static portMUX_TYPE channelsLock = portMUX_INITIALIZER_UNLOCKED;
+static RelayCheckpointBlob saved;  // Last blob written, under channelsLock
+static TimerHandle_t checkpointTimer;
+static StaticTimer_t checkpointTimerBuffer;
+static TaskHandle_t RelayCheckpoint;
+STATIC_TASK(RelayCheckpoint, RELAY_CHECKPOINT_STACK);
+
+static int64_t NowMs(void) { return esp_timer_get_time() / 1000; }
+
+// Lifetime on-time including an interval still running. Called with channelsLock held.
+static uint64_t ChannelOnMs(const RelayChannel *c, int64_t now) { return c->onMs + (c->on ? now - c->onSinceMs : 0); }
+
+static float EnergyWh(int channel, uint64_t onMs) { return channelWatts[channel] * (onMs / 3600000.0f); }
+
+void RelayAccountingSet(int channel, int level) {
+  RelayChannel *c = &channels[channel];
+  int64_t now = NowMs();
+  portENTER_CRITICAL(&channelsLock);
+  if (level && !c->on) {
+    c->on = true;
+    c->onSinceMs = now;
+    c->cycles++;
+  } else if (!level && c->on) {
+    c->on = false;
+    c->onMs += now - c->onSinceMs;
+  }
+  portEXIT_CRITICAL(&channelsLock);
+}
+
+void RelayAccountingCookStart(int zone) {
+  EventBits_t relays = ZONE_RELAYS(&Zones[zone]);
+  int64_t now = NowMs();
+  portENTER_CRITICAL(&channelsLock);
+  for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) {
+    if (!(relays & BIT(ch))) continue;
+    channels[ch].cookStartOnMs = ChannelOnMs(&channels[ch], now);
+    channels[ch].cookStartCycles = channels[ch].cycles;
+  }
+  portEXIT_CRITICAL(&channelsLock);
+}
+
+int RelayAccountingCookEnd(int zone, RelayUsage *usage, int max) {
+  EventBits_t relays = ZONE_RELAYS(&Zones[zone]);
+  int64_t now = NowMs();
+  int count = 0;
+  portENTER_CRITICAL(&channelsLock);
+  for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) {
+    if (!(relays & BIT(ch))) continue;
+    RelayChannel *c = &channels[ch];
+    c->lastCookOnMs = ChannelOnMs(c, now) - c->cookStartOnMs;
+    c->lastCookCycles = c->cycles - c->cookStartCycles;
+    if (count == max) continue;
+    usage[count++] = (RelayUsage){
+        .channel = ch,
+        .onSeconds = c->lastCookOnMs / 1000,
+        .cycles = c->lastCookCycles,
+        .energyWh = EnergyWh(ch, c->lastCookOnMs),
+        .lifetimeCycles = c->cycles,
+        .lifetimeHours = ChannelOnMs(c, now) / 3600000.0f,
+    };
+  }
+  portEXIT_CRITICAL(&channelsLock);
+  return count;
+}
+
+// Blocks on flash, only runs on RelayCheckpointTask
+static void RelayAccountingCheckpoint(void) {
+#ifndef SIMULATION  // Simulated cooks never add to the board's lifetime counters
+  RelayCheckpointBlob blob = {.version = RELAY_ACCOUNTING_VERSION}, last;
+  int64_t now = NowMs();
+  portENTER_CRITICAL(&channelsLock);
+  last = saved;
+  for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) {
+    blob.onMs[ch] = ChannelOnMs(&channels[ch], now);
+    blob.cycles[ch] = channels[ch].cycles;
+  }
+  portEXIT_CRITICAL(&channelsLock);
+
+  // Nothing switched or ran since the last write, skip the flash wear
+  if (memcmp(blob.onMs, last.onMs, sizeof(blob.onMs)) == 0 && memcmp(blob.cycles, last.cycles, sizeof(blob.cycles)) == 0) return;
+  blob.checkpoints = last.checkpoints + 1;
+  if (FlashSet(NVS_TYPE_BLOB, RELAY_ACCOUNTING_KEY, &blob, sizeof(blob)) != ESP_OK) return;
+  portENTER_CRITICAL(&channelsLock);
+  saved = blob;
+  portEXIT_CRITICAL(&channelsLock);
+#endif
+}
+
+// Requests made while a write is running coalesce into one more pass
+static void RelayCheckpointTask(void *args) {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    RelayAccountingCheckpoint();
+  }
+}
+
+// The timer task only hands the write over, it must not wait on flash
+static void CheckpointTimerCallback(TimerHandle_t timer) { RelayAccountingRequestCheckpoint(); }
+
+void RelayAccountingRequestCheckpoint(void) {
+  if (RelayCheckpoint != NULL) xTaskNotifyGive(RelayCheckpoint);
+}
+
+static struct {
+  struct arg_lit *save;
+  struct arg_end *end;
+} relays_args;
+
+static int RelaysConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&relays_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, relays_args.end, argv[0]);
+    return 1;
+  }
+  if (relays_args.save->count) RelayAccountingRequestCheckpoint();
+
+  RelayChannel copy[RELAY_MAX_CHANNELS];
+  uint64_t onMs[RELAY_MAX_CHANNELS];
+  uint32_t checkpoints;
+  int64_t now = NowMs();
+  portENTER_CRITICAL(&channelsLock);
+  memcpy(copy, channels, sizeof(copy));
+  checkpoints = saved.checkpoints;
+  for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) onMs[ch] = ChannelOnMs(&channels[ch], now);
+  portEXIT_CRITICAL(&channelsLock);
+
+  printf("%-14s %5s %3s %10s %9s %9s | %8s %7s %8s\n", "channel", "watts", "on", "on hours", "cycles", "kWh", "cook s", "cycles", "cook Wh");
+  for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) {
+    printf("%-14s %5u %3s %10.2f %9u %9.2f | %8u %7u %8.1f\n", channelNames[ch], channelWatts[ch], copy[ch].on ? "yes" : "no",
+           onMs[ch] / 3600000.0, copy[ch].cycles, EnergyWh(ch, onMs[ch]) / 1000, copy[ch].lastCookOnMs / 1000, copy[ch].lastCookCycles,
+           EnergyWh(ch, copy[ch].lastCookOnMs));
+  }
+  printf("%u checkpoints written, every %d min while the counters change\n", checkpoints, RELAY_CHECKPOINT_INTERVAL_MS / 60000);
+  return 0;
+}
+
+static void RegisterRelayAccounting(void) {
+  relays_args.save = arg_lit0("s", "save", "Checkpoint the lifetime counters to flash now");
+  relays_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "relays",
+      .help = "Get per relay on-time, switching cycles and energy, over the lifetime and the last cook",
+      .hint = NULL,
+      .func = &RelaysConsoleCmd,
+      .argtable = &relays_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+// Restores the lifetime counters, a missing or older blob starts them from zero
+void SetupRelayAccounting(void) {
+  RelayCheckpointBlob blob;
+  if (FlashGet(NVS_TYPE_BLOB, RELAY_ACCOUNTING_KEY, &blob, sizeof(blob)) == ESP_OK && blob.version == RELAY_ACCOUNTING_VERSION) {
+    saved = blob;
+    for (int ch = 0; ch < RELAY_MAX_CHANNELS; ch++) {
+      channels[ch].onMs = blob.onMs[ch];
+      channels[ch].cycles = blob.cycles[ch];
+    }
+  } else {
+    ESP_LOGW(TAG, "No relay counters in flash, starting from zero");
+  }
+
+  checkpointTimer = BudgetCreateTimer(TAG, "RelayCheckpoint", pdMS_TO_TICKS(RELAY_CHECKPOINT_INTERVAL_MS), pdTRUE,
+                                      CheckpointTimerCallback, &checkpointTimerBuffer);
+  RelayCheckpoint = BudgetCreateTask(TAG, RelayCheckpointTask, "RelayCheckpoint", RELAY_CHECKPOINT_STACK, NULL, RELAY_CHECKPOINT_PRIORITY,
+                                     RELAY_CHECKPOINT_CORE, RelayCheckpointStack, &RelayCheckpointTCB);
+  xTimerStart(checkpointTimer, 0);
+  RegisterRelayAccounting();
+}
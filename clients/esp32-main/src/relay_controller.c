@@ -1,5 +1,6 @@
 #include "relay_controller.h"
 
+#include "binlog.h"
 #include "config.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
@@ -8,28 +9,56 @@
 #include "freertos/task.h"
 #include "hal/gpio_types.h"
 #include "helpers.h"
+#include "memory_budget.h"
+#include "relay_accounting.h"
+#include "simulation.h"
+#include "task_config.h"
+#include "trace.h"
+#include "zone.h"
 
 #define TAG "RELAY_CONTROLLER"
 
 TaskHandle_t RelayController;
 EventGroupHandle_t RelayControllerFlags;
+STATIC_TASK(RelayController, RELAY_CONTROLLER_STACK);
+static StaticEventGroup_t RelayControllerFlagsBuffer;
+static uint32_t cause;
 
+// Indexed by RelayControllerFlags bit
 int RelayDevices[] = {
     INDICATOR_LIGHT_PIN, TOP_HEATING_ELEMENT_PIN, BOTTOM_HEATING_ELEMENT_PIN, CONVECTION_FAN_PIN, ROTISERRIE_PIN,
+#if ZONE_COUNT > 1
+    ZONE1_TOP_HEATING_ELEMENT_PIN, ZONE1_BOTTOM_HEATING_ELEMENT_PIN,
+#endif
+#if ZONE_COUNT > 2
+    ZONE2_HEATING_ELEMENT_PIN,
+#endif
 };
 
+void RelayControllerSetCause(uint32_t seq) { __atomic_store_n(&cause, seq, __ATOMIC_RELAXED); }
+
+static void SetRelay(int index, int level) {
+  gpio_set_level(RelayDevices[index], level);
+  RelayAccountingSet(index, level);
+#ifdef SIMULATION
+  SimulationSetRelay(index, level);
+#endif
+}
+
 void RelayControllerTask(void *PvParams) {
   int i;
   const int length = NELEMS(RelayDevices);
   EventBits_t bits;
+  EventBits_t outputs = 0;  // what the pins were last driven to in regular operation
+  bool cooked = false;      // since the last checkpoint request
   while (true) {
     bits = xEventGroupWaitBits(DeviceStatus, EMERGENCY_STOP, pdFALSE, pdFALSE, pdMS_TO_TICKS(1000));
 
     // When emergency stop
     if (bits & EMERGENCY_STOP) {
       for (i = 0; i < length; i++) {
-        ESP_LOGV(TAG, "EMERGENCY STOP --> INDEX: %d - VALUE: 1", i);
-        gpio_set_level(RelayDevices[i], 0);
+        BINLOGV(TAG, "EMERGENCY STOP --> INDEX: %d - VALUE: 1", i);
+        SetRelay(i, 0);
       }
 
       // Waiting for emergency stop to lift
@@ -44,29 +73,42 @@ void RelayControllerTask(void *PvParams) {
     }
 
     // When not cooking
-    bits = xEventGroupWaitBits(DeviceStatus, IS_COOKING, pdFALSE, pdFALSE, pdMS_TO_TICKS(1000));
+    bits = xEventGroupGetBits(DeviceStatus);
     if (!(bits & IS_COOKING)) {
       for (i = 0; i < length; i++) {
-        ESP_LOGV(TAG, "NOT COOKING --> INDEX: %d - VALUE: 1", i);
-        gpio_set_level(RelayDevices[i], 0);
+        BINLOGV(TAG, "NOT COOKING --> INDEX: %d - VALUE: 1", i);
+        SetRelay(i, 0);
       }
+      outputs = 0;
+      if (cooked) {  // Every zone has finished, the counters won't move until the next cook
+        RelayAccountingRequestCheckpoint();
+        cooked = false;
+      }
+      // Everything is off, sleep until a cook starts or an emergency stop needs handling
+      xEventGroupWaitBits(DeviceStatus, IS_COOKING | EMERGENCY_STOP, pdFALSE, pdFALSE, portMAX_DELAY);
       continue;
     }
 
     // Regular operation
+    cooked = true;
     bits = xEventGroupGetBits(RelayControllerFlags);
     static bool is_set;
     for (i = 0; i < length; i++) {
       is_set = bits & (1 << i);
-      ESP_LOGV(TAG, "REGULAR --> INDEX: %d - VALUE: %d", i, is_set);
-      gpio_set_level(RelayDevices[i], is_set);
+      BINLOGV(TAG, "REGULAR --> INDEX: %d - VALUE: %d", i, is_set);
+      SetRelay(i, is_set);
+    }
+    if ((bits & ((1 << length) - 1)) != outputs) {
+      outputs = bits & ((1 << length) - 1);
+      Trace(TRACE_RELAY_EDGE, __atomic_load_n(&cause, __ATOMIC_RELAXED));
     }
   }
 }
 
 void SetupRelayController(void) {
   ESP_LOGD(TAG, "Setting up relay controller");
-  int pin_mask = 0;
+  SetupRelayAccounting();  // Before the first GPIO write so every edge is counted
+  uint64_t pin_mask = 0;  // GPIO 32 and up need the top half
   for (int i = 0; i < NELEMS(RelayDevices); i++) {
     BIT_SET(pin_mask, RelayDevices[i]);
   }
@@ -79,10 +121,11 @@ void SetupRelayController(void) {
 
   gpio_config(&relay_gpio_config);
 
-  RelayControllerFlags = xEventGroupCreate();
+  RelayControllerFlags = BudgetCreateEventGroup(TAG, "RelayControllerFlags", &RelayControllerFlagsBuffer);
 
-  BaseType_t task = xTaskCreate(RelayControllerTask, "RelayControllerTask", 2048, NULL, 5, &RelayController);
+  RelayController = BudgetCreateTask(TAG, RelayControllerTask, "RelayControllerTask", RELAY_CONTROLLER_STACK, NULL,
+                                     RELAY_CONTROLLER_PRIORITY, RELAY_CONTROLLER_CORE, RelayControllerStack, &RelayControllerTCB);
 
-  if (task == pdFALSE) ESP_LOGE(TAG, "Failed to create relay controller task");
+  if (RelayController == NULL) ESP_LOGE(TAG, "Failed to create relay controller task");
   ESP_LOGD(TAG, "Relay controller task created");
 }
@@ -0,0 +1,269 @@
+#include "sensor_bus.h"
+
+#include <driver/spi_master.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "simulation.h"
+#include "temperature_sensor.h"
+
+#define TAG "SENSOR_BUS"
+
+#define SENSOR_FRAME_SIGN BIT15       // Always 0 from a MAX6675
+#define SENSOR_FRAME_OPEN BIT2
+#define SENSOR_FRAME_DEVICE_ID BIT1  // Always 0 from a MAX6675
+#define SENSOR_BUS_MAX_PASSES 1000
+
+typedef struct SensorChannel {
+  spi_device_handle_t device;
+  int cs;
+  spi_transaction_t trans;  // Reused every sweep, the frame lands in trans.rx_data
+  bool inFlight;            // Timed out and still owned by the driver, reclaimed before the next queue
+  int64_t startUs;          // Written by the transfer callbacks in the SPI interrupt
+  uint32_t busyUs;
+  // Guarded by statsLock
+  uint32_t reads;
+  uint32_t open;
+  uint32_t missing;
+  uint32_t busErrors;
+  uint16_t lastFrame;
+} SensorChannel;
+
+typedef struct SensorSweepStats {
+  uint32_t sweeps;
+  uint32_t lastUs;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint64_t busyUs;  // Sum of the time each transaction held the bus, chip select setup and hold included
+} SensorSweepStats;
+
+static SensorChannel channels[SENSOR_BUS_MAX_CHANNELS];
+static int channelCount;
+static SensorSweepStats stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+// The channel transactions are reused, so one sweep at a time between the sensor task, bench and console
+static SemaphoreHandle_t sweepLock;
+static StaticSemaphore_t sweepLockBuffer;
+
+static void IRAM_ATTR SensorBusPreTransfer(spi_transaction_t *trans) {
+  SensorChannel *channel = trans->user;
+  channel->startUs = esp_timer_get_time();
+}
+
+static void IRAM_ATTR SensorBusPostTransfer(spi_transaction_t *trans) {
+  SensorChannel *channel = trans->user;
+  channel->busyUs = esp_timer_get_time() - channel->startUs;
+}
+
+int SensorBusAddChannel(int cs) {
+  if (channelCount == SENSOR_BUS_MAX_CHANNELS) {
+    ESP_LOGE(TAG, "No chip select left for GPIO %d", cs);
+    return -1;
+  }
+
+  SensorChannel *channel = &channels[channelCount];
+  spi_device_interface_config_t deviceCfg = {
+      .mode = 0,
+      .clock_speed_hz = SENSOR_BUS_CLOCK_HZ,
+      .spics_io_num = cs,
+      .queue_size = 1,  // One transaction per channel per sweep
+      .cs_ena_posttrans = 3,
+      .cs_ena_pretrans = 3,
+      .pre_cb = SensorBusPreTransfer,
+      .post_cb = SensorBusPostTransfer,
+  };
+  ESP_ERROR_CHECK(spi_bus_add_device(SENSOR_BUS_HOST, &deviceCfg, &channel->device));
+  channel->cs = cs;
+  channel->trans = (spi_transaction_t){
+      .flags = SPI_TRANS_USE_RXDATA,
+      .length = SENSOR_BUS_FRAME_LEN,
+      .rxlength = SENSOR_BUS_FRAME_LEN,
+      .user = channel,
+  };
+  ESP_LOGD(TAG, "Channel %d on GPIO %d", channelCount, cs);
+  return channelCount++;
+}
+
+int SensorBusChannelCount(void) { return channelCount; }
+
+// 12 bit reading in quarter degrees at bit 3, MSB first
+static void SensorBusDecode(SensorChannel *channel, SensorReading *reading) {
+  uint16_t frame = channel->trans.rx_data[0] << 8 | channel->trans.rx_data[1];
+  portENTER_CRITICAL(&statsLock);
+  channel->reads++;
+  channel->lastFrame = frame;
+  // An idle MISO reads all zeros, and 0 C is not a reading an oven gives, so an empty frame is no device either
+  if (frame == 0 || (frame & (SENSOR_FRAME_SIGN | SENSOR_FRAME_DEVICE_ID))) {
+    reading->faults = SENSOR_FAULT_MISSING;
+    channel->missing++;
+  } else if (frame & SENSOR_FRAME_OPEN) {
+    reading->faults = SENSOR_FAULT_OPEN;
+    channel->open++;
+  } else {
+    reading->c = (frame >> 3) * 0.25f;
+  }
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static void SensorBusBusError(int ch, SensorReading *reading) {
+  reading->faults = SENSOR_FAULT_BUS;
+  portENTER_CRITICAL(&statsLock);
+  channels[ch].busErrors++;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+// Sweeps the first count channels, returns the bus time their transactions took. Called with sweepLock held.
+static uint32_t SensorBusRun(int count, SensorReading *readings) {
+  SensorChannel *channel;
+  spi_transaction_t *done;
+  uint32_t busyUs = 0;
+  int ch;
+
+  PowerAcquire(POWER_LOCK_SENSOR);
+  for (ch = 0; ch < count; ch++) {
+    channel = &channels[ch];
+    readings[ch].c = 0;
+    readings[ch].faults = 0;
+    if (channel->inFlight) {
+      if (spi_device_get_trans_result(channel->device, &done, 0) != ESP_OK) {
+        SensorBusBusError(ch, &readings[ch]);
+        continue;
+      }
+      channel->inFlight = false;
+    }
+    if (spi_device_queue_trans(channel->device, &channel->trans, 0) != ESP_OK) SensorBusBusError(ch, &readings[ch]);
+  }
+
+  // Each device has its own result queue, collecting them in channel order only waits as long as the whole sweep
+  for (ch = 0; ch < count; ch++) {
+    channel = &channels[ch];
+    if (readings[ch].faults) continue;
+    if (spi_device_get_trans_result(channel->device, &done, pdMS_TO_TICKS(SENSOR_BUS_TIMEOUT_MS) + 1) != ESP_OK) {
+      channel->inFlight = true;
+      SensorBusBusError(ch, &readings[ch]);
+      continue;
+    }
+    busyUs += channel->busyUs;
+#ifdef SIMULATION
+    // The transaction still ran so the bus timing matches the hardware build, the frame is the plant model's
+    uint16_t frame = SimulationSensorFrame(ch);
+    memcpy(channel->trans.rx_data, &frame, sizeof(frame));
+#endif
+    SensorBusDecode(channel, &readings[ch]);
+  }
+  PowerRelease(POWER_LOCK_SENSOR);
+  return busyUs;
+}
+
+void SensorBusSweep(SensorReading *readings) {
+  xSemaphoreTake(sweepLock, portMAX_DELAY);
+  int64_t start = esp_timer_get_time();
+  uint32_t busyUs = SensorBusRun(channelCount, readings);
+  uint32_t sweepUs = esp_timer_get_time() - start;
+  xSemaphoreGive(sweepLock);
+
+  portENTER_CRITICAL(&statsLock);
+  stats.sweeps++;
+  stats.lastUs = sweepUs;
+  if (sweepUs > stats.maxUs) stats.maxUs = sweepUs;
+  stats.totalUs += sweepUs;
+  stats.busyUs += busyUs;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static struct {
+  struct arg_int *passes;
+  struct arg_end *end;
+} sensorbus_args;
+
+// Times passes sweeps over the first one, two, ... channels, shows what each added sensor costs
+static void SensorBusScale(int passes) {
+  SensorReading readings[SENSOR_BUS_MAX_CHANNELS];
+  uint64_t sweepUs, busyUs;
+  int64_t start;
+
+  printf("channels  sweep us  bus busy us  bus utilization\n");
+  for (int count = 1; count <= channelCount; count++) {
+    sweepUs = 0;
+    busyUs = 0;
+    for (int pass = 0; pass < passes; pass++) {
+      xSemaphoreTake(sweepLock, portMAX_DELAY);
+      start = esp_timer_get_time();
+      busyUs += SensorBusRun(count, readings);
+      sweepUs += esp_timer_get_time() - start;
+      xSemaphoreGive(sweepLock);
+    }
+    printf("%8d  %8llu  %11llu  %14.1f%%\n", count, sweepUs / passes, busyUs / passes, sweepUs ? 100.0 * busyUs / sweepUs : 0);
+  }
+}
+
+static int SensorBusConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&sensorbus_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, sensorbus_args.end, argv[0]);
+    return 1;
+  }
+
+  if (sensorbus_args.passes->count) {
+    int passes = sensorbus_args.passes->ival[0];
+    if (passes < 1 || passes > SENSOR_BUS_MAX_PASSES) {
+      printf("Passes must be 1 to %d\n", SENSOR_BUS_MAX_PASSES);
+      return 1;
+    }
+    SensorBusScale(passes);
+    return 0;
+  }
+
+  SensorChannel copy[SENSOR_BUS_MAX_CHANNELS];
+  portENTER_CRITICAL(&statsLock);
+  SensorSweepStats s = stats;
+  memcpy(copy, channels, sizeof(copy));
+  portEXIT_CRITICAL(&statsLock);
+
+  int64_t uptimeUs = esp_timer_get_time();
+  printf("%u sweeps of %d channels, last %u us, mean %llu us, max %u us\n", s.sweeps, channelCount, s.lastUs,
+         s.sweeps ? s.totalUs / s.sweeps : 0, s.maxUs);
+  printf("bus busy %.1f%% of sweep time, %.3f%% of uptime\n", s.totalUs ? 100.0 * s.busyUs / s.totalUs : 0,
+         uptimeUs ? 100.0 * s.busyUs / uptimeUs : 0);
+  for (int ch = 0; ch < channelCount; ch++) {
+    printf("%d GPIO %2d: %u reads, %u open, %u missing, %u bus errors, last frame 0x%04x\n", ch, copy[ch].cs, copy[ch].reads,
+           copy[ch].open, copy[ch].missing, copy[ch].busErrors, copy[ch].lastFrame);
+  }
+  return 0;
+}
+
+static void RegisterSensorBus(void) {
+  sensorbus_args.passes = arg_int0("s", "scale", "<passes>", "Time sweeps over 1 to all channels, passes each");
+  sensorbus_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "sensorbus",
+      .help = "Get sweep times, bus utilization and per channel faults of the thermocouple bus",
+      .hint = NULL,
+      .func = &SensorBusConsoleCmd,
+      .argtable = &sensorbus_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupSensorBus(void) {
+  spi_bus_config_t busCfg = {
+      .miso_io_num = SPI_MISO,
+      .mosi_io_num = -1,
+      .sclk_io_num = SPI_CLK,
+      .quadwp_io_num = -1,
+      .quadhd_io_num = -1,
+      .max_transfer_sz = SENSOR_BUS_FRAME_LEN / 8,
+  };
+  ESP_ERROR_CHECK(spi_bus_initialize(SENSOR_BUS_HOST, &busCfg, SPI_DMA_CH_AUTO));
+  sweepLock = BudgetCreateMutex(TAG, "sweepLock", &sweepLockBuffer);
+  RegisterSensorBus();
+}
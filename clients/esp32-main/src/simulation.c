@@ -0,0 +1,286 @@
+#include "simulation.h"
+
+#ifdef SIMULATION
+
+#include <driver/spi_master.h>
+#include <driver/uart.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "buffer_pool.h"
+#include "config.h"
+#include "console.h"
+#include "cooking_controller.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "memory_budget.h"
+#include "qr_scanner.h"
+#include "task_config.h"
+
+#define TAG "SIMULATION"
+#define SIM_QR_REPLAY_GAP_MS 100  // Between replayed scans, each one reads as its own frame
+#define SIM_DEFAULT_SETPOINT_C 180
+#define MAX6675_MAX_C 1023.75f
+#define MAX6675_OPEN BIT2
+
+STATIC_TASK(Simulation, SIMULATION_STACK);
+static SimulationModel model = {
+    .ambientC = SIM_DEFAULT_AMBIENT_C,
+    .heatCapacity = SIM_DEFAULT_HEAT_CAPACITY,
+    .elementWatts = SIM_DEFAULT_ELEMENT_WATTS,
+    .lossWattsPerC = SIM_DEFAULT_LOSS_W_PER_C,
+    .fanLossFactor = SIM_DEFAULT_FAN_LOSS_FACTOR,
+};
+static SimulationStats stats = {.timeScale = SIM_DEFAULT_TIME_SCALE};
+static double offsetSeconds;  // How far the simulated clock has run ahead of the real one
+static uint32_t relays;       // Output levels by RelayDevices index, the same bits as RelayControllerFlags
+static bool openThermocouple;
+static portMUX_TYPE simLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Called with simLock held
+static void SimulationStep(int zone, float dt, float setpointC, bool cooking) {
+  const ZoneConfig *config = &Zones[zone];
+  float *temperatureC = &stats.temperatureC[zone];
+  int elements = ((relays & config->topElement) != 0) + ((relays & config->bottomElement) != 0);
+  float loss = model.lossWattsPerC * ((relays & config->fan) ? model.fanLossFactor : 1.0f);
+  *temperatureC += dt * (elements * model.elementWatts - loss * (*temperatureC - model.ambientC)) / model.heatCapacity;
+  stats.heatingSeconds += elements * dt;
+  if (!cooking) return;
+
+  float error = *temperatureC - setpointC;
+  stats.cookingSeconds += dt;
+  if (fabsf(error) < SIM_BAND_C) stats.inBandSeconds += dt;
+  if (error > stats.maxOvershootC) stats.maxOvershootC = error;
+}
+
+static void SimulationTask(void *args) {
+  TickType_t wake = xTaskGetTickCount();
+  int64_t last = esp_timer_get_time();
+  int64_t now;
+  CookingState cooking[ZONE_COUNT];
+  float real, setpointC;
+  int zone;
+
+  while (true) {
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(SIM_STEP_MS));
+    // Steps by the measured time rather than the nominal period so a late wake up doesn't slow the oven down
+    now = esp_timer_get_time();
+    real = (now - last) / 1000000.0f;
+    last = now;
+    for (zone = 0; zone < ZONE_COUNT; zone++) CookingControllerGetState(zone, &cooking[zone]);
+
+    portENTER_CRITICAL(&simLock);
+    float dt = real * stats.timeScale;
+    offsetSeconds += dt - real;
+    stats.simulatedSeconds += dt;
+    for (zone = 0; zone < ZONE_COUNT; zone++) {
+      setpointC = cooking[zone].temperatureUnit == 'F' ? (cooking[zone].setpoint - 32) / 1.8f : cooking[zone].setpoint;
+      SimulationStep(zone, dt, setpointC, cooking[zone].temperatureUnit != 0);
+    }
+    portEXIT_CRITICAL(&simLock);
+  }
+}
+
+uint16_t SimulationSensorFrame(int zone) {
+  portENTER_CRITICAL(&simLock);
+  float temperature = stats.temperatureC[zone];
+  bool open = openThermocouple;
+  portEXIT_CRITICAL(&simLock);
+
+  // 12 bit reading in quarter degrees at bit 3, bit 2 set when the thermocouple is open
+  uint16_t raw = MAX6675_OPEN;
+  if (!open) {
+    if (temperature < 0) temperature = 0;
+    if (temperature > MAX6675_MAX_C) temperature = MAX6675_MAX_C;
+    raw = (uint16_t)(temperature * 4) << 3;
+  }
+  return SPI_SWAP_DATA_TX(raw, 16);
+}
+
+void SimulationSetRelay(int index, int level) {
+  portENTER_CRITICAL(&simLock);
+  uint32_t previous = relays;
+  if (level) {
+    relays |= BIT(index);
+  } else {
+    relays &= ~BIT(index);
+  }
+  if (relays != previous) stats.relayEdges++;
+  portEXIT_CRITICAL(&simLock);
+}
+
+void SimulationGetStats(SimulationStats *out) {
+  portENTER_CRITICAL(&simLock);
+  *out = stats;
+  portEXIT_CRITICAL(&simLock);
+}
+
+time_t SimulationNow(void) {
+  portENTER_CRITICAL(&simLock);
+  double offset = offsetSeconds;
+  portEXIT_CRITICAL(&simLock);
+  return time(NULL) + (time_t)offset;
+}
+
+// Whether a period is a whole number of ticks at scale
+static bool SimulationScaleExact(uint32_t scale) {
+  return scale >= 1 && scale <= SIM_MAX_TIME_SCALE && ((uint64_t)SIM_PERIOD_MS * configTICK_RATE_HZ) % (1000ULL * scale) == 0;
+}
+
+TickType_t SimulationTicks(uint32_t ms) {
+  // Scaled in ticks rather than ms, pdMS_TO_TICKS(ms / scale) would truncate twice
+  return ((uint64_t)ms * configTICK_RATE_HZ) / (1000ULL * __atomic_load_n(&stats.timeScale, __ATOMIC_RELAXED));
+}
+
+// Sent out of the scanner UART's TX, which loopback feeds straight back into its RX
+static void SimulationReplayScan(const char *code) {
+  const char terminator = QR_TERMINATOR;
+  uart_write_bytes(UART_PORT, code, strlen(code));
+  uart_write_bytes(UART_PORT, &terminator, 1);
+  uart_wait_tx_done(UART_PORT, portMAX_DELAY);
+  portENTER_CRITICAL(&simLock);
+  stats.qrScansReplayed++;
+  portEXIT_CRITICAL(&simLock);
+}
+
+// Queues a bake straight to the cooking controller, as if it came from the server
+static bool SimulationCook(int zone, int minutes, int setpointC) {
+  Recipe *recipe = BufferAlloc(&RecipePool, 0);
+  if (recipe == NULL) return false;
+  memset(recipe, 0, sizeof(*recipe));
+  strlcpy(recipe->applianceMode, "Bake", sizeof(recipe->applianceMode));
+  strlcpy(recipe->applianceType, APPLIANCE_TYPE, sizeof(recipe->applianceType));
+  strlcpy(recipe->temperatureUnit, "C", sizeof(recipe->temperatureUnit));
+  strlcpy(recipe->id, "simulation", sizeof(recipe->id));
+  recipe->temperature = setpointC;
+  recipe->cookingTime = minutes * 60 * 1000.0;
+  recipe->zone = zone;
+  if (!CookingControllerSubmit(recipe, 0)) {
+    BufferRelease(recipe);
+    return false;
+  }
+  return true;
+}
+
+static struct {
+  struct arg_int *scale;
+  struct arg_dbl *ambient;
+  struct arg_dbl *temperature;
+  struct arg_dbl *watts;
+  struct arg_dbl *loss;
+  struct arg_dbl *capacity;
+  struct arg_int *open;
+  struct arg_str *qr;
+  struct arg_int *cook;
+  struct arg_int *setpoint;
+  struct arg_int *zone;
+  struct arg_lit *reset;
+  struct arg_end *end;
+} sim_args;
+
+static int SimulationConsoleCmd(int argc, char **argv) {
+  int nerrors = arg_parse(argc, argv, (void **)&sim_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, sim_args.end, argv[0]);
+    return 1;
+  }
+  if (sim_args.scale->count && !SimulationScaleExact(sim_args.scale->ival[0])) {
+    printf("Time scale must be 1 to %d and divide the %d ms period into whole %d ms ticks\n", SIM_MAX_TIME_SCALE, SIM_PERIOD_MS,
+           portTICK_PERIOD_MS);
+    return 1;
+  }
+  int zone = sim_args.zone->count ? sim_args.zone->ival[0] : 0;
+  if (zone < 0 || zone >= ZONE_COUNT) {
+    printf("Zone must be 0 to %d\n", ZONE_COUNT - 1);
+    return 1;
+  }
+
+  portENTER_CRITICAL(&simLock);
+  if (sim_args.scale->count) stats.timeScale = sim_args.scale->ival[0];
+  if (sim_args.ambient->count) model.ambientC = sim_args.ambient->dval[0];
+  if (sim_args.temperature->count) stats.temperatureC[zone] = sim_args.temperature->dval[0];
+  if (sim_args.watts->count) model.elementWatts = sim_args.watts->dval[0];
+  if (sim_args.loss->count) model.lossWattsPerC = sim_args.loss->dval[0];
+  if (sim_args.capacity->count && sim_args.capacity->dval[0] > 0) model.heatCapacity = sim_args.capacity->dval[0];
+  if (sim_args.open->count) openThermocouple = sim_args.open->ival[0] != 0;
+  if (sim_args.reset->count) {
+    stats.cookingSeconds = stats.inBandSeconds = stats.heatingSeconds = 0;
+    stats.maxOvershootC = 0;
+    stats.relayEdges = stats.qrScansReplayed = 0;
+  }
+  portEXIT_CRITICAL(&simLock);
+
+  for (int i = 0; i < sim_args.qr->count; i++) {
+    if (i > 0) vTaskDelay(pdMS_TO_TICKS(SIM_QR_REPLAY_GAP_MS));
+    SimulationReplayScan(sim_args.qr->sval[i]);
+  }
+  if (sim_args.cook->count) {
+    int setpoint = sim_args.setpoint->count ? sim_args.setpoint->ival[0] : SIM_DEFAULT_SETPOINT_C;
+    if (!SimulationCook(zone, sim_args.cook->ival[0], setpoint)) {
+      printf("No recipe buffer free or zone %d already has a recipe waiting\n", zone);
+      return 1;
+    }
+    printf("Cooking %d min at %d C, about %d s of real time\n", sim_args.cook->ival[0], setpoint,
+           sim_args.cook->ival[0] * 60 / (int)stats.timeScale);
+  }
+
+  SimulationStats s;
+  SimulationModel m;
+  portENTER_CRITICAL(&simLock);
+  s = stats;
+  m = model;
+  portEXIT_CRITICAL(&simLock);
+  printf("time scale: %ux, simulated: %.0f s%s\n", s.timeScale, s.simulatedSeconds, openThermocouple ? ", thermocouples open" : "");
+  for (zone = 0; zone < ZONE_COUNT; zone++) printf("zone %d cavity: %.2f C\n", zone, s.temperatureC[zone]);
+  printf("model: ambient %.1f C, elements %.0f W, loss %.2f W/C (x%.2f with fan), capacity %.0f J/C\n", m.ambientC, m.elementWatts,
+         m.lossWattsPerC, m.fanLossFactor, m.heatCapacity);
+  if (s.cookingSeconds > 0) {
+    printf("cooking: %.0f s, in band: %.1f %%, max overshoot: %.2f C, element on: %.0f s, relay edges: %u\n", s.cookingSeconds,
+           100 * s.inBandSeconds / s.cookingSeconds, s.maxOvershootC, s.heatingSeconds, s.relayEdges);
+  }
+  printf("qr scans replayed: %u\n", s.qrScansReplayed);
+  return 0;
+}
+
+static void RegisterSimulation(void) {
+  sim_args.scale = arg_int0("s", "scale", "<n>", "Simulated seconds per real second");
+  sim_args.ambient = arg_dbl0("a", "ambient", "<C>", "Room temperature");
+  sim_args.temperature = arg_dbl0("t", "temperature", "<C>", "Set the zone's cavity temperature now");
+  sim_args.watts = arg_dbl0("w", "watts", "<W>", "Power of each heating element");
+  sim_args.loss = arg_dbl0("k", "loss", "<W/C>", "Heat lost through the walls per degree above ambient");
+  sim_args.capacity = arg_dbl0("c", "capacity", "<J/C>", "Heat capacity of the cavity");
+  sim_args.open = arg_int0("o", "open", "<0|1>", "Report an open thermocouple");
+  sim_args.qr = arg_strn("q", "qr", "<code>", 0, 4, "Replay a scan through the QR scanner UART");
+  sim_args.cook = arg_int0("m", "cook", "<min>", "Start a bake of this many simulated minutes");
+  sim_args.setpoint = arg_int0("p", "setpoint", "<C>", "Bake temperature, default 180");
+  sim_args.zone = arg_int0("z", "zone", "<n>", "Zone -t and -m apply to, default 0");
+  sim_args.reset = arg_lit0("r", "reset", "Reset the cooking statistics");
+  sim_args.end = arg_end(12);
+  const esp_console_cmd_t cmd = {
+      .command = "sim",
+      .help = "Drive the simulated oven and report how the controller tracked it",
+      .hint = NULL,
+      .func = &SimulationConsoleCmd,
+      .argtable = &sim_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
+void SetupSimulation(void) {
+  if (!SimulationScaleExact(stats.timeScale)) {
+    ESP_LOGE(TAG, "SIM_DEFAULT_TIME_SCALE %u doesn't divide the period into whole ticks, running at 1x", stats.timeScale);
+    stats.timeScale = 1;
+  }
+  for (int zone = 0; zone < ZONE_COUNT; zone++) stats.temperatureC[zone] = SIM_DEFAULT_AMBIENT_C;
+  ESP_ERROR_CHECK(uart_set_loop_back(UART_PORT, true));
+  BudgetCreateTask(TAG, SimulationTask, "SimulationTask", SIMULATION_STACK, NULL, SIMULATION_PRIORITY, SIMULATION_CORE, SimulationStack,
+                   &SimulationTCB);
+  RegisterSimulation();
+  ESP_LOGW(TAG, "Simulation build, the sensor and relays drive a modelled oven at %ux real time", stats.timeScale);
+}
+
+#endif
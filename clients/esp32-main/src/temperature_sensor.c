@@ -1,98 +1,87 @@
 #include "temperature_sensor.h"
 
-#include <driver/spi_master.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <math.h>
 
+#include "binlog.h"
+#include "boot.h"
 #include "config.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "lcd.h"
+#include "memory_budget.h"
+#include "sensor_bus.h"
+#include "simulation.h"
+#include "task_config.h"
+#include "trace.h"
+#include "zone.h"
 
 #define TAG "TEMPERATURE_SENSOR"
 
 QueueHandle_t TempSensorQueue;
 TaskHandle_t TempSensor;
-spi_device_handle_t temp_spi_handle;
+STATIC_QUEUE(TempSensorQueue, ZONE_COUNT, Temperature);
+STATIC_TASK(TempSensor, TEMP_SENSOR_STACK);
+static Temperature latest[ZONE_COUNT];
+static portMUX_TYPE latestLock = portMUX_INITIALIZER_UNLOCKED;
 
-float TempSensorRead() {
-  uint16_t data = 0;
-  spi_transaction_t trans = {
-      .tx_buffer = NULL,
-      .rx_buffer = &data,
-      .length = TEMP_SENSOR_DATA_LEN,
-      .rxlength = TEMP_SENSOR_DATA_LEN,
-  };
-
-  spi_device_acquire_bus(temp_spi_handle, portMAX_DELAY);
-  spi_device_transmit(temp_spi_handle, &trans);
-  spi_device_release_bus(temp_spi_handle);
-
-  int16_t res = (int16_t)SPI_SWAP_DATA_RX(data, TEMP_SENSOR_DATA_LEN);
-
-  if (res & (1 << 2)) {
-    ESP_LOGE(TAG, "Sensor is not connected\n");
-    return 1000;
-  } else {
-    res >>= 3;
-    return res * 0.25;
-  }
+// Last reading for readers that must not consume TempSensorQueue
+void TempSensorGetLatest(int zone, Temperature *temp) {
+  portENTER_CRITICAL(&latestLock);
+  *temp = latest[zone];
+  portEXIT_CRITICAL(&latestLock);
 }
 
 void TempSensorTask(void *pvParams) {
+  SensorReading readings[ZONE_COUNT];
+  uint32_t seqs[ZONE_COUNT];
   Temperature temp;
   EventBits_t bits;
-  LCDMessage msg = {
-      .row = 1,
-      .col = 0,
-      .text = "Temp: ",
-  };
-  xQueueSend(LCDQueue, &msg, portMAX_DELAY);
-  msg.col = 6;
+  int zone;
   while (true) {
-    temp.c = TempSensorRead();
-    temp.f = roundf(temp.c * 1.8 + 32.0);
-    ESP_LOGI(TAG, "C: %d, F: %d", temp.c, temp.f);
-    sprintf(msg.text, "%03d C | %03d F", temp.c, temp.f);
-    xQueueSend(LCDQueue, &msg, pdMS_TO_TICKS(10));
-    xQueueOverwrite(TempSensorQueue, &temp);
+    for (zone = 0; zone < ZONE_COUNT; zone++) seqs[zone] = TraceNextSeq();
+    SensorBusSweep(readings);  // Zone n is sensor bus channel n
+    for (zone = 0; zone < ZONE_COUNT; zone++) {
+      Trace(TRACE_SENSOR_READ, seqs[zone]);
+      temp.seq = seqs[zone];
+      temp.zone = zone;
+      temp.faults = readings[zone].faults;
+      temp.c = readings[zone].c;
+      temp.f = temp.faults ? 0 : roundf(readings[zone].c * 1.8 + 32.0);
+      if (temp.faults) {
+        BINLOGE(TAG, "Zone %d sensor fault 0x%x", zone, temp.faults);
+        if (zone == 0) LCDSetField(LCD_FIELD_TEMPERATURE, "%s", temp.faults & SENSOR_FAULT_OPEN ? "Open probe" : "Sensor fault");
+      } else {
+        BINLOGI(TAG, "Zone %d C: %d, F: %d", zone, temp.c, temp.f);
+        if (zone == 0) LCDSetField(LCD_FIELD_TEMPERATURE, "%03d C | %03d F", temp.c, temp.f);
+      }
+      portENTER_CRITICAL(&latestLock);
+      latest[zone] = temp;
+      portEXIT_CRITICAL(&latestLock);
+      xQueueSend(TempSensorQueue, &temp, 0);  // Telemetry only, a reading it hasn't room for is dropped
+    }
+    BootMark(BOOT_FIRST_TEMPERATURE);
     bits = xEventGroupWaitBits(DeviceStatus, IS_COOKING, pdFALSE, pdFALSE, pdMS_TO_TICKS(30000));
     if (bits & IS_COOKING) {
-      vTaskDelay(pdMS_TO_TICKS(1000));
+      vTaskDelay(SIM_TICKS(1000));
     }
   }
 }
 
 void SetupTempSensor(void) {
   ESP_LOGD(TAG, "Setting up temperature sensor");
-  spi_bus_config_t busCfg = {
-      .miso_io_num = SPI_MISO,
-      .mosi_io_num = -1,
-      .sclk_io_num = SPI_CLK,
-      .quadwp_io_num = -1,
-      .quadhd_io_num = -1,
-      .max_transfer_sz = TEMP_SENSOR_DATA_LEN,
-  };
-
-  ESP_ERROR_CHECK(spi_bus_initialize(VSPI_HOST, &busCfg, SPI_DMA_CH_AUTO));
-
-  spi_device_interface_config_t temp_sensor_cfg = {
-      .mode = 0,
-      .clock_speed_hz = 2 * 1000 * 1000,
-      .spics_io_num = TEMP_SENSOR_CS,
-      .queue_size = 1,
-      .cs_ena_posttrans = 3,
-      .cs_ena_pretrans = 3,
-  };
-  ESP_ERROR_CHECK(spi_bus_add_device(VSPI_HOST, &temp_sensor_cfg, &temp_spi_handle));
+  SetupSensorBus();
+  for (int zone = 0; zone < ZONE_COUNT; zone++) SensorBusAddChannel(Zones[zone].sensorCs);
 
-  TempSensorQueue = xQueueCreate(1, sizeof(Temperature));
+  TempSensorQueue =
+      BudgetCreateQueue(TAG, "TempSensorQueue", ZONE_COUNT, sizeof(Temperature), TempSensorQueueStorage, &TempSensorQueueBuffer);
   if (TempSensorQueue == NULL) {
     ESP_LOGE(TAG, "Failed to create temperature sensor queue");
   }
 
-  BaseType_t task = xTaskCreate(TempSensorTask, "TemperatureTask", 2048, NULL, 4, &TempSensor);
-  if (task == pdFALSE) ESP_LOGE(TAG, "Failed to create temperature sensor task");
+  TempSensor = BudgetCreateTask(TAG, TempSensorTask, "TemperatureTask", TEMP_SENSOR_STACK, NULL, TEMP_SENSOR_PRIORITY, TEMP_SENSOR_CORE,
+                                TempSensorStack, &TempSensorTCB);
+  if (TempSensor == NULL) ESP_LOGE(TAG, "Failed to create temperature sensor task");
   ESP_LOGD(TAG, "Temperature sensor setup complete");
 }
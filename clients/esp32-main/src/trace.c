@@ -0,0 +1,215 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "argtable3/argtable3.h"
+#include "console.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define TAG "TRACE"
+
+typedef struct TraceEvent {
+  uint32_t stamp;  // slot index + 1, written last so readers can tell a finished event from a torn one
+  uint32_t timeUs;
+  uint32_t seq;
+  uint8_t point;
+  uint8_t core;
+} TraceEvent;
+
+// One ring per core so the only writers racing for a slot are tasks and ISRs on the same core
+typedef struct TraceRing {
+  uint32_t head;
+  TraceEvent events[TRACE_BUFFER_LENGTH];
+} TraceRing;
+
+static TraceRing rings[portNUM_PROCESSORS];
+static uint32_t nextSeq;
+
+static const char *pointNames[TRACE_POINT_COUNT] = {
+    [TRACE_SENSOR_READ] = "sensor_read",
+    [TRACE_CONTROL_DECISION] = "control_decision",
+    [TRACE_RELAY_EDGE] = "relay_edge",
+    [TRACE_TEMPERATURE_ENQUEUE] = "temperature_enqueue",
+    [TRACE_WEBSOCKET_SEND] = "websocket_send",
+};
+
+uint32_t TraceNextSeq(void) {
+  uint32_t seq;
+  do {
+    seq = __atomic_add_fetch(&nextSeq, 1, __ATOMIC_RELAXED);
+  } while (seq == 0);
+  return seq;
+}
+
+void Trace(TracePoint point, uint32_t seq) {
+  if (seq == 0 || point >= TRACE_POINT_COUNT) return;
+  uint32_t timeUs = esp_timer_get_time();
+  int core = xPortGetCoreID();
+  TraceRing *ring = &rings[core];
+  uint32_t index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  TraceEvent *event = &ring->events[index & (TRACE_BUFFER_LENGTH - 1)];
+
+  __atomic_store_n(&event->stamp, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->timeUs = timeUs;
+  event->seq = seq;
+  event->point = point;
+  event->core = core;
+  __atomic_store_n(&event->stamp, index + 1, __ATOMIC_RELEASE);
+}
+
+// Copies the finished events out of both rings, oldest first per core. Returns the count.
+static int TraceCollect(TraceEvent *out) {
+  int count = 0;
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    TraceRing *ring = &rings[core];
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t first = head > TRACE_BUFFER_LENGTH ? head - TRACE_BUFFER_LENGTH : 0;
+    for (uint32_t index = first; index < head; index++) {
+      TraceEvent *event = &ring->events[index & (TRACE_BUFFER_LENGTH - 1)];
+      if (__atomic_load_n(&event->stamp, __ATOMIC_ACQUIRE) != index + 1) continue;
+      out[count] = *event;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&event->stamp, __ATOMIC_RELAXED) != index + 1) continue;  // overwritten while copying
+      count++;
+    }
+  }
+  return count;
+}
+
+static const TraceEvent *FindSensorRead(const TraceEvent *events, int count, uint32_t seq) {
+  for (int i = 0; i < count; i++) {
+    if (events[i].point == TRACE_SENSOR_READ && events[i].seq == seq) return &events[i];
+  }
+  return NULL;
+}
+
+// Each point fires from a single pinned task, so its events are in order within the collected array.
+// Only the first event of each point per seq counts, the controller sees the same sample until the next one lands
+static bool FirstOfSeq(const TraceEvent *events, int index) {
+  for (int i = 0; i < index; i++) {
+    if (events[i].point == events[index].point && events[i].seq == events[index].seq) return false;
+  }
+  return true;
+}
+
+typedef struct TraceHistogram {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t buckets[TRACE_HISTOGRAM_BUCKETS];
+} TraceHistogram;
+
+static void PrintHistograms(const TraceEvent *events, int count) {
+  static TraceHistogram histograms[TRACE_POINT_COUNT];
+  int i, bucket;
+  memset(histograms, 0, sizeof(histograms));
+
+  for (i = 0; i < count; i++) {
+    if (events[i].point == TRACE_SENSOR_READ || !FirstOfSeq(events, i)) continue;
+    const TraceEvent *start = FindSensorRead(events, count, events[i].seq);
+    if (start == NULL) continue;  // the sensor read already fell out of its ring
+    uint32_t latency = events[i].timeUs - start->timeUs;
+
+    TraceHistogram *h = &histograms[events[i].point];
+    if (h->count == 0 || latency < h->min) h->min = latency;
+    if (latency > h->max) h->max = latency;
+    h->total += latency;
+    h->count++;
+    for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS - 1 && latency >= (2u << bucket); bucket++) {
+    }
+    h->buckets[bucket]++;
+  }
+
+  for (i = TRACE_SENSOR_READ + 1; i < TRACE_POINT_COUNT; i++) {
+    TraceHistogram *h = &histograms[i];
+    printf("sensor_read -> %s: ", pointNames[i]);
+    if (h->count == 0) {
+      printf("no samples\n");
+      continue;
+    }
+    printf("%u samples, min %u us, avg %u us, max %u us\n", h->count, h->min, (uint32_t)(h->total / h->count), h->max);
+    for (bucket = 0; bucket < TRACE_HISTOGRAM_BUCKETS; bucket++) {
+      if (h->buckets[bucket] == 0) continue;
+      printf("  < %8u us %5u ", 2u << bucket, h->buckets[bucket]);
+      for (int bar = 0; bar < h->buckets[bucket] * 40 / h->count; bar++) putchar('#');
+      putchar('\n');
+    }
+  }
+}
+
+// chrome://tracing and Perfetto both load this, one instant per trace point and a span per sample
+static void PrintChromeTrace(const TraceEvent *events, int count) {
+  int i, j;
+  bool first = true;
+  printf("{\"traceEvents\":[\n");
+  for (i = 0; i < count; i++) {
+    printf("%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%u,\"pid\":0,\"tid\":%u,\"args\":{\"seq\":%u}}", first ? "" : ",\n",
+           pointNames[events[i].point], events[i].timeUs, events[i].core, events[i].seq);
+    first = false;
+  }
+  for (i = 0; i < count; i++) {
+    if (events[i].point != TRACE_SENSOR_READ) continue;
+    uint32_t duration = 0;
+    for (j = 0; j < count; j++) {
+      if (events[j].seq != events[i].seq || j == i) continue;
+      uint32_t elapsed = events[j].timeUs - events[i].timeUs;
+      if ((int32_t)elapsed > 0 && elapsed > duration) duration = elapsed;
+    }
+    printf(",\n{\"name\":\"sample\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,\"pid\":0,\"tid\":%d,\"args\":{\"seq\":%u}}", events[i].timeUs,
+           duration, portNUM_PROCESSORS, events[i].seq);
+  }
+  printf("\n]}\n");
+}
+
+static struct {
+  struct arg_lit *chrome;
+  struct arg_lit *reset;
+  struct arg_end *end;
+} trace_args;
+
+static int TraceConsoleCmd(int argc, char **argv) {
+  static TraceEvent events[TRACE_BUFFER_LENGTH * portNUM_PROCESSORS];
+  int nerrors = arg_parse(argc, argv, (void **)&trace_args);
+  if (nerrors != 0) {
+    arg_print_errors(stderr, trace_args.end, argv[0]);
+    return 1;
+  }
+
+  if (trace_args.reset->count) {
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+      for (int i = 0; i < TRACE_BUFFER_LENGTH; i++) __atomic_store_n(&rings[core].events[i].stamp, 0, __ATOMIC_RELAXED);
+    }
+    printf("Trace buffers cleared\n");
+    return 0;
+  }
+
+  int count = TraceCollect(events);
+  if (trace_args.chrome->count) {
+    PrintChromeTrace(events, count);
+  } else {
+    printf("%d events buffered\n", count);
+    PrintHistograms(events, count);
+  }
+  return 0;
+}
+
+void RegisterTrace(void) {
+  trace_args.chrome = arg_lit0("c", "chrome", "Dump the buffered events as Chrome trace JSON");
+  trace_args.reset = arg_lit0("r", "reset", "Drop the buffered events");
+  trace_args.end = arg_end(1);
+  const esp_console_cmd_t cmd = {
+      .command = "trace",
+      .help = "Get latency histograms from a sensor read to the control decision, relay edge and websocket send",
+      .hint = NULL,
+      .func = &TraceConsoleCmd,
+      .argtable = &trace_args,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
@@ -5,7 +5,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "binlog.h"
 #include "bluetooth.h"
+#include "boot.h"
 #include "cJSON.h"
 #include "config.h"
 #include "cooking_controller.h"
@@ -25,9 +27,14 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 #include "helpers.h"
+#include "json_arena.h"
+#include "memory_budget.h"
 #include "nvs_flash.h"
+#include "power.h"
 #include "qr_scanner.h"
+#include "task_config.h"
 #include "temperature_sensor.h"
+#include "trace.h"
 
 #define TAG "WEBSOCKET"
 #define WEBSOCKET_TIMEOUT 10
@@ -36,7 +43,20 @@ TimerHandle_t SHUTDOWN_TIMER;
 TimerHandle_t START_TIMER;
 QueueHandle_t WebsocketQueue;
 TaskHandle_t Websocket;
+static char uri[128];
 TaskHandle_t DefinedInDB;
+BufferPool WebsocketPool;
+BufferPool JSONStringPool;
+STATIC_QUEUE(WebsocketQueue, 1, WebSocketMessage *);
+STATIC_BUFFER_POOL(WebsocketPool, WEBSOCKET_POOL_SIZE, WebSocketMessage);
+STATIC_BUFFER_POOL(JSONStringPool, JSON_STRING_POOL_SIZE, JSONString);
+STATIC_TASK(Websocket, WEBSOCKET_STACK);
+STATIC_TASK(DefinedInDB, DEFINED_IN_DB_STACK);
+static StaticTimer_t ShutdownTimerBuffer;
+static StaticTimer_t StartTimerBuffer;
+STATIC_JSON_ARENA(WebsocketEventArena, 2048);
+STATIC_JSON_ARENA(WebsocketSendArena, 4096);  // Parses every outgoing document back in, diagnostics are the largest
+STATIC_JSON_ARENA(DefinedInDBArena, 512);
 
 static void shutdown_signaler(TimerHandle_t xTimer) {
   EventBits_t bits = xEventGroupGetBits(DeviceStatus);
@@ -51,6 +71,19 @@ static void shutdown_signaler(TimerHandle_t xTimer) {
   xTimerStop(SHUTDOWN_TIMER, 0);
 }
 
+WebSocketMessage *WebsocketMessageAlloc(const char *method, const char *path, TickType_t wait) {
+  WebSocketMessage *msg = BufferAlloc(&WebsocketPool, wait);
+  if (msg == NULL) return NULL;
+  strlcpy(msg->method, method, sizeof(msg->method));
+  strlcpy(msg->path, path, sizeof(msg->path));
+  msg->methodName = method;
+  msg->pathName = path;
+  msg->dataString.string[0] = '\0';
+  msg->dataString.length = 0;
+  msg->seq = 0;
+  return msg;
+}
+
 static void start_signaler(TimerHandle_t xTimer) {
   EventBits_t bits = xEventGroupGetBits(DeviceStatus);
   if (bits & WEBSOCKET_CONNECTED) {
@@ -90,6 +123,7 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
 
       ESP_LOGD(TAG, "WEBSOCKET_EVENT_DATA");
 
+      JsonArenaBegin(&WebsocketEventArena);
       cJSON *json = cJSON_ParseWithLength(data->data_ptr, data->data_len);
       if (json == NULL) {
         const char *error_ptr = cJSON_GetErrorPtr();
@@ -97,6 +131,7 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
           ESP_LOGE(TAG, "Error before: %s", error_ptr);
         }
         cJSON_Delete(json);
+        JsonArenaEnd(&WebsocketEventArena);
         break;
       }
 
@@ -106,6 +141,7 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
         ESP_LOGE(TAG, "Error: %s", errorJson);
         cJSON_free(errorJson);
         cJSON_Delete(json);
+        JsonArenaEnd(&WebsocketEventArena);
         break;
       }
 
@@ -116,17 +152,25 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
 
       if (strcmp(requestId, "appliance.esp32Register") == 0) {  // Defined in DB
         xEventGroupSetBits(DeviceStatus, WEBSOCKET_READY);
+        BootMark(BOOT_WEBSOCKET_READY);
         ESP_LOGI(TAG, "Device is defined in DB");
       }
 
       if (strcmp(requestId, "appliance.setRecipe") == 0) {
-        JSONString json;
-        json.length = data->data_len;
-        strncpy(json.string, data->data_ptr, data->data_len);
-        xQueueOverwrite(DecodeRecipeQueue, &json);
+        JSONString *recipe = BufferAlloc(&JSONStringPool, 0);
+        if (recipe == NULL || data->data_len >= sizeof(recipe->string)) {
+          ESP_LOGE(TAG, "Dropping recipe of %d bytes", data->data_len);
+          BufferRelease(recipe);
+        } else {
+          memcpy(recipe->string, data->data_ptr, data->data_len);
+          recipe->string[data->data_len] = '\0';
+          recipe->length = data->data_len;
+          DBManagerDecodeRecipe(recipe);
+        }
       }
 
       cJSON_Delete(json);
+      JsonArenaEnd(&WebsocketEventArena);
       xTimerReset(SHUTDOWN_TIMER, portMAX_DELAY);
       break;
     case WEBSOCKET_EVENT_ERROR:
@@ -140,25 +184,7 @@ static void DefinedInDBTask(void *pvParameters) {
   char path[] = "appliance.esp32Register";
   char method[] = "mutation";
   sprintf(callId, "%s::%s", ID, path);
-
-  cJSON *output = cJSON_CreateObject();
-  cJSON *params = cJSON_CreateObject();
-  cJSON *input = cJSON_CreateObject();
-  cJSON *appliance = cJSON_CreateObject();
-
-  cJSON_AddStringToObject(output, "id", callId);
-  cJSON_AddStringToObject(output, "method", method);
-  cJSON_AddItemToObject(output, "params", params);
-
-  cJSON_AddItemToObject(params, "input", input);
-  cJSON_AddStringToObject(params, "path", path);
-
-  cJSON_AddItemToObject(input, "json", appliance);
-
-  cJSON_AddStringToObject(appliance, "id", ID);
-  cJSON_AddStringToObject(appliance, "name", "unknown");
-  cJSON_AddStringToObject(appliance, "BLEId", "unknown");
-
+  static char frame[WEBSOCKET_FRAME_LENGTH];
   char BLEId[64] = "";
   char name[32] = "";
 
@@ -171,92 +197,116 @@ static void DefinedInDBTask(void *pvParameters) {
       continue;
     }
 
+    PowerAcquire(POWER_LOCK_NETWORK);
     FlashGet(NVS_TYPE_STR, BLE_DEVICE_ID_KEY, BLEId, 64);
     FlashGet(NVS_TYPE_STR, BLE_DEVICE_NAME_KEY, name, 32);
-    cJSON_ReplaceItemInObjectCaseSensitive(appliance, "BLEId", cJSON_CreateString(BLEId));
-    cJSON_ReplaceItemInObjectCaseSensitive(appliance, "name", cJSON_CreateString(name));
-
-    char *json_str = cJSON_Print(output);
-    int len = strlen(json_str);
-    int sent = esp_websocket_client_send_text(CLIENT, json_str, len, portMAX_DELAY);
-    ESP_LOGI(TAG, "%s --> %s = %d bytes", method, path, sent);
-    cJSON_free(json_str);
+
+    JsonArenaBegin(&DefinedInDBArena);
+    cJSON *output = cJSON_CreateObject();
+    cJSON *params = cJSON_AddObjectToObject(output, "params");
+    cJSON *input = cJSON_AddObjectToObject(params, "input");
+    cJSON *appliance = cJSON_AddObjectToObject(input, "json");
+    cJSON_AddStringToObject(output, "id", callId);
+    cJSON_AddStringToObject(output, "method", method);
+    cJSON_AddStringToObject(params, "path", path);
+    cJSON_AddStringToObject(appliance, "id", ID);
+    cJSON_AddStringToObject(appliance, "name", name);
+    cJSON_AddStringToObject(appliance, "BLEId", BLEId);
+    bool printed = cJSON_PrintPreallocated(output, frame, sizeof(frame), false);
+    cJSON_Delete(output);
+    JsonArenaEnd(&DefinedInDBArena);
+
+    if (printed) {
+      int sent = esp_websocket_client_send_text(CLIENT, frame, strlen(frame), portMAX_DELAY);
+      ESP_LOGI(TAG, "%s --> %s = %d bytes", method, path, sent);
+    }
+    PowerRelease(POWER_LOCK_NETWORK);
     vTaskDelay(pdMS_TO_TICKS(5000));
   }
 }
 
+//{
+//   "id": "unique appliance id"
+//   "method" : *method,
+//   "params" : {
+//     "input" : {
+//       "json" : {
+//         *data
+//       }
+//     },
+//     "path" : *path
+//   }
+//}
+bool WebsocketBuildFrame(JsonArena *arena, const WebSocketMessage *msg, char *frame, size_t size) {
+  char id[256];
+  snprintf(id, sizeof(id), "%s::%s", ID, msg->path);
+
+  JsonArenaBegin(arena);
+  cJSON *output = cJSON_CreateObject();
+  cJSON *params = cJSON_AddObjectToObject(output, "params");
+  cJSON *input = cJSON_AddObjectToObject(params, "input");
+  cJSON_AddStringToObject(output, "id", id);
+  cJSON_AddStringToObject(output, "method", msg->method);
+  cJSON_AddStringToObject(params, "path", msg->path);
+  cJSON_AddItemToObject(input, "json", cJSON_ParseWithLength(msg->dataString.string, msg->dataString.length));
+  bool printed = cJSON_PrintPreallocated(output, frame, size, false);
+  cJSON_Delete(output);
+  JsonArenaEnd(arena);
+  return printed;
+}
+
 static void WebsocketTask(void *pvParameters) {
   esp_websocket_client_config_t websocket_cfg = {
-      .uri = "ws://10.0.0.146",
-      .port = 3001,
+      .uri = uri,
   };
-  ESP_LOGI(TAG, "Connecting to %s:%d", websocket_cfg.uri, websocket_cfg.port);
+  ESP_LOGI(TAG, "Connecting to %s", websocket_cfg.uri);
 
   CLIENT = esp_websocket_client_init(&websocket_cfg);
   esp_websocket_register_events(CLIENT, WEBSOCKET_EVENT_ANY, websocket_event_handler, (void *)CLIENT);
   esp_websocket_client_start(CLIENT);
 
-  WebSocketMessage msg;
-
-  //{
-  //   "id": "unique appliance id"
-  //   "method" : *method,
-  //   "params" : {
-  //     "input" : {
-  //       "json" : {
-  //         *data
-  //       }
-  //     },
-  //     "path" : *path
-  //   }
-  //}
-
-  cJSON *output = cJSON_CreateObject();
-  cJSON_AddStringToObject(output, "id", ID);
-  cJSON *params = cJSON_CreateObject();
-  cJSON_AddItemToObject(output, "params", params);
-  cJSON *input = cJSON_CreateObject();
-  cJSON_AddItemToObject(params, "input", input);
-  cJSON_AddStringToObject(output, "method", "unknown");
-  cJSON_AddStringToObject(params, "path", "unknown");
-  cJSON_AddStringToObject(input, "json", "unknown");
-  char id[256] = "";
+  WebSocketMessage *msg;
+  static char frame[WEBSOCKET_FRAME_LENGTH];
 
   while (true) {
     xEventGroupWaitBits(DeviceStatus, WEBSOCKET_READY, pdFALSE, pdTRUE, portMAX_DELAY);
     xQueueReceive(WebsocketQueue, &msg, portMAX_DELAY);  // Guaranteed to have an item
-    sprintf(id, "%s::%s", ID, msg.path);
-    cJSON_ReplaceItemInObjectCaseSensitive(output, "id", cJSON_CreateString(id));
-    cJSON_ReplaceItemInObjectCaseSensitive(output, "method", cJSON_CreateString(msg.method));
-    cJSON_ReplaceItemInObjectCaseSensitive(params, "path", cJSON_CreateString(msg.path));
-
-    cJSON *data = cJSON_ParseWithLength(msg.dataString.string, msg.dataString.length);
-    cJSON_ReplaceItemInObjectCaseSensitive(input, "json", data);
-
-    char *json_str = cJSON_Print(output);
-    int len = strlen(json_str);
-    int sent = esp_websocket_client_send_text(CLIENT, json_str, len, portMAX_DELAY);
-    ESP_LOGI(TAG, "%s --> %s = %d bytes", msg.method, msg.path, sent);
-    cJSON_free(json_str);
+    PowerAcquire(POWER_LOCK_NETWORK);
+    if (WebsocketBuildFrame(&WebsocketSendArena, msg, frame, sizeof(frame))) {
+      int sent = esp_websocket_client_send_text(CLIENT, frame, strlen(frame), portMAX_DELAY);
+      Trace(TRACE_WEBSOCKET_SEND, msg->seq);
+      BINLOGI(TAG, "%s --> %s = %d bytes", msg->methodName, msg->pathName, sent);
+    } else {
+      ESP_LOGE(TAG, "%s does not fit in a %d byte frame, dropping it", msg->path, WEBSOCKET_FRAME_LENGTH);
+    }
+    BufferRelease(msg);
+    PowerRelease(POWER_LOCK_NETWORK);
 
-    ESP_LOGI(TAG, "Websocket ready: %d", xEventGroupGetBits(DeviceStatus) & WEBSOCKET_READY);
+    BINLOGI(TAG, "Websocket ready: %d", xEventGroupGetBits(DeviceStatus) & WEBSOCKET_READY);
   }
-  cJSON_Delete(output);
   esp_websocket_client_stop(CLIENT);
   ESP_LOGE(TAG, "Websocket Stopped");
   esp_websocket_client_destroy(CLIENT);
 }
 
 void SetupWebsocket() {
-  WebsocketQueue = xQueueCreate(1, sizeof(WebSocketMessage));
+  FlashStringFallback(NVS_TYPE_STR, WEBSOCKET_URI_KEY, uri, sizeof(uri), DEFAULT_WEBSOCKET_URI);
+  BufferPoolCreate(TAG, &WebsocketPool, "WebsocketPool", WebsocketPoolBlocks, sizeof(WebSocketMessage), WEBSOCKET_POOL_SIZE, WebsocketPoolRefs,
+                   WebsocketPoolFreeListStorage, &WebsocketPoolFreeListBuffer);
+  BufferPoolCreate(TAG, &JSONStringPool, "JSONStringPool", JSONStringPoolBlocks, sizeof(JSONString), JSON_STRING_POOL_SIZE, JSONStringPoolRefs,
+                   JSONStringPoolFreeListStorage, &JSONStringPoolFreeListBuffer);
+  WebsocketQueue = BudgetCreateQueue(TAG, "WebsocketQueue", 1, sizeof(WebSocketMessage *), WebsocketQueueStorage, &WebsocketQueueBuffer);
   if (WebsocketQueue == NULL) {
     ESP_LOGE(TAG, "Failed to create WebsocketQueue");
   }
 
-  xTaskCreate(WebsocketTask, "WebsocketTask", 4096, NULL, 3, &Websocket);
-  xTaskCreate(DefinedInDBTask, "DefinedInDBTask", 4096, NULL, 3, &DefinedInDB);
+  Websocket = BudgetCreateTask(TAG, WebsocketTask, "WebsocketTask", WEBSOCKET_STACK, NULL, WEBSOCKET_PRIORITY, WEBSOCKET_CORE, WebsocketStack,
+                               &WebsocketTCB);
+  DefinedInDB = BudgetCreateTask(TAG, DefinedInDBTask, "DefinedInDBTask", DEFINED_IN_DB_STACK, NULL, DEFINED_IN_DB_PRIORITY,
+                                 DEFINED_IN_DB_CORE, DefinedInDBStack, &DefinedInDBTCB);
 
-  SHUTDOWN_TIMER = xTimerCreate("Websocket shutdown timer", pdMS_TO_TICKS(WEBSOCKET_TIMEOUT * 1000), pdTRUE, NULL, shutdown_signaler);
-  START_TIMER = xTimerCreate("Websocket start timer", pdMS_TO_TICKS(1000), pdTRUE, NULL, start_signaler);
+  SHUTDOWN_TIMER = BudgetCreateTimer(TAG, "Websocket shutdown timer", pdMS_TO_TICKS(WEBSOCKET_TIMEOUT * 1000), pdTRUE, shutdown_signaler,
+                                     &ShutdownTimerBuffer);
+  START_TIMER = BudgetCreateTimer(TAG, "Websocket start timer", pdMS_TO_TICKS(1000), pdTRUE, start_signaler, &StartTimerBuffer);
   xTimerStart(START_TIMER, portMAX_DELAY);
 }
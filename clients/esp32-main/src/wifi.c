@@ -1,44 +1,154 @@
 #include "wifi.h"
 
+#include <stdio.h>
 #include <string.h>
 
+#include "boot.h"
 #include "config.h"
+#include "console.h"
+#include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "flash.h"
+#include "power.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "nvs.h"
 
 #define TAG "WIFI"
 
+typedef struct WifiCache {
+  uint8_t ssid[32];  // the cache only applies while the credentials point at the same network
+  uint8_t bssid[6];
+  uint8_t channel;
+} WifiCache;
+
+static wifi_config_t wifi_config;
+static WifiCache cache;
+static bool cache_valid;
+static bool fast_attempt;
+static uint32_t backoff_attempt;
+static int64_t disconnected_at;
+static esp_timer_handle_t reconnect_timer;
+static WifiStats stats;
+static portMUX_TYPE statsLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Tries the cached access point first, a miss drops back to scanning every channel until the next IP
+static void WifiConnect(void) {
+  fast_attempt = cache_valid && memcmp(cache.ssid, wifi_config.sta.ssid, sizeof(cache.ssid)) == 0;
+  if (fast_attempt) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+    wifi_config.sta.channel = cache.channel;
+    wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+  } else {
+    wifi_config.sta.bssid_set = false;
+    wifi_config.sta.channel = 0;
+    wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+  }
+
+  portENTER_CRITICAL(&statsLock);
+  stats.attempts++;
+  if (!fast_attempt) stats.fullScans++;
+  portEXIT_CRITICAL(&statsLock);
+
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  esp_err_t err = esp_wifi_connect();
+  if (err != ESP_OK) ESP_LOGE(TAG, "Failed to connect: %s", esp_err_to_name(err));
+}
+
+static void WifiReconnect(void *args) { WifiConnect(); }
+
+static void ScheduleReconnect(void) {
+  uint32_t delay = WIFI_BACKOFF_MAX_MS;
+  if (backoff_attempt < 16 && (WIFI_BACKOFF_MIN_MS << backoff_attempt) < WIFI_BACKOFF_MAX_MS) {
+    delay = WIFI_BACKOFF_MIN_MS << backoff_attempt;
+  }
+  backoff_attempt++;
+  esp_timer_stop(reconnect_timer);
+  esp_timer_start_once(reconnect_timer, (uint64_t)delay * 1000);
+  ESP_LOGI(TAG, "Reconnecting in %d ms", delay);
+}
+
+// Only touches flash when we landed on a different access point
+static void SaveCache(void) {
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+  if (cache_valid && memcmp(cache.ssid, wifi_config.sta.ssid, sizeof(cache.ssid)) == 0 &&
+      memcmp(cache.bssid, ap.bssid, sizeof(cache.bssid)) == 0 && cache.channel == ap.primary) {
+    return;
+  }
+  memcpy(cache.ssid, wifi_config.sta.ssid, sizeof(cache.ssid));
+  memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+  cache.channel = ap.primary;
+  cache_valid = true;
+  FlashSet(NVS_TYPE_BLOB, WIFI_CACHE_KEY, &cache, sizeof(cache));
+}
+
 static void WifiEventHandler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
-  switch (event_id) {
-    case WIFI_EVENT_STA_START:
-      ESP_LOGI(TAG, "WIFI STARTED");
-      esp_wifi_connect();
-      break;
-    case WIFI_EVENT_STA_DISCONNECTED:
-      ESP_LOGI(TAG, "WIFI DISCONNECTED");
-      esp_wifi_connect();
-      xEventGroupClearBits(DeviceStatus, WIFI_CONNECTED);
-      break;
-    case IP_EVENT_STA_GOT_IP:
-      ESP_LOGI(TAG, "WIFI ACTIVE");
-      xEventGroupSetBits(DeviceStatus, WIFI_CONNECTED);
-      break;
-    default:
-      break;
+  int64_t now = esp_timer_get_time();
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    ESP_LOGI(TAG, "WIFI STARTED");
+    backoff_attempt = 0;
+    WifiConnect();
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+    ESP_LOGI(TAG, "WIFI DISCONNECTED reason: %d", event->reason);
+    bool was_connected = xEventGroupClearBits(DeviceStatus, WIFI_CONNECTED) & WIFI_CONNECTED;
+    if (was_connected) disconnected_at = now;
+    if (event->reason == WIFI_REASON_ASSOC_LEAVE) return;  // We asked for this through esp_wifi_stop or esp_wifi_disconnect
+
+    if (was_connected) {
+      WifiConnect();  // The access point was fine a moment ago, go straight back to it
+    } else if (fast_attempt) {
+      ESP_LOGW(TAG, "Cached access point failed, scanning all channels");
+      cache_valid = false;
+      WifiConnect();
+    } else {
+      ScheduleReconnect();
+    }
+  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+    ESP_LOGI(TAG, "WIFI ACTIVE");
+    backoff_attempt = 0;
+
+    portENTER_CRITICAL(&statsLock);
+    if (fast_attempt) stats.fastConnects++;
+    if (stats.bootToConnectedUs == 0) {
+      stats.bootToConnectedUs = now;
+    } else if (disconnected_at != 0) {
+      stats.reconnects++;
+      stats.lastReconnectUs = now - disconnected_at;
+      if (stats.lastReconnectUs > stats.maxReconnectUs) stats.maxReconnectUs = stats.lastReconnectUs;
+    }
+    portEXIT_CRITICAL(&statsLock);
+
+    if (disconnected_at != 0) {
+      ESP_LOGI(TAG, "Reconnected %lld ms after the disconnect", (now - disconnected_at) / 1000);
+    } else {
+      ESP_LOGI(TAG, "Connected %lld ms after boot", now / 1000);
+    }
+    disconnected_at = 0;
+    SaveCache();
+    xEventGroupSetBits(DeviceStatus, WIFI_CONNECTED);
+    BootMark(BOOT_WIFI_CONNECTED);
   }
 }
 
 void SetWifiCreds(char *ssid, char *pass) {
   FlashSet(NVS_TYPE_STR, WIFI_SSID_KEY, ssid, 32);
   FlashSet(NVS_TYPE_STR, WIFI_PASS_KEY, pass, 32);
+  esp_timer_stop(reconnect_timer);
   esp_wifi_stop();
 
-  wifi_config_t wifi_config = {.sta = {.threshold.authmode = WIFI_AUTH_WPA2_PSK, .pmf_cfg = {.capable = true, .required = false}}};
-  memcpy(wifi_config.sta.ssid, ssid, 32);
-  memcpy(wifi_config.sta.password, pass, 32);
+  memset(&wifi_config, 0, sizeof(wifi_config));
+  wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+  wifi_config.sta.pmf_cfg.capable = true;
+  wifi_config.sta.pmf_cfg.required = false;
+  wifi_config.sta.listen_interval = POWER_IDLE_LISTEN_INTERVAL;  // Only used under WIFI_PS_MAX_MODEM
+  strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+  strncpy((char *)wifi_config.sta.password, pass, sizeof(wifi_config.sta.password));
 
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
@@ -46,23 +156,90 @@ void SetWifiCreds(char *ssid, char *pass) {
   ESP_LOGI(TAG, "Connecting to wifi: %s pass: %s", ssid, pass);
 }
 
+// Static addressing is opt in, the keys are read straight from nvs so a missing key is not logged as an error
+static bool LoadStaticIp(esp_netif_ip_info_t *ip_info) {
+  char ip[16], netmask[16], gateway[16];
+  size_t ip_size = sizeof(ip), netmask_size = sizeof(netmask), gateway_size = sizeof(gateway);
+  nvs_handle_t nvs;
+  bool found;
+
+  if (nvs_open(NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+  found = nvs_get_str(nvs, WIFI_STATIC_IP_KEY, ip, &ip_size) == ESP_OK &&
+          nvs_get_str(nvs, WIFI_STATIC_NETMASK_KEY, netmask, &netmask_size) == ESP_OK &&
+          nvs_get_str(nvs, WIFI_STATIC_GATEWAY_KEY, gateway, &gateway_size) == ESP_OK;
+  nvs_close(nvs);
+  if (!found) return false;
+
+  if (esp_netif_str_to_ip4(ip, &ip_info->ip) != ESP_OK || esp_netif_str_to_ip4(netmask, &ip_info->netmask) != ESP_OK ||
+      esp_netif_str_to_ip4(gateway, &ip_info->gw) != ESP_OK) {
+    ESP_LOGE(TAG, "Static ip %s/%s via %s is invalid, using DHCP", ip, netmask, gateway);
+    return false;
+  }
+  return true;
+}
+
+void WifiGetStats(WifiStats *out) {
+  portENTER_CRITICAL(&statsLock);
+  *out = stats;
+  portEXIT_CRITICAL(&statsLock);
+}
+
+static int WifiStatsConsoleCmd(int argc, char **argv) {
+  WifiStats s;
+  WifiGetStats(&s);
+  printf("boot to connected: %lld ms\n", s.bootToConnectedUs / 1000);
+  printf("reconnects: %u, last: %lld ms, max: %lld ms\n", s.reconnects, s.lastReconnectUs / 1000, s.maxReconnectUs / 1000);
+  printf("attempts: %u, fast connects: %u, full scans: %u\n", s.attempts, s.fastConnects, s.fullScans);
+  if (cache_valid) {
+    printf("cached access point: %02x:%02x:%02x:%02x:%02x:%02x channel %d\n", cache.bssid[0], cache.bssid[1], cache.bssid[2],
+           cache.bssid[3], cache.bssid[4], cache.bssid[5], cache.channel);
+  }
+  return 0;
+}
+
+static void RegisterWifi(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "wifi",
+      .help = "Get wifi connection timings",
+      .hint = NULL,
+      .func = &WifiStatsConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
+
 void SetupWifi(void) {
   ESP_LOGD(TAG, "Setting up wifi");
   ESP_ERROR_CHECK(esp_netif_init());
 
   ESP_ERROR_CHECK(esp_event_loop_create_default());
-  esp_netif_create_default_wifi_sta();
+  esp_netif_t *netif = esp_netif_create_default_wifi_sta();
+
+  esp_netif_ip_info_t ip_info;
+  if (LoadStaticIp(&ip_info)) {
+    esp_netif_dns_info_t dns = {.ip.type = ESP_IPADDR_TYPE_V4, .ip.u_addr.ip4 = ip_info.gw};
+    esp_netif_dhcpc_stop(netif);
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
+    esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+    ESP_LOGI(TAG, "Using static ip " IPSTR, IP2STR(&ip_info.ip));
+  }
 
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(ESP_EVENT_ANY_BASE, ESP_EVENT_ANY_ID, &WifiEventHandler, NULL, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiEventHandler, NULL, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &WifiEventHandler, NULL, NULL));
+
+  const esp_timer_create_args_t timer_args = {.callback = &WifiReconnect, .name = "WifiReconnect"};
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &reconnect_timer));
+
+  cache_valid = FlashGet(NVS_TYPE_BLOB, WIFI_CACHE_KEY, &cache, sizeof(cache)) == ESP_OK;
 
   char wifi_ssid[32];
   char wifi_pass[32];
   FlashStringFallback(NVS_TYPE_STR, WIFI_SSID_KEY, wifi_ssid, 32, DEFAULT_WIFI_SSID);
   FlashStringFallback(NVS_TYPE_STR, WIFI_PASS_KEY, wifi_pass, 32, DEFAULT_WIFI_PASS);
   SetWifiCreds(wifi_ssid, wifi_pass);
+  RegisterWifi();
 
   ESP_LOGD(TAG, "Wifi setup complete");
 }
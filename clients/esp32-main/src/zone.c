@@ -0,0 +1,48 @@
+#include "zone.h"
+
+#include <stdio.h>
+
+#include "config.h"
+#include "console.h"
+#include "cooking_controller.h"
+#include "esp_console.h"
+#include "relay_controller.h"
+#include "temperature_sensor.h"
+
+const ZoneConfig Zones[ZONE_COUNT] = {
+    {"oven", TEMP_SENSOR_CS, TOP_HEATING_ELEMENT, BOTTOM_HEATING_ELEMENT, CONVECTION_FAN, ROTISERRIE},
+#if ZONE_COUNT > 1
+    {"zone 1", ZONE1_TEMP_SENSOR_CS, ZONE1_TOP_HEATING_ELEMENT, ZONE1_BOTTOM_HEATING_ELEMENT, 0, 0},
+#endif
+#if ZONE_COUNT > 2
+    {"zone 2", ZONE2_TEMP_SENSOR_CS, ZONE2_HEATING_ELEMENT, 0, 0, 0},
+#endif
+};
+
+static int ZoneConsoleCmd(int argc, char **argv) {
+  Temperature temp;
+  CookingState cooking;
+  EventBits_t relays = xEventGroupGetBits(RelayControllerFlags);
+
+  for (int zone = 0; zone < ZONE_COUNT; zone++) {
+    TempSensorGetLatest(zone, &temp);
+    CookingControllerGetState(zone, &cooking);
+    printf("%d %-8s %4d C | %4d F, relays 0x%02x", zone, Zones[zone].name, temp.c, temp.f, relays & ZONE_RELAYS(&Zones[zone]));
+    if (cooking.temperatureUnit) {
+      printf(", cooking at %d %c, %d s left\n", cooking.setpoint, cooking.temperatureUnit, cooking.remainingSeconds);
+    } else {
+      printf(", idle\n");
+    }
+  }
+  return 0;
+}
+
+void RegisterZones(void) {
+  const esp_console_cmd_t cmd = {
+      .command = "zone",
+      .help = "Get each zone's temperature, relay outputs and cook",
+      .hint = NULL,
+      .func = &ZoneConsoleCmd,
+  };
+  ESP_ERROR_CHECK(ConsoleRegister(&cmd));
+}
@@ -0,0 +1,23 @@
+#include <unity.h>
+
+#include "bench.h"
+#include "boot.h"
+#include "json_arena.h"
+
+// On-target run of the "bench" table, "pio test -e pico32". Boots the whole firmware first so every benchmark sees
+// the same tasks and peripherals it does in the field. Save a baseline with "bench -s" from the console beforehand
+// for the regression check to mean anything.
+
+static void TestBenchNoRegression(void) {
+  uint32_t jsonAllocs = JsonHeapAllocations();
+  TEST_ASSERT_EQUAL_INT_MESSAGE(0, BenchRunAll(NULL, BENCH_DEFAULT_ITERATIONS, false), "p50 slower than the saved baseline");
+  // The envelope and recipe decode benchmarks build and parse inside an arena, so cJSON should never reach the heap
+  TEST_ASSERT_EQUAL_UINT32_MESSAGE(jsonAllocs, JsonHeapAllocations(), "cJSON fell back to the heap");
+}
+
+void app_main() {
+  AppStart();
+  UNITY_BEGIN();
+  RUN_TEST(TestBenchNoRegression);
+  UNITY_END();
+}
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Turns raw binlog records back into log lines, see include/binlog.h. Console text around the records passes through.
+
+    binlog -r                                                             (on the device console)
+    python tools/binlog_decode.py .pio/build/pico32/firmware.elf --port /dev/ttyUSB0
+
+Needs pyelftools, and pyserial for --port. The ELF must be the one the device is running.
+"""
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+SYNC = b"\xa5\x5a"
+HEADER = struct.Struct("<IBBII")  # time us, level, arg count, tag address, format address
+LEVELS = "NEWIDV"
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z)?([diouxXcsp%])")
+
+
+class Strings:
+    """Reads NUL terminated strings out of the ELF's loadable sections by address."""
+
+    def __init__(self, path):
+        self.sections = []
+        with open(path, "rb") as f:
+            for section in ELFFile(f).iter_sections():
+                if section["sh_addr"] and section["sh_type"] == "SHT_PROGBITS":
+                    self.sections.append((section["sh_addr"], section.data()))
+        self.cache = {}
+
+    def get(self, address):
+        if address not in self.cache:
+            self.cache[address] = "<0x%08x>" % address
+            for start, data in self.sections:
+                if start <= address < start + len(data):
+                    end = data.index(b"\0", address - start)
+                    self.cache[address] = data[address - start:end].decode(errors="replace")
+                    break
+        return self.cache[address]
+
+
+def format_record(strings, format_string, args):
+    args = list(args)
+
+    def convert(match):
+        flags, kind = match.groups()
+        if kind == "%":
+            return "%"
+        value = args.pop(0) if args else 0
+        if kind in "di":
+            value = struct.unpack("<i", struct.pack("<I", value))[0]
+        elif kind == "s":
+            value = strings.get(value)
+        elif kind == "c":
+            value = chr(value & 0xFF)
+        elif kind == "p":
+            return "0x%08x" % value
+        elif kind == "u":
+            kind = "d"
+        return ("%" + flags + kind) % value
+
+    return CONVERSION.sub(convert, format_string)
+
+
+def decode(read, strings, out):
+    buffer = b""
+    while True:
+        chunk = read()
+        if not chunk:
+            break
+        buffer += chunk
+        while True:
+            start = buffer.find(SYNC)
+            if start < 0:
+                keep = 1 if buffer.endswith(SYNC[:1]) else 0
+                out.write(buffer[:len(buffer) - keep].decode(errors="replace"))
+                buffer = buffer[len(buffer) - keep:]
+                break
+            out.write(buffer[:start].decode(errors="replace"))
+            buffer = buffer[start:]
+            if len(buffer) < len(SYNC) + HEADER.size:
+                break
+            time_us, level, count, tag, format_address = HEADER.unpack_from(buffer, len(SYNC))
+            length = len(SYNC) + HEADER.size + 4 * count
+            if len(buffer) < length:
+                break
+            args = struct.unpack_from("<%dI" % count, buffer, len(SYNC) + HEADER.size)
+            buffer = buffer[length:]
+            message = format_record(strings, strings.get(format_address), args)
+            out.write("%s (%u) %s: %s\n" % (LEVELS[level] if level < len(LEVELS) else "?", time_us // 1000, strings.get(tag), message))
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", help="firmware ELF the device is running")
+    parser.add_argument("--port", help="serial port to read, stdin when left out")
+    parser.add_argument("--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    strings = Strings(args.elf)
+    if args.port:
+        import serial
+
+        with serial.Serial(args.port, args.baud) as port:
+            decode(lambda: port.read(max(1, port.in_waiting)), strings, sys.stdout)
+    else:
+        decode(lambda: sys.stdin.buffer.read1(256), strings, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Soaks a board over its console and logs whether the heap fragments, see the json command in src/json_arena.c.
+
+    pio run -e simulation -t upload
+    python tools/heap_soak.py --port /dev/ttyUSB0 --hours 24 --cook 30 --csv soak.csv
+
+Every --interval seconds it asks for the json command and records the free heap, the largest free block and the cJSON
+allocations that missed an arena. With --cook it also starts a simulated bake of that many minutes whenever the
+previous one should be over, so the websocket, DB manager and LCD keep building messages for the whole run. Needs
+pyserial.
+"""
+import argparse
+import csv
+import re
+import sys
+import time
+
+FREE = re.compile(r"free heap: (\d+), largest free block: (\d+)")
+HEAP_ALLOCATIONS = re.compile(r"cJSON heap allocations outside an arena: (\d+)")
+SCALE = re.compile(r"time scale: (\d+)x")
+
+
+def command(port, line, timeout=2.0):
+    """Sends one console command and returns what the device printed until it went quiet."""
+    port.reset_input_buffer()
+    port.write(line.encode() + b"\r\n")
+    output = b""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        chunk = port.read(max(1, port.in_waiting))
+        if chunk:
+            output += chunk
+            deadline = time.monotonic() + 0.3
+    return output.decode(errors="replace")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", required=True, help="serial port of the board's console")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--hours", type=float, default=24)
+    parser.add_argument("--interval", type=float, default=60, help="seconds between samples")
+    parser.add_argument("--cook", type=int, help="keep simulated bakes of this many minutes running")
+    parser.add_argument("--csv", help="file to write the samples to, stdout when left out")
+    args = parser.parse_args()
+
+    import serial
+
+    out = open(args.csv, "w", newline="") if args.csv else sys.stdout
+    writer = csv.writer(out)
+    writer.writerow(["elapsed s", "free heap", "largest free block", "cJSON heap allocations"])
+    samples = []
+    next_cook = 0.0
+    start = time.monotonic()
+    with serial.Serial(args.port, args.baud, timeout=0.1) as port:
+        while time.monotonic() - start < args.hours * 3600:
+            elapsed = time.monotonic() - start
+            if args.cook and elapsed >= next_cook:
+                scale = SCALE.search(command(port, "sim -m %d" % args.cook))
+                # Real seconds the bake takes plus the rest before the zone takes the next one
+                next_cook = elapsed + args.cook * 60 / (int(scale.group(1)) if scale else 1) + 10
+            text = command(port, "json")
+            free, allocations = FREE.search(text), HEAP_ALLOCATIONS.search(text)
+            if free and allocations:
+                sample = (round(elapsed), int(free.group(1)), int(free.group(2)), int(allocations.group(1)))
+                samples.append(sample)
+                writer.writerow(sample)
+                out.flush()
+            else:
+                print("no json output at %d s" % elapsed, file=sys.stderr)
+            time.sleep(args.interval)
+
+    if not samples:
+        sys.exit("no samples")
+    largest = [s[2] for s in samples]
+    print("%d samples over %.1f h, largest free block first %d, lowest %d, last %d, cJSON heap allocations %d -> %d"
+          % (len(samples), samples[-1][0] / 3600, largest[0], min(largest), largest[-1], samples[0][3], samples[-1][3]),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
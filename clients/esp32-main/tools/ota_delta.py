@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Builds an OTA delta patch between two firmware images, see include/ota.h for the format.
+
+    python tools/ota_delta.py old/firmware.bin .pio/build/pico32/firmware.bin firmware.patch --verify
+
+The old image must be exactly what the device is running, the patch is rejected otherwise.
+"""
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"SEDP"
+VERSION = 1
+HASH_LENGTH = 32
+OP_END, OP_COPY, OP_DATA = 0, 1, 2
+BLOCK = 32    # Matches shorter than a block aren't worth the 9 byte COPY op
+MIN_COPY = 64
+
+
+def index_blocks(source):
+    index = {}
+    for offset in range(0, len(source) - BLOCK + 1, BLOCK):
+        index.setdefault(source[offset:offset + BLOCK], offset)
+    return index
+
+
+def diff(source, target):
+    """Greedy matcher: looks every target offset up in a table of aligned source blocks, then grows the match both ways."""
+    index = index_blocks(source)
+    ops = []
+    literal = 0
+    position = 0
+    while position <= len(target) - BLOCK:
+        offset = index.get(target[position:position + BLOCK])
+        if offset is None:
+            position += 1
+            continue
+        start, source_start = position, offset
+        while start > literal and source_start > 0 and target[start - 1] == source[source_start - 1]:
+            start -= 1
+            source_start -= 1
+        end, source_end = position + BLOCK, offset + BLOCK
+        while end < len(target) and source_end < len(source) and target[end] == source[source_end]:
+            end += 1
+            source_end += 1
+        if end - start < MIN_COPY:
+            position += 1
+            continue
+        if start > literal:
+            ops.append((OP_DATA, target[literal:start]))
+        ops.append((OP_COPY, source_start, end - start))
+        literal = position = end
+    if literal < len(target):
+        ops.append((OP_DATA, target[literal:]))
+    return ops
+
+
+def encode(source, target, ops):
+    out = bytearray(MAGIC)
+    out += struct.pack("<B", VERSION)
+    out += source[-HASH_LENGTH:]
+    out += hashlib.sha256(target).digest()
+    out += struct.pack("<I", len(target))
+    for op in ops:
+        if op[0] == OP_COPY:
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+        else:
+            out += struct.pack("<BI", OP_DATA, len(op[1])) + op[1]
+    out += struct.pack("<B", OP_END)
+    return bytes(out)
+
+
+def apply(source, patch):
+    """Same walk the firmware does, used by --verify."""
+    header = 4 + 1 + HASH_LENGTH * 2 + 4
+    if patch[:4] != MAGIC or patch[4] != VERSION:
+        raise ValueError("not a version %d patch" % VERSION)
+    if patch[5:5 + HASH_LENGTH] != source[-HASH_LENGTH:]:
+        raise ValueError("patch was built against a different image")
+    target_hash = patch[5 + HASH_LENGTH:5 + HASH_LENGTH * 2]
+    (size,) = struct.unpack_from("<I", patch, header - 4)
+    out = bytearray()
+    position = header
+    while True:
+        op = patch[position]
+        position += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", patch, position)
+            position += 8
+            out += source[offset:offset + length]
+        elif op == OP_DATA:
+            (length,) = struct.unpack_from("<I", patch, position)
+            position += 4
+            out += patch[position:position + length]
+            position += length
+        else:
+            raise ValueError("unknown op 0x%02x at %d" % (op, position - 1))
+    if len(out) != size or hashlib.sha256(out).digest() != target_hash:
+        raise ValueError("patched image does not match the target")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="image the device is running")
+    parser.add_argument("target", help="image to update to")
+    parser.add_argument("patch", help="patch file to write")
+    parser.add_argument("--verify", action="store_true", help="apply the patch to source and compare against target")
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        source = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+    if len(source) < HASH_LENGTH:
+        sys.exit("%s is too short to be a firmware image" % args.source)
+
+    ops = diff(source, target)
+    patch = encode(source, target, ops)
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+
+    copied = sum(op[2] for op in ops if op[0] == OP_COPY)
+    print("full image %d bytes, patch %d bytes (%.1f%% smaller), %d ops, %.1f%% copied from the running image"
+          % (len(target), len(patch), 100.0 * (1 - len(patch) / len(target)), len(ops), 100.0 * copied / len(target)))
+    if args.verify:
+        apply(source, patch)
+        print("verified")
+
+
+if __name__ == "__main__":
+    main()
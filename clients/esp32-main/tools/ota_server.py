@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+"""Serves firmware images and patches to devices on the local network and logs how much each update downloaded.
+
+    python tools/ota_server.py --dir .pio/build/pico32 --port 8070
+    ota -u http://<host>:8070/firmware.patch      (on the device console)
+"""
+import argparse
+import functools
+import http.server
+import time
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    def copyfile(self, source, outputfile):
+        start = time.monotonic()
+        sent = 0
+        while True:
+            chunk = source.read(16 * 1024)
+            if not chunk:
+                break
+            outputfile.write(chunk)
+            sent += len(chunk)
+        self.log_message("served %s, %d bytes in %.2fs", self.path, sent, time.monotonic() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--dir", default=".", help="directory to serve")
+    parser.add_argument("--port", type=int, default=8070)
+    args = parser.parse_args()
+    handler = functools.partial(Handler, directory=args.dir)
+    with http.server.ThreadingHTTPServer(("", args.port), handler) as server:
+        print("serving %s on port %d" % (args.dir, args.port))
+        server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -4,6 +4,9 @@ import { applianceTypes } from "./applianceConstants";
 
 export const IdSchema = z.string();
 
+// Zone of a multi zone appliance, single zone appliances only have zone 0
+export const ZoneSchema = z.number().int().min(0).default(0);
+
 export const TemperatureSchema = z.object({
   temperatureC: z.number(),
   temperatureF: z.number(),
@@ -13,6 +16,35 @@ export const TemperatureWithIdSchema = TemperatureSchema.extend({
   id: IdSchema,
 });
 
+export const ZoneTemperatureSchema = TemperatureSchema.extend({
+  zone: ZoneSchema,
+});
+
+export const ZoneTemperatureWithIdSchema = TemperatureWithIdSchema.extend({
+  zone: ZoneSchema,
+});
+
+export const ZoneWithIdSchema = z.object({
+  id: IdSchema,
+  zone: ZoneSchema,
+});
+
+// One relay's share of a finished cook, with its lifetime wear for maintenance
+export const RelayUsageSchema = z.object({
+  channel: z.number().int(),
+  onSeconds: z.number(),
+  cycles: z.number().int(),
+  energyWh: z.number(),
+  lifetimeCycles: z.number().int(),
+  lifetimeHours: z.number(),
+});
+
+// Older firmware sends only the id and zone
+export const CookingStopSchema = ZoneWithIdSchema.extend({
+  energyWh: z.number().optional(),
+  relays: z.array(RelayUsageSchema).optional(),
+});
+
 export const ApplianceSchema = TemperatureWithIdSchema.extend({
   name: z.string(),
   type: z.enum(applianceTypes),
@@ -28,12 +60,33 @@ export const ApplianceWithoutRecipeSchema = ApplianceSchema.omit({
 export const StatusMessageSchema = z.object({
   type: z.enum(["cookingStart", "cookingEnd", "alarm"]),
   message: z.string(),
+  zone: ZoneSchema,
 });
 
 export const StatusMessageWithIdSchema = StatusMessageSchema.extend({
   id: IdSchema,
 });
 
+export const DiagnosticsSchema = z.object({
+  uptime: z.number(),
+  heap: z.number(),
+  tasks: z.array(
+    z.object({ name: z.string(), cpu: z.number(), stack: z.number() })
+  ),
+  queues: z.array(
+    z.object({
+      name: z.string(),
+      depth: z.number(),
+      peak: z.number(),
+      failed: z.number(),
+    })
+  ),
+});
+
+export const DiagnosticsWithIdSchema = DiagnosticsSchema.extend({
+  id: IdSchema,
+});
+
 export const ApplianceInfoSchema = z.object({
   name: z.string(),
   type: z.enum(applianceTypes),
@@ -43,7 +96,10 @@ export const ApplianceInfoSchema = z.object({
 
 export type Appliance = z.infer<typeof ApplianceSchema>;
 export type Temperature = z.infer<typeof TemperatureSchema>;
+export type ZoneTemperature = z.infer<typeof ZoneTemperatureSchema>;
+export type RelayUsage = z.infer<typeof RelayUsageSchema>;
 export type StatusMessage = z.infer<typeof StatusMessageSchema>;
+export type Diagnostics = z.infer<typeof DiagnosticsSchema>;
 export type ApplianceWithoutRecipe = z.infer<
   typeof ApplianceWithoutRecipeSchema
 >;
@@ -2,10 +2,15 @@ import { z } from "zod";
 import {
   ApplianceSchema,
   ApplianceWithoutRecipeSchema,
-  Temperature,
-  TemperatureWithIdSchema,
+  ZoneTemperature,
+  ZoneTemperatureWithIdSchema,
+  ZoneWithIdSchema,
+  CookingStopSchema,
+  ZoneSchema,
   StatusMessageWithIdSchema,
   StatusMessage,
+  DiagnosticsWithIdSchema,
+  Diagnostics,
   IdSchema,
   defaultAppliance,
 } from "@safe-eats/types/applianceTypes";
@@ -17,6 +22,14 @@ import {
   cookingStartPushNotification,
 } from "../utils/pushNotifications";
 
+// Zone 0 lives on the Appliance row, the other zones of a multi zone appliance each get an ApplianceZone row
+const zoneKey = (applianceId: string, zone: number) => ({
+  applianceId_zone: { applianceId, zone },
+});
+
+const zoneName = (name: string, zone: number) =>
+  zone === 0 ? name : `${name} zone ${zone}`;
+
 export const applianceRouter = router({
   esp32Register: publicProcedure
     .input(z.object({ name: z.string(), id: z.string(), BLEId: z.string() }))
@@ -105,13 +118,12 @@ export const applianceRouter = router({
   onTemperatureUpdate: publicProcedure
     .input(IdSchema)
     .subscription(({ input: connectedApplianceId }) => {
-      return observable<Temperature>((emit) => {
+      return observable<ZoneTemperature>((emit) => {
         const listener = (val: unknown) => {
-          const { id, temperatureC, temperatureF } =
-            TemperatureWithIdSchema.parse(val);
+          const { id, ...temperature } = ZoneTemperatureWithIdSchema.parse(val);
           console.log(id, connectedApplianceId);
           if (id === connectedApplianceId) {
-            emit.next({ temperatureC, temperatureF });
+            emit.next(temperature);
           }
         };
         ee.on("temperatureUpdate", listener);
@@ -122,15 +134,20 @@ export const applianceRouter = router({
     }),
 
   updateTemperature: publicProcedure
-    .input(TemperatureWithIdSchema)
+    .input(ZoneTemperatureWithIdSchema)
     .mutation(async ({ input }) => {
       ee.emit("temperatureUpdate", input);
-      return await prisma.appliance.update({
-        where: { id: input.id },
-        data: {
-          temperatureC: input.temperatureC,
-          temperatureF: input.temperatureF,
-        },
+      const { id, zone, ...temperature } = input;
+      if (zone === 0) {
+        return await prisma.appliance.update({
+          where: { id },
+          data: temperature,
+        });
+      }
+      return await prisma.applianceZone.upsert({
+        where: zoneKey(id, zone),
+        create: { applianceId: id, zone, ...temperature },
+        update: temperature,
       });
     }),
 
@@ -139,9 +156,9 @@ export const applianceRouter = router({
     .subscription(({ input: connectedApplianceId }) => {
       return observable<StatusMessage>((emit) => {
         const listener = (val: unknown) => {
-          const { id, type, message } = StatusMessageWithIdSchema.parse(val);
+          const { id, ...status } = StatusMessageWithIdSchema.parse(val);
           if (id === connectedApplianceId) {
-            emit.next({ type, message });
+            emit.next(status);
           }
         };
         ee.on("statusUpdate", listener);
@@ -157,23 +174,63 @@ export const applianceRouter = router({
       ee.emit("statusUpdate", input);
     }),
 
+  onDiagnostics: publicProcedure
+    .input(IdSchema)
+    .subscription(({ input: connectedApplianceId }) => {
+      return observable<Diagnostics>((emit) => {
+        const listener = (val: unknown) => {
+          const { id, ...diagnostics } = DiagnosticsWithIdSchema.parse(val);
+          if (id === connectedApplianceId) {
+            emit.next(diagnostics);
+          }
+        };
+        ee.on("diagnostics", listener);
+        return () => {
+          ee.off("diagnostics", listener);
+        };
+      });
+    }),
+
+  diagnostics: publicProcedure
+    .input(DiagnosticsWithIdSchema)
+    .mutation(async ({ input }) => {
+      ee.emit("diagnostics", input);
+    }),
+
   cookingStop: publicProcedure
-    .input(z.object({ id: IdSchema }))
+    .input(CookingStopSchema)
     .mutation(async ({ input }) => {
-      const appliance = await prisma.appliance.update({
-        where: { id: input.id },
-        data: {
-          cookingStartTime: null,
-          recipe: {
-            disconnect: true,
-          },
+      const data = {
+        cookingStartTime: null,
+        recipe: {
+          disconnect: true,
         },
-      });
+      };
+      const applianceRow =
+        input.zone === 0
+          ? await prisma.appliance.update({ where: { id: input.id }, data })
+          : (
+              await prisma.applianceZone.update({
+                where: zoneKey(input.id, input.zone),
+                data,
+                include: { appliance: true },
+              })
+            ).appliance;
+      const appliance = {
+        ...applianceRow,
+        name: zoneName(applianceRow.name, input.zone),
+      };
 
       ee.emit("statusUpdate", {
         id: input.id,
         type: "cookingEnd",
-        message: `${appliance.name} has stopped cooking`,
+        message:
+          input.energyWh === undefined
+            ? `${appliance.name} has stopped cooking`
+            : `${appliance.name} has stopped cooking, using ${(
+                input.energyWh / 1000
+              ).toFixed(2)} kWh`,
+        zone: input.zone,
       });
 
       const expoPushTokensObjList = await prisma.user.findMany({
@@ -198,73 +255,100 @@ export const applianceRouter = router({
     }),
 
   setRecipe: publicProcedure
-    .input(z.object({ id: IdSchema, qrCode: z.string().uuid() }))
+    .input(
+      z.object({ id: IdSchema, qrCode: z.string().uuid(), zone: ZoneSchema })
+    )
     .mutation(async ({ input }) => {
+      // QR code ids are stored lowercase, see qrCodeRouter
       const qrCode = await prisma.qRCode.findUnique({
-        where: { id: input.qrCode },
+        where: { id: input.qrCode.toLowerCase() },
       });
       if (!qrCode) {
         throw new Error("Invalid QR Code");
       }
       // await prisma.qRCode.delete({ where: { id: input.qrCode } });
-      const appliance = await prisma.appliance.update({
-        where: { id: input.id },
-        data: {
-          recipe: {
-            connect: {
-              id: qrCode.recipeId,
-            },
+      const data = {
+        recipe: {
+          connect: {
+            id: qrCode.recipeId,
           },
         },
-        include: {
-          recipe: true,
-        },
-      });
+      };
+      const { recipe } =
+        input.zone === 0
+          ? await prisma.appliance.update({
+              where: { id: input.id },
+              data,
+              include: { recipe: true },
+            })
+          : await prisma.applianceZone.upsert({
+              where: zoneKey(input.id, input.zone),
+              create: {
+                applianceId: input.id,
+                zone: input.zone,
+                recipeId: qrCode.recipeId,
+              },
+              update: data,
+              include: { recipe: true },
+            });
 
-      if (!appliance || !appliance.recipe) {
+      if (!recipe) {
         throw new Error("Invalid Appliance");
       }
 
-      appliance.recipe.expiryDate += qrCode.createdAt.getTime();
+      recipe.expiryDate += qrCode.createdAt.getTime();
 
-      if (appliance.recipe.expiryDate < Date.now()) {
+      if (recipe.expiryDate < Date.now()) {
         console.log("Recipe has expired");
         const emitVal = {
           id: input.id,
           type: "alarm",
-          message: `${appliance.recipe.name} is expired`,
+          message: `${recipe.name} is expired`,
+          zone: input.zone,
         };
         ee.emit("statusUpdate", emitVal);
         // throw new Error("Recipe has expired");
       }
 
-      return appliance.recipe;
+      // The appliance routes the recipe by the zone it asked for
+      return { ...recipe, zone: input.zone };
     }),
 
   cookingStart: publicProcedure
-    .input(z.object({ id: IdSchema }))
+    .input(ZoneWithIdSchema)
     .mutation(async ({ input }) => {
-      const appliance = await prisma.appliance.findUnique({
+      const applianceRow = await prisma.appliance.findUnique({
         where: { id: input.id },
         include: {
           recipe: true,
+          zones: { where: { zone: input.zone }, include: { recipe: true } },
         },
       });
 
-      if (!appliance) {
+      if (!applianceRow) {
         throw new Error("Appliance not found");
       }
 
-      if (!appliance.recipe) {
+      const recipe =
+        input.zone === 0 ? applianceRow.recipe : applianceRow.zones[0]?.recipe;
+      if (!recipe) {
         throw new Error("Appliance has no recipe assigned to it");
       }
+      const appliance = {
+        ...applianceRow,
+        name: zoneName(applianceRow.name, input.zone),
+        recipe,
+      };
 
-      await prisma.appliance.update({
-        where: { id: input.id },
-        data: {
-          cookingStartTime: new Date(),
-        },
-      });
+      const data = { cookingStartTime: new Date() };
+      if (input.zone === 0) {
+        await prisma.appliance.update({ where: { id: input.id }, data });
+      } else {
+        await prisma.applianceZone.update({
+          where: zoneKey(input.id, input.zone),
+          data,
+        });
+      }
 
       const expoPushTokensObjList = await prisma.user.findMany({
         where: {
@@ -283,6 +367,7 @@ export const applianceRouter = router({
         id: input.id,
         type: "cookingStart",
         message: `${appliance.name} is cooking ${appliance.recipe.name}`,
+        zone: input.zone,
       });
 
       const expoPushTokens = expoPushTokensObjList
@@ -6,22 +6,31 @@ import { authedProcedure, router } from "../utils/trpc";
 import { qrCodeSchema } from "@safe-eats/types/qrCodeTypes";
 import { prisma } from "@safe-eats/db";
 
+// Labels may be printed with uppercase UUIDs but appliances send the code back lowercase, ids are stored lowercase
+const qrCodeId = (id: string) => id.toLowerCase();
+
 export const qrCodeRouter = router({
   add: authedProcedure.input(qrCodeSchema).mutation(async ({ input }) => {
-    return await prisma.qRCode.create({ data: input });
+    return await prisma.qRCode.create({
+      data: { ...input, id: qrCodeId(input.id) },
+    });
   }),
 
   get: authedProcedure.input(z.string().uuid()).query(async ({ input }) => {
-    return await prisma.qRCode.findUnique({ where: { id: input } });
+    return await prisma.qRCode.findUnique({ where: { id: qrCodeId(input) } });
   }),
 
   delete: authedProcedure
     .input(z.string().uuid())
     .mutation(async ({ input }) => {
-      return await prisma.qRCode.delete({ where: { id: input } });
+      return await prisma.qRCode.delete({ where: { id: qrCodeId(input) } });
     }),
 
   update: authedProcedure.input(qrCodeSchema).mutation(async ({ input }) => {
-    return await prisma.qRCode.update({ where: { id: input.id }, data: input });
+    const id = qrCodeId(input.id);
+    return await prisma.qRCode.update({
+      where: { id },
+      data: { ...input, id },
+    });
   }),
 });